@@ -0,0 +1,55 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * The DMLocationManagerBenchmark measures the hot path of the DMLocationManager with synthetic locations, no device or core location needed.
+ * It is not part of the pod, add the Benchmarks directory and the sources of the pod to a host app or test target and run it off the main thread:
+ *
+ *		NSString* path = [documentsDirectory stringByAppendingPathComponent:@"benchmark.json"];
+ *		NSDictionary* results = [DMLocationManagerBenchmark runWithOutputPath:path];
+ *
+ * The results are written as JSON to compare them between versions:
+ *
+ *		{"version": 1, "date": "...", "benchmarks": [{"name": "sample", "parameter": 0, "iterations": 100000, "nanosecondsPerOperation": 850.2, "allocationsPerOperation": 3.0}, ...]}
+ *
+ * The benchmarks:
+ *
+ *		sample		Cost per raw location through the filters of a running query, which does not reach the desired accuracy
+ *		fanOut		Cost per location delivered to the amount of subscribed delegates given as parameter
+ *		loopCycle	Cost per cycle of the loop, restarting the query, determining the location and rearming the timers
+ *
+ * Allocations are counted on all threads while a benchmark runs. The benchmark uses its own DMLocationManager instances
+ * processing in background, but they share the persisted location of the app which is cleared.
+ */
+
+#pragma mark -
+#pragma mark DMLocationManagerBenchmark
+
+@interface DMLocationManagerBenchmark : NSObject
+
+/**
+ * Run all benchmarks and write the results as JSON to the path, if not nil. Returns the results.
+ */
++ (NSDictionary*)runWithOutputPath:(NSString*)path;
+
+/**
+ * Run a single benchmark with the amount of iterations. Returns the result of the benchmark.
+ */
++ (NSDictionary*)runBenchmark:(NSString*)name parameter:(NSUInteger)parameter iterations:(NSUInteger)iterations;
+
+@end
@@ -0,0 +1,271 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationManagerBenchmark.h"
+#import "DMLocationManager.h"
+#import "DMLocationSource.h"
+#include <mach/mach_time.h>
+
+#define DM_LOCATION_MANAGER_BENCHMARK_VERSION		1
+#define DM_LOCATION_MANAGER_BENCHMARK_LOCATIONS		1024
+#define DM_LOCATION_MANAGER_BENCHMARK_WARM_UP		1000
+
+// The malloc logger of libmalloc is informed about every allocation on any thread, it is what Instruments uses
+#define DM_LOCATION_MANAGER_BENCHMARK_MALLOC_ALLOCATE	2
+
+typedef void (*DMLocationManagerBenchmarkMallocLogger)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t skippedFrames);
+extern DMLocationManagerBenchmarkMallocLogger malloc_logger;
+
+static int64_t DMLocationManagerBenchmarkAllocations = 0;
+
+static void DMLocationManagerBenchmarkCountAllocation(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t skippedFrames)
+{
+	if (type & DM_LOCATION_MANAGER_BENCHMARK_MALLOC_ALLOCATE)
+		__atomic_add_fetch(&DMLocationManagerBenchmarkAllocations, 1, __ATOMIC_RELAXED);
+}
+
+static double DMLocationManagerBenchmarkNanoseconds(uint64_t duration)
+{
+	static mach_timebase_info_data_t timebase;
+	
+	if (0 == timebase.denom)
+		mach_timebase_info(&timebase);
+	
+	return (double)duration * timebase.numer / timebase.denom;
+}
+
+
+#pragma mark -
+#pragma mark DMLocationManagerBenchmarkSource
+
+/**
+ * A source which does nothing, the benchmark passes the locations to the manager itself.
+ */
+@interface DMLocationManagerBenchmarkSource : NSObject <DMLocationSource>
+{
+	id<DMLocationSourceDelegate>	_delegate;
+	CLLocationAccuracy				_desiredAccuracy;
+	CLLocationDistance				_distanceFilter;
+}
+@end
+
+@implementation DMLocationManagerBenchmarkSource
+
+@synthesize delegate		= _delegate;
+@synthesize desiredAccuracy	= _desiredAccuracy;
+@synthesize distanceFilter	= _distanceFilter;
+
+- (void)startUpdatingLocation
+{
+}
+
+- (void)stopUpdatingLocation
+{
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationManagerBenchmarkDelegate
+
+@interface DMLocationManagerBenchmarkDelegate : NSObject <DMLocationManagerDelegate>
+{
+@public
+	NSUInteger	_count;
+}
+@end
+
+@implementation DMLocationManagerBenchmarkDelegate
+
+- (void)locationManager:(CLLocationManager*)manager
+	 didUpdateToLocation:(CLLocation*)newLocation
+		    fromLocation:(CLLocation*)oldLocation
+{
+	_count++;
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationManagerBenchmark
+
+@interface DMLocationManagerBenchmark (private)
++ (NSArray*)locations;
++ (DMLocationManager*)newLocationManagerWithSource:(id<DMLocationSource>)source;
+@end
+
+@implementation DMLocationManagerBenchmark
+
++ (NSDictionary*)runWithOutputPath:(NSString*)path
+{
+	NSMutableArray* benchmarks = [NSMutableArray array];
+	
+	[benchmarks addObject: [self runBenchmark: @"sample" parameter: 0 iterations: 100000]];
+	
+	for (NSUInteger delegateCount = 1; delegateCount <= 1000; delegateCount *= 10)
+	{
+		[benchmarks addObject: [self runBenchmark: @"fanOut" parameter: delegateCount iterations: MAX(100000 / delegateCount, 100)]];
+	}
+	
+	[benchmarks addObject: [self runBenchmark: @"loopCycle" parameter: 0 iterations: 20000]];
+	
+	NSDictionary* results = [NSDictionary dictionaryWithObjectsAndKeys:
+							 [NSNumber numberWithInt: DM_LOCATION_MANAGER_BENCHMARK_VERSION], @"version",
+							 [[NSDate date] description], @"date",
+							 benchmarks, @"benchmarks",
+							 nil];
+	
+	if (nil != path)
+	{
+		NSData* data = [NSJSONSerialization dataWithJSONObject: results options: NSJSONWritingPrettyPrinted error: NULL];
+		[data writeToFile: path atomically: YES];
+	}
+	
+	return results;
+}
+
++ (NSDictionary*)runBenchmark:(NSString*)name parameter:(NSUInteger)parameter iterations:(NSUInteger)iterations
+{
+	NSAutoreleasePool* pool						= [NSAutoreleasePool new];
+	NSArray* locations							= [self locations];
+	DMLocationManagerBenchmarkSource* source	= [DMLocationManagerBenchmarkSource new];
+	DMLocationManager* locationManager			= [self newLocationManagerWithSource: source];
+	NSMutableArray* delegates					= [NSMutableArray array];
+	
+	BOOL fansOut	= [name isEqualToString: @"fanOut"];
+	BOOL determines	= [name isEqualToString: @"loopCycle"];
+	BOOL loops		= determines;
+	
+	// A determining query accepts the accuracy of the synthetic locations, otherwise the query runs on
+	locationManager.desiredAccuracy		= (YES == determines) ? kCLLocationAccuracyThreeKilometers : kCLLocationAccuracyBest;
+	locationManager.loop				= loops;
+	locationManager.loopTimeInterval	= 3600.0;
+	
+	for (NSUInteger i = 0; i < MAX(parameter, 1); i++)
+	{
+		DMLocationManagerBenchmarkDelegate* delegate = [DMLocationManagerBenchmarkDelegate new];
+		[delegates addObject: delegate];
+		
+		// Subscribers get every location of the running session, so the timed loop measures only the delivery
+		if (YES == fansOut)
+		{
+			[locationManager addDelegate: delegate queue: NULL subscription: DMLocationSubscriptionMake(kCLLocationAccuracyThreeKilometers, kCLDistanceFilterNone, 0.0)];
+		}
+		else
+		{
+			[locationManager addDelegate: delegate];
+		}
+		
+		[delegate release];
+	}
+	
+	[locationManager startUpdatingLocation];
+	
+	void (^iterate)(NSUInteger) = ^(NSUInteger count) {
+		for (NSUInteger i = 0; i < count; i++)
+		{
+			if (YES == determines)
+				[locationManager startUpdatingLocation];
+			
+			[locationManager locationSource: source didUpdateLocation: [locations objectAtIndex: i % DM_LOCATION_MANAGER_BENCHMARK_LOCATIONS]];
+		}
+		
+		// Wait for the engine to process all locations
+		[locationManager locationSource];
+	};
+	
+	iterate(DM_LOCATION_MANAGER_BENCHMARK_WARM_UP);
+	
+	DMLocationManagerBenchmarkMallocLogger previousLogger = malloc_logger;
+	__atomic_store_n(&DMLocationManagerBenchmarkAllocations, 0, __ATOMIC_RELAXED);
+	malloc_logger = DMLocationManagerBenchmarkCountAllocation;
+	
+	uint64_t start = mach_absolute_time();
+	iterate(iterations);
+	uint64_t duration = mach_absolute_time() - start;
+	
+	malloc_logger = previousLogger;
+	int64_t allocations = __atomic_load_n(&DMLocationManagerBenchmarkAllocations, __ATOMIC_RELAXED);
+	
+	[locationManager stopUpdatingLocation];
+	[locationManager locationSource];
+	
+	for (DMLocationManagerBenchmarkDelegate* delegate in delegates)
+	{
+		[locationManager removeDelegate: delegate];
+	}
+	
+	[locationManager release];
+	[source release];
+	
+	NSDictionary* result = [[NSDictionary alloc] initWithObjectsAndKeys:
+							name, @"name",
+							[NSNumber numberWithUnsignedInteger: parameter], @"parameter",
+							[NSNumber numberWithUnsignedInteger: iterations], @"iterations",
+							[NSNumber numberWithDouble: DMLocationManagerBenchmarkNanoseconds(duration) / iterations], @"nanosecondsPerOperation",
+							[NSNumber numberWithDouble: (double)allocations / iterations], @"allocationsPerOperation",
+							nil];
+	
+	[pool drain];
+	
+	return [result autorelease];
+}
+
+
+#pragma mark -
+#pragma mark Private
+
+/**
+ * Returns locations walking north, created in advance so their allocation is not measured.
+ *
+ */
++ (NSArray*)locations
+{
+	NSMutableArray* locations	= [NSMutableArray arrayWithCapacity: DM_LOCATION_MANAGER_BENCHMARK_LOCATIONS];
+	NSDate* timestamp			= [NSDate date];
+	
+	for (NSUInteger i = 0; i < DM_LOCATION_MANAGER_BENCHMARK_LOCATIONS; i++)
+	{
+		CLLocation* location = [[CLLocation alloc] initWithCoordinate: CLLocationCoordinate2DMake(52.52 + i * 1e-5, 13.40)
+															 altitude: 34.0
+												   horizontalAccuracy: 65.0
+													 verticalAccuracy: 10.0
+															   course: 0.0
+																speed: 1.4
+															timestamp: timestamp];
+		[locations addObject: location];
+		[location release];
+	}
+	
+	return locations;
+}
+
++ (DMLocationManager*)newLocationManagerWithSource:(id<DMLocationSource>)source
+{
+	// Without cache path the persisted location of the app is neither read nor cleared
+	DMLocationManager* locationManager = [[DMLocationManager alloc] initWithCachePath: nil];
+	
+	locationManager.processesInBackground	= YES;
+	locationManager.useCache				= YES;
+	locationManager.queryingInterval		= 3600.0;
+	locationManager.locationSource			= source;
+	
+	return locationManager;
+}
+
+@end
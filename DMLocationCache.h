@@ -0,0 +1,84 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ * The DMLocationCache persists the best location and a small history of recent locations across launches.
+ * The file has a fixed layout and is memory-mapped, so reading and writing does not involve any parsing or file system calls.
+ *
+ *		DMLocationCache* cache = [[DMLocationCache alloc] initWithPath:[DMLocationCache defaultPath]];
+ *		CLLocation* location   = cache.bestLocation;
+ *
+ * The cache is not thread safe, use it from one thread or queue only.
+ */
+
+#pragma mark -
+#pragma mark DMLocationCache
+
+#define DM_LOCATION_CACHE_HISTORY_CAPACITY		8
+
+@interface DMLocationCache : NSObject
+{
+@private
+	NSString*			_path;
+	int					_fileDescriptor;
+	void*				_map;				// Memory-mapped file, nil if it could not be mapped
+	size_t				_mapLength;
+}
+
+/**
+ * The path of the cache file.
+ */
+@property (nonatomic, retain, readonly) NSString*						path;
+
+/**
+ * The best location stored last. Nil if the cache is empty.
+ */
+@property (nonatomic, retain, readonly) CLLocation*						bestLocation;
+
+/**
+ * The recent locations, newest first. At most DM_LOCATION_CACHE_HISTORY_CAPACITY.
+ */
+@property (nonatomic, retain, readonly) NSArray*						recentLocations;
+
+/**
+ * Returns the path in the caches directory used by default.
+ */
++ (NSString*)defaultPath;
+
+/**
+ * Map the cache file at the path, which is created if it does not exist or does not match the layout.
+ */
+- (id)initWithPath:(NSString*)path;
+
+/**
+ * Store the location as the best location.
+ */
+- (void)setBestLocation:(CLLocation*)location;
+
+/**
+ * Add the location to the history of recent locations, replacing the oldest if the capacity is reached.
+ */
+- (void)addRecentLocation:(CLLocation*)location;
+
+/**
+ * Remove all locations.
+ */
+- (void)clear;
+
+@end
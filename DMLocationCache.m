@@ -0,0 +1,276 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationCache.h"
+#import "DMLocationManager.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DM_LOCATION_CACHE_MAGIC		0x434C4D44	// 'DMLC'
+#define DM_LOCATION_CACHE_VERSION	1
+
+/**
+ * A location in the cache file. The timestamp is the time interval since 1970, so it survives restarts of the device.
+ */
+typedef struct
+{
+	double		latitude;
+	double		longitude;
+	double		altitude;
+	double		horizontalAccuracy;
+	double		verticalAccuracy;
+	double		course;
+	double		speed;
+	double		timestamp;
+} DMLocationCacheRecord;
+
+/**
+ * Layout of the cache file.
+ */
+typedef struct
+{
+	uint32_t				magic;
+	uint32_t				version;
+	uint32_t				hasBestLocation;
+	uint32_t				recentCount;
+	uint32_t				recentHead;	// Index of the newest recent location
+	uint32_t				reserved;
+	DMLocationCacheRecord	bestLocation;
+	DMLocationCacheRecord	recentLocations[DM_LOCATION_CACHE_HISTORY_CAPACITY];
+} DMLocationCacheFile;
+
+static void DMLocationCacheRecordSetLocation(DMLocationCacheRecord* record, CLLocation* location)
+{
+	record->latitude			= location.coordinate.latitude;
+	record->longitude			= location.coordinate.longitude;
+	record->altitude			= location.altitude;
+	record->horizontalAccuracy	= location.horizontalAccuracy;
+	record->verticalAccuracy	= location.verticalAccuracy;
+	record->course				= location.course;
+	record->speed				= location.speed;
+	record->timestamp			= [location.timestamp timeIntervalSince1970];
+}
+
+static CLLocation* DMLocationCacheRecordCreateLocation(const DMLocationCacheRecord* record)
+{
+	return [[CLLocation alloc] initWithCoordinate: CLLocationCoordinate2DMake(record->latitude, record->longitude)
+										 altitude: record->altitude
+							   horizontalAccuracy: record->horizontalAccuracy
+								 verticalAccuracy: record->verticalAccuracy
+										   course: record->course
+											speed: record->speed
+										timestamp: [NSDate dateWithTimeIntervalSince1970: record->timestamp]];
+}
+
+
+@interface DMLocationCache (private)
+- (BOOL)mapFile;
+- (void)unmapFile;
+- (DMLocationCacheFile*)file;
+@end
+
+@implementation DMLocationCache
+
+@synthesize path = _path;
+@dynamic	bestLocation;
+@dynamic	recentLocations;
+
++ (NSString*)defaultPath
+{
+	NSString* cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+	
+	return [cachesDirectory stringByAppendingPathComponent: @"DMLocationManager.cache"];
+}
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithPath:(NSString*)path
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_path			= [path copy];
+		_fileDescriptor	= -1;
+		_map			= NULL;
+		_mapLength		= 0;
+		
+		[self mapFile];
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[self unmapFile];
+	
+	[_path release];
+	
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Mapping
+
+- (BOOL)mapFile
+{
+	_fileDescriptor = open([_path fileSystemRepresentation], O_RDWR | O_CREAT, 0600);
+	if (_fileDescriptor < 0)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationCache could not open %@", _path);
+#endif
+		return NO;
+	}
+	
+	struct stat status;
+	BOOL isValid = (0 == fstat(_fileDescriptor, &status) && status.st_size == sizeof(DMLocationCacheFile));
+	
+	if (NO == isValid && 0 != ftruncate(_fileDescriptor, sizeof(DMLocationCacheFile)))
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationCache could not resize %@", _path);
+#endif
+		[self unmapFile];
+		return NO;
+	}
+	
+	_mapLength	= sizeof(DMLocationCacheFile);
+	_map		= mmap(NULL, _mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, _fileDescriptor, 0);
+	if (MAP_FAILED == _map)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationCache could not map %@", _path);
+#endif
+		_map = NULL;
+		[self unmapFile];
+		return NO;
+	}
+	
+	// Reset a file of a different layout
+	DMLocationCacheFile* file = [self file];
+	if (NO == isValid || file->magic != DM_LOCATION_CACHE_MAGIC || file->version != DM_LOCATION_CACHE_VERSION || file->recentCount > DM_LOCATION_CACHE_HISTORY_CAPACITY)
+	{
+		memset(file, 0, sizeof(DMLocationCacheFile));
+		file->magic		= DM_LOCATION_CACHE_MAGIC;
+		file->version	= DM_LOCATION_CACHE_VERSION;
+	}
+	
+	return YES;
+}
+
+- (void)unmapFile
+{
+	if (_map)
+	{
+		munmap(_map, _mapLength);
+		_map = NULL;
+	}
+	
+	if (_fileDescriptor >= 0)
+	{
+		close(_fileDescriptor);
+		_fileDescriptor = -1;
+	}
+}
+
+- (DMLocationCacheFile*)file
+{
+	return (DMLocationCacheFile*)_map;
+}
+
+
+#pragma mark -
+#pragma mark Locations
+
+- (CLLocation*)bestLocation
+{
+	DMLocationCacheFile* file = [self file];
+	if (NULL == file || 0 == file->hasBestLocation)
+		return nil;
+	
+	return [DMLocationCacheRecordCreateLocation(&file->bestLocation) autorelease];
+}
+
+- (void)setBestLocation:(CLLocation*)location
+{
+	DMLocationCacheFile* file = [self file];
+	if (NULL == file)
+		return;
+	
+	if (nil == location)
+	{
+		file->hasBestLocation = 0;
+		return;
+	}
+	
+	DMLocationCacheRecordSetLocation(&file->bestLocation, location);
+	file->hasBestLocation = 1;
+}
+
+- (NSArray*)recentLocations
+{
+	DMLocationCacheFile* file = [self file];
+	if (NULL == file)
+		return [NSArray array];
+	
+	NSMutableArray* recentLocations = [NSMutableArray arrayWithCapacity: file->recentCount];
+	
+	for (uint32_t i = 0; i < file->recentCount; i++)
+	{
+		uint32_t index			= (file->recentHead + DM_LOCATION_CACHE_HISTORY_CAPACITY - i) % DM_LOCATION_CACHE_HISTORY_CAPACITY;
+		CLLocation* location	= DMLocationCacheRecordCreateLocation(&file->recentLocations[index]);
+		
+		[recentLocations addObject: location];
+		[location release];
+	}
+	
+	return recentLocations;
+}
+
+- (void)addRecentLocation:(CLLocation*)location
+{
+	DMLocationCacheFile* file = [self file];
+	if (NULL == file || nil == location)
+		return;
+	
+	uint32_t index = (0 == file->recentCount) ? 0 : (file->recentHead + 1) % DM_LOCATION_CACHE_HISTORY_CAPACITY;
+	
+	// Write the location before publishing it by the header
+	DMLocationCacheRecordSetLocation(&file->recentLocations[index], location);
+	
+	file->recentHead = index;
+	if (file->recentCount < DM_LOCATION_CACHE_HISTORY_CAPACITY)
+		file->recentCount++;
+}
+
+- (void)clear
+{
+	DMLocationCacheFile* file = [self file];
+	if (NULL == file)
+		return;
+	
+	file->hasBestLocation	= 0;
+	file->recentCount		= 0;
+	file->recentHead		= 0;
+}
+
+@end
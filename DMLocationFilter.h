@@ -0,0 +1,100 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "DMLocationManager.h"
+
+/**
+ * A location filter rejects raw locations of the source before the DMLocationManager uses them for anything,
+ * e.g. jumps of several kilometers to a cell tower:
+ *
+ *		DMLocationOutlierFilter* filter = [DMLocationOutlierFilter new];
+ *		filter.maximumSpeed			 = 60.0;
+ *		locationManager.locationFilter	 = filter;
+ *
+ * A filter is invoked for every raw location on the engine of the DMLocationManager, so it should be cheap and must not block.
+ */
+
+#pragma mark -
+#pragma mark DMLocationFilter
+
+@protocol DMLocationFilter <NSObject>
+
+/**
+ * Returns NO to discard the sample. The samples arrive in the order of the source.
+ */
+- (BOOL)acceptsSample:(DMLocationSample)sample;
+
+/**
+ * Forget the recent samples, e.g. after the source changed.
+ */
+- (void)reset;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationOutlierFilter
+
+/**
+ * Rejects samples which are physically impossible regarding the last accepted one. A sample is accepted if its distance to the last one
+ * is explained by their accuracies, else the implied speed and acceleration must be within the limits.
+ * Only the last accepted sample is kept, so each sample takes constant time without any allocation.
+ */
+@interface DMLocationOutlierFilter : NSObject <DMLocationFilter>
+{
+@private
+	CLLocationSpeed		_maximumSpeed;
+	double				_maximumAcceleration;
+	double				_maximumNormalizedDistance;
+	NSUInteger			_maximumConsecutiveRejections;
+	DMLocationSample	_lastSample;			// Last accepted sample
+	CLLocationSpeed		_lastSpeed;				// Speed at the last accepted sample, negative if unknown
+	BOOL				_hasLastSample;
+	NSUInteger			_consecutiveRejections;
+	NSUInteger			_rejectedCount;
+}
+
+/**
+ * The highest speed in meters per second which is accepted.
+ * Default is 70 meters per second.
+ */
+@property (nonatomic, assign)			CLLocationSpeed					maximumSpeed;
+
+/**
+ * The highest change of the speed in meters per second squared which is accepted.
+ * Default is 10.
+ */
+@property (nonatomic, assign)			double							maximumAcceleration;
+
+/**
+ * A distance up to this multiple of the combined accuracy of both samples is noise and always accepted.
+ * Default is 3.
+ */
+@property (nonatomic, assign)			double							maximumNormalizedDistance;
+
+/**
+ * After this amount of rejections in a row the sample is accepted as the new start, so the filter does not stick to an outlier.
+ * Default is 5.
+ */
+@property (nonatomic, assign)			NSUInteger						maximumConsecutiveRejections;
+
+/**
+ * The amount of rejected samples.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						rejectedCount;
+
+@end
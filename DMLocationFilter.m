@@ -0,0 +1,128 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationFilter.h"
+
+#define DM_LOCATION_FILTER_EARTH_RADIUS		6371008.8
+
+/**
+ * Returns the distance in meters between the samples, by the equirectangular projection which is exact enough for jumps of a few hundred kilometers.
+ */
+static CLLocationDistance DMLocationFilterDistance(const DMLocationSample* from, const DMLocationSample* to)
+{
+	double scale	= M_PI / 180.0 * DM_LOCATION_FILTER_EARTH_RADIUS;
+	double x		= (to->longitude - from->longitude) * cos(0.5 * (from->latitude + to->latitude) * M_PI / 180.0) * scale;
+	double y		= (to->latitude - from->latitude) * scale;
+	
+	return hypot(x, y);
+}
+
+
+@interface DMLocationOutlierFilter (private)
+- (void)acceptSample:(const DMLocationSample*)sample speed:(CLLocationSpeed)speed;
+@end
+
+@implementation DMLocationOutlierFilter
+
+@synthesize maximumSpeed					= _maximumSpeed;
+@synthesize maximumAcceleration				= _maximumAcceleration;
+@synthesize maximumNormalizedDistance		= _maximumNormalizedDistance;
+@synthesize maximumConsecutiveRejections	= _maximumConsecutiveRejections;
+@synthesize rejectedCount					= _rejectedCount;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)init
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_maximumSpeed					= 70.0;
+		_maximumAcceleration			= 10.0;
+		_maximumNormalizedDistance		= 3.0;
+		_maximumConsecutiveRejections	= 5;
+		
+		[self reset];
+	}
+	
+	return self;
+}
+
+
+#pragma mark -
+#pragma mark DMLocationFilter
+
+- (BOOL)acceptsSample:(DMLocationSample)sample
+{
+	if (NO == _hasLastSample)
+	{
+		[self acceptSample: &sample speed: sample.speed];
+		return YES;
+	}
+	
+	CLLocationDistance distance	= DMLocationFilterDistance(&_lastSample, &sample);
+	NSTimeInterval duration		= sample.timestamp - _lastSample.timestamp;
+	double accuracy				= hypot(MAX(sample.horizontalAccuracy, 0.0), MAX(_lastSample.horizontalAccuracy, 0.0));
+	CLLocationSpeed speed		= (duration > 0.0) ? distance / duration : -1.0;
+	
+	// The jump is within the noise of both samples
+	if (distance <= _maximumNormalizedDistance * accuracy)
+	{
+		[self acceptSample: &sample speed: (sample.speed >= 0.0) ? sample.speed : _lastSpeed];
+		return YES;
+	}
+	
+	BOOL isPossible = (duration > 0.0 && speed <= _maximumSpeed);
+	
+	if (YES == isPossible && _lastSpeed >= 0.0)
+	{
+		isPossible = (fabs(speed - _lastSpeed) / duration <= _maximumAcceleration);
+	}
+	
+	if (YES == isPossible || _consecutiveRejections >= _maximumConsecutiveRejections)
+	{
+		[self acceptSample: &sample speed: (YES == isPossible) ? speed : -1.0];
+		return YES;
+	}
+	
+	_consecutiveRejections++;
+	_rejectedCount++;
+	
+	return NO;
+}
+
+- (void)reset
+{
+	_hasLastSample			= NO;
+	_lastSpeed				= -1.0;
+	_consecutiveRejections	= 0;
+}
+
+
+#pragma mark -
+#pragma mark Private
+
+- (void)acceptSample:(const DMLocationSample*)sample speed:(CLLocationSpeed)speed
+{
+	_lastSample				= *sample;
+	_lastSpeed				= speed;
+	_hasLastSample			= YES;
+	_consecutiveRejections	= 0;
+}
+
+@end
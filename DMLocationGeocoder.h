@@ -0,0 +1,114 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ * The DMLocationGeocoder reverse geocodes locations through one CLGeocoder for all consumers, which core location throttles otherwise.
+ * The placemarks are cached per tile of a square grid, least recently used ones are dropped, optionally persisted to a file.
+ * New placemarks are written to the file together after a few seconds or when the app enters background.
+ * Concurrent lookups of the same tile share one request and the requests run one after another:
+ *
+ *		DMLocationGeocoder* geocoder = [[DMLocationGeocoder alloc] initWithPath:[DMLocationGeocoder defaultPath]];
+ *
+ *		[geocoder reverseGeocodeLocation:location completion:^(CLPlacemark* placemark, NSError* error) {
+ *		}];
+ *
+ * The geocoder is thread safe, the completions are invoked on the main queue.
+ */
+
+/**
+ * Key of a tile, locations with the same key get the same placemark.
+ */
+typedef int64_t DMLocationGeocoderTile;
+
+/**
+ * Invoked with the placemark of the tile or the error of core location.
+ */
+typedef void (^DMLocationGeocoderCompletion)(CLPlacemark* placemark, NSError* error);
+
+#pragma mark -
+#pragma mark DMLocationGeocoder
+
+@interface DMLocationGeocoder : NSObject
+{
+@private
+	NSString*				_path;
+	CLLocationDistance		_tileSize;
+	NSUInteger				_capacity;
+	dispatch_queue_t		_queue;				// Serializes the cache and the requests
+	CLGeocoder*				_geocoder;
+	NSMutableDictionary*	_entries;			// Cached placemarks by tile
+	id						_newestEntry;		// List of the entries ordered by use
+	id						_oldestEntry;
+	NSMutableDictionary*	_completions;		// Completions waiting for the placemark by tile
+	NSMutableArray*			_pendingLocations;	// Locations of the tiles waiting for the geocoder
+	BOOL					_isGeocoding;
+	BOOL					_isPersistScheduled;	// The placemarks changed since they were written
+}
+
+/**
+ * The path the placemarks are persisted to, nil if they are only kept in memory.
+ */
+@property (nonatomic, retain, readonly) NSString*						path;
+
+/**
+ * The edge in meters of a tile.
+ */
+@property (nonatomic, assign, readonly) CLLocationDistance				tileSize;
+
+/**
+ * The amount of placemarks cached.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						capacity;
+
+/**
+ * Returns the path in the caches directory used by default.
+ */
++ (NSString*)defaultPath;
+
+/**
+ * Create the geocoder with tiles of 250 meters and 512 placemarks, restoring the ones persisted at the path if not nil.
+ */
+- (id)initWithPath:(NSString*)path;
+
+/**
+ * Create the geocoder with the tile size in meters and the amount of cached placemarks, restoring the ones persisted at the path if not nil.
+ */
+- (id)initWithPath:(NSString*)path tileSize:(CLLocationDistance)tileSize capacity:(NSUInteger)capacity;
+
+/**
+ * Returns the tile of the coordinate.
+ */
+- (DMLocationGeocoderTile)tileOfCoordinate:(CLLocationCoordinate2D)coordinate;
+
+/**
+ * Returns the cached placemark of the tile of the location, nil if it was not looked up yet. Does not ask core location.
+ */
+- (CLPlacemark*)cachedPlacemarkForLocation:(CLLocation*)location;
+
+/**
+ * Look up the placemark of the tile of the location. Served from the cache or shared with a running lookup of the tile if possible.
+ */
+- (void)reverseGeocodeLocation:(CLLocation*)location completion:(DMLocationGeocoderCompletion)completion;
+
+/**
+ * Remove all cached placemarks, also from the file.
+ */
+- (void)clear;
+
+@end
@@ -0,0 +1,474 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationGeocoder.h"
+#import "DMLocationManager.h"
+
+#define DM_LOCATION_GEOCODER_METERS_PER_DEGREE	(M_PI / 180.0 * 6371008.8)
+#define DM_LOCATION_GEOCODER_VERSION			1
+#define DM_LOCATION_GEOCODER_PERSIST_DELAY		30.0	// Seconds new placemarks are collected before writing them
+
+
+#pragma mark -
+#pragma mark DMLocationGeocoderEntry
+
+/**
+ * A cached placemark, linked into the list of the entries ordered by use. The list does not retain, the entries are owned by the dictionary.
+ */
+@interface DMLocationGeocoderEntry : NSObject
+{
+@public
+	DMLocationGeocoderTile		_tile;
+	CLPlacemark*				_placemark;
+	DMLocationGeocoderEntry*	_newer;
+	DMLocationGeocoderEntry*	_older;
+}
+@end
+
+@implementation DMLocationGeocoderEntry
+
+- (void)dealloc
+{
+	[_placemark release];
+
+	[super dealloc];
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationGeocoder
+
+@interface DMLocationGeocoder (private)
+- (DMLocationGeocoderEntry*)entryOfTile:(DMLocationGeocoderTile)tile;
+- (void)addPlacemark:(CLPlacemark*)placemark ofTile:(DMLocationGeocoderTile)tile;
+- (void)unlinkEntry:(DMLocationGeocoderEntry*)entry;
+- (void)linkNewestEntry:(DMLocationGeocoderEntry*)entry;
+- (void)geocodeNextLocation;
+- (void)finishTile:(DMLocationGeocoderTile)tile placemark:(CLPlacemark*)placemark error:(NSError*)error;
+- (void)restore;
+- (void)schedulePersist;
+- (void)persistIfScheduled;
+- (void)persist;
+- (void)applicationDidEnterBackground:(NSNotification*)notification;
+@end
+
+@implementation DMLocationGeocoder
+
+@synthesize path		= _path;
+@synthesize tileSize	= _tileSize;
+@synthesize capacity	= _capacity;
+
++ (NSString*)defaultPath
+{
+	NSString* cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+
+	return [cachesDirectory stringByAppendingPathComponent: @"DMLocationManager.placemarks"];
+}
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithPath:(NSString*)path
+{
+	return [self initWithPath: path tileSize: 250.0 capacity: 512];
+}
+
+- (id)initWithPath:(NSString*)path tileSize:(CLLocationDistance)tileSize capacity:(NSUInteger)capacity
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_path				= [path copy];
+		_tileSize			= MAX(tileSize, 1.0);
+		_capacity			= MAX(capacity, 1);
+		_queue				= dispatch_queue_create("de.devmob.DMLocationGeocoder", DISPATCH_QUEUE_SERIAL);
+		_geocoder			= [CLGeocoder new];
+		_entries			= [NSMutableDictionary new];
+		_newestEntry		= nil;
+		_oldestEntry		= nil;
+		_completions		= [NSMutableDictionary new];
+		_pendingLocations	= [NSMutableArray new];
+		_isGeocoding		= NO;
+		_isPersistScheduled	= NO;
+
+		[self restore];
+
+		if (nil != _path)
+		{
+			[[NSNotificationCenter defaultCenter] addObserver: self
+													 selector: @selector(applicationDidEnterBackground:)
+														 name: UIApplicationDidEnterBackgroundNotification
+													   object: nil];
+		}
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[[NSNotificationCenter defaultCenter] removeObserver: self];
+
+	[_geocoder cancelGeocode];
+	[_geocoder release];
+
+	[_path release];
+	[_entries release];
+	[_completions release];
+	[_pendingLocations release];
+
+	dispatch_release(_queue);
+
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Tiles
+
+/**
+ * Tiles are squares in degrees of latitude, their width in degrees of longitude grows towards the poles to keep them square in meters.
+ *
+ */
+- (DMLocationGeocoderTile)tileOfCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	double size			= _tileSize / DM_LOCATION_GEOCODER_METERS_PER_DEGREE;
+	int32_t row			= (int32_t)floor((MIN(MAX(coordinate.latitude, -90.0), 90.0) + 90.0) / size);
+	double width		= size / MAX(cos(((row + 0.5) * size - 90.0) * M_PI / 180.0), 0.01);
+	int32_t column		= (int32_t)floor((remainder(coordinate.longitude, 360.0) + 180.0) / width);
+
+	return ((int64_t)row << 32) | (uint32_t)column;
+}
+
+
+#pragma mark -
+#pragma mark Cache
+
+- (CLPlacemark*)cachedPlacemarkForLocation:(CLLocation*)location
+{
+	__block CLPlacemark* placemark		= nil;
+	DMLocationGeocoderTile tile			= [self tileOfCoordinate: location.coordinate];
+
+	dispatch_sync(_queue, ^{
+		DMLocationGeocoderEntry* entry = [self entryOfTile: tile];
+
+		if (nil != entry)
+			placemark = [entry->_placemark retain];
+	});
+
+	return [placemark autorelease];
+}
+
+/**
+ * Returns the entry of the tile and marks it as the most recently used, nil if the tile is not cached.
+ *
+ */
+- (DMLocationGeocoderEntry*)entryOfTile:(DMLocationGeocoderTile)tile
+{
+	DMLocationGeocoderEntry* entry = [_entries objectForKey: [NSNumber numberWithLongLong: tile]];
+
+	if (nil != entry)
+	{
+		[self unlinkEntry: entry];
+		[self linkNewestEntry: entry];
+	}
+
+	return entry;
+}
+
+/**
+ * Cache the placemark as the most recently used one and drop the least recently used one above the capacity.
+ *
+ */
+- (void)addPlacemark:(CLPlacemark*)placemark ofTile:(DMLocationGeocoderTile)tile
+{
+	DMLocationGeocoderEntry* entry = [self entryOfTile: tile];
+
+	if (nil == entry)
+	{
+		entry			= [[DMLocationGeocoderEntry new] autorelease];
+		entry->_tile	= tile;
+
+		[_entries setObject: entry forKey: [NSNumber numberWithLongLong: tile]];
+		[self linkNewestEntry: entry];
+	}
+
+	[entry->_placemark release];
+	entry->_placemark = [placemark retain];
+
+	while ([_entries count] > _capacity)
+	{
+		DMLocationGeocoderEntry* oldestEntry = _oldestEntry;
+
+		[self unlinkEntry: oldestEntry];
+		[_entries removeObjectForKey: [NSNumber numberWithLongLong: oldestEntry->_tile]];
+	}
+}
+
+- (void)unlinkEntry:(DMLocationGeocoderEntry*)entry
+{
+	if (nil != entry->_newer)
+		entry->_newer->_older = entry->_older;
+	else
+		_newestEntry = entry->_older;
+
+	if (nil != entry->_older)
+		entry->_older->_newer = entry->_newer;
+	else
+		_oldestEntry = entry->_newer;
+
+	entry->_newer = nil;
+	entry->_older = nil;
+}
+
+- (void)linkNewestEntry:(DMLocationGeocoderEntry*)entry
+{
+	entry->_older = _newestEntry;
+	entry->_newer = nil;
+
+	if (nil != _newestEntry)
+		((DMLocationGeocoderEntry*)_newestEntry)->_newer = entry;
+	else
+		_oldestEntry = entry;
+
+	_newestEntry = entry;
+}
+
+- (void)clear
+{
+	dispatch_async(_queue, ^{
+		[_entries removeAllObjects];
+		_newestEntry = nil;
+		_oldestEntry = nil;
+
+		[self persist];
+	});
+}
+
+
+#pragma mark -
+#pragma mark Geocoding
+
+- (void)reverseGeocodeLocation:(CLLocation*)location completion:(DMLocationGeocoderCompletion)completion
+{
+	DMLocationGeocoderTile tile = [self tileOfCoordinate: location.coordinate];
+
+	dispatch_async(_queue, ^{
+		DMLocationGeocoderEntry* entry = [self entryOfTile: tile];
+
+		if (nil != entry)
+		{
+			CLPlacemark* placemark = entry->_placemark;
+
+			if (completion)
+			{
+				dispatch_async(dispatch_get_main_queue(), ^{
+					completion(placemark, nil);
+				});
+			}
+			return;
+		}
+
+		// A lookup of the tile is already waiting or running, share its result
+		NSNumber* key					= [NSNumber numberWithLongLong: tile];
+		NSMutableArray* completions		= [_completions objectForKey: key];
+
+		if (nil == completions)
+		{
+			completions = [NSMutableArray array];
+			[_completions setObject: completions forKey: key];
+			[_pendingLocations addObject: location];
+		}
+
+		if (completion)
+		{
+			[completions addObject: [[completion copy] autorelease]];
+		}
+
+		[self geocodeNextLocation];
+	});
+}
+
+/**
+ * Let core location look up the oldest waiting tile, if it is not busy. One request at a time is what CLGeocoder supports.
+ *
+ */
+- (void)geocodeNextLocation
+{
+	if (YES == _isGeocoding || 0 == [_pendingLocations count])
+		return;
+
+	CLLocation* location			= [[[_pendingLocations objectAtIndex: 0] retain] autorelease];
+	DMLocationGeocoderTile tile		= [self tileOfCoordinate: location.coordinate];
+
+	[_pendingLocations removeObjectAtIndex: 0];
+	_isGeocoding = YES;
+
+	[_geocoder reverseGeocodeLocation: location completionHandler: ^(NSArray* placemarks, NSError* error) {
+		CLPlacemark* placemark = (0 < [placemarks count]) ? [placemarks objectAtIndex: 0] : nil;
+
+		dispatch_async(_queue, ^{
+			_isGeocoding = NO;
+
+			[self finishTile: tile placemark: placemark error: error];
+			[self geocodeNextLocation];
+		});
+	}];
+}
+
+/**
+ * Cache a found placemark and hand the result to all completions of the tile. Errors are not cached, so the tile is looked up again.
+ *
+ */
+- (void)finishTile:(DMLocationGeocoderTile)tile placemark:(CLPlacemark*)placemark error:(NSError*)error
+{
+	NSNumber* key			= [NSNumber numberWithLongLong: tile];
+	NSArray* completions	= [[[_completions objectForKey: key] retain] autorelease];
+
+	[_completions removeObjectForKey: key];
+
+	if (nil == error && nil != placemark)
+	{
+		[self addPlacemark: placemark ofTile: tile];
+		[self schedulePersist];
+	}
+
+	if (0 == [completions count])
+		return;
+
+	dispatch_async(dispatch_get_main_queue(), ^{
+		for (DMLocationGeocoderCompletion completion in completions)
+		{
+			completion(placemark, error);
+		}
+	});
+}
+
+
+#pragma mark -
+#pragma mark Persistence
+
+/**
+ * Read the placemarks persisted at the path, oldest first. A file of another version or a damaged one is ignored.
+ *
+ */
+- (void)restore
+{
+	if (nil == _path)
+		return;
+
+	NSData* data = [NSData dataWithContentsOfFile: _path];
+	if (nil == data)
+		return;
+
+	NSDictionary* archive = nil;
+
+	@try
+	{
+		archive = [NSKeyedUnarchiver unarchiveObjectWithData: data];
+	}
+	@catch (NSException* exception)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationGeocoder could not read %@", _path);
+#endif
+		return;
+	}
+
+	if (NO == [archive isKindOfClass: [NSDictionary class]] || DM_LOCATION_GEOCODER_VERSION != [[archive objectForKey: @"version"] intValue])
+		return;
+
+	NSArray* tiles		= [archive objectForKey: @"tiles"];
+	NSArray* placemarks	= [archive objectForKey: @"placemarks"];
+
+	for (NSUInteger i = 0; i < MIN([tiles count], [placemarks count]); i++)
+	{
+		[self addPlacemark: [placemarks objectAtIndex: i] ofTile: [[tiles objectAtIndex: i] longLongValue]];
+	}
+}
+
+/**
+ * Write the placemarks after the delay, so the placemarks found meanwhile are written at once. The pending block retains the geocoder.
+ *
+ */
+- (void)schedulePersist
+{
+	if (nil == _path || YES == _isPersistScheduled)
+		return;
+
+	_isPersistScheduled = YES;
+
+	dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(DM_LOCATION_GEOCODER_PERSIST_DELAY * NSEC_PER_SEC)), _queue, ^{
+		[self persistIfScheduled];
+	});
+}
+
+- (void)persistIfScheduled
+{
+	if (NO == _isPersistScheduled)
+		return;
+
+	_isPersistScheduled = NO;
+	[self persist];
+}
+
+/**
+ * The app may be terminated in background, so the scheduled placemarks are written right away.
+ *
+ */
+- (void)applicationDidEnterBackground:(NSNotification*)notification
+{
+	dispatch_async(_queue, ^{
+		[self persistIfScheduled];
+	});
+}
+
+/**
+ * Write the placemarks to the path, oldest first so restoring them keeps the order of use.
+ *
+ */
+- (void)persist
+{
+	if (nil == _path)
+		return;
+
+	NSMutableArray* tiles		= [NSMutableArray arrayWithCapacity: [_entries count]];
+	NSMutableArray* placemarks	= [NSMutableArray arrayWithCapacity: [_entries count]];
+
+	for (DMLocationGeocoderEntry* entry = _oldestEntry; nil != entry; entry = entry->_newer)
+	{
+		[tiles addObject: [NSNumber numberWithLongLong: entry->_tile]];
+		[placemarks addObject: entry->_placemark];
+	}
+
+	NSDictionary* archive = [NSDictionary dictionaryWithObjectsAndKeys:
+							 [NSNumber numberWithInt: DM_LOCATION_GEOCODER_VERSION], @"version",
+							 tiles, @"tiles",
+							 placemarks, @"placemarks",
+							 nil];
+
+	if (NO == [[NSKeyedArchiver archivedDataWithRootObject: archive] writeToFile: _path atomically: YES])
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationGeocoder could not write %@", _path);
+#endif
+	}
+}
+
+@end
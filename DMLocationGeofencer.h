@@ -0,0 +1,102 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+#import "DMLocationManager.h"
+
+/**
+ * A DMLocationGeofencer evaluates thousands of circular regions against the locations, beyond the 20 regions core location monitors.
+ * The regions are bulk loaded into a grid of cells. A location is tested only against the regions overlapping its cell
+ * and the ones it is inside, so it costs about the same for ten or ten thousand regions:
+ *
+ *		DMLocationGeofencer* geofencer = [[DMLocationGeofencer alloc] initWithRegions:regions];
+ *
+ *		[geofencer evaluateSample:DMLocationSampleMakeWithLocation(location) usingBlock:^(CLCircularRegion* region, BOOL isInside) {
+ *		}];
+ *
+ * The DMLocationManager runs one for its 'geofences' on the engine. A geofencer is not thread safe.
+ */
+
+typedef struct DMLocationGeofencerCircle	DMLocationGeofencerCircle;
+typedef struct DMLocationGeofencerEntry		DMLocationGeofencerEntry;
+
+/**
+ * Invoked for every region the location entered or exited.
+ */
+typedef void (^DMLocationGeofencerTransition)(CLCircularRegion* region, BOOL isInside);
+
+#pragma mark -
+#pragma mark DMLocationGeofencer
+
+@interface DMLocationGeofencer : NSObject
+{
+@private
+	NSArray*					_regions;
+	NSDictionary*				_indexes;			// Index of each region by identifier
+	DMLocationGeofencerCircle*	_circles;			// Center and radius of each region
+	DMLocationGeofencerEntry*	_entries;			// Regions of each cell, sorted by cell
+	NSUInteger					_entryCount;
+	uint32_t*					_largeIndexes;		// Regions overlapping too many cells, tested for every location
+	NSUInteger					_largeCount;
+	CLLocationDegrees			_cellSize;
+	int32_t						_columnCount;
+	uint8_t*					_isInside;
+	uint32_t*					_insideIndexes;		// Regions the location is inside, to test them for exit
+	NSUInteger					_insideCount;
+	CLLocationDistance			_hysteresis;
+}
+
+/**
+ * The regions of the geofencer.
+ */
+@property (nonatomic, retain, readonly) NSArray*						regions;
+
+/**
+ * Meters a location must be outside of a region to exit it, so the inaccuracy at the border does not toggle it.
+ * Default is 20 meters.
+ */
+@property (nonatomic, assign)			CLLocationDistance				hysteresis;
+
+/**
+ * Bulk load the circular regions. The size of the cells follows the median diameter of the regions,
+ * the few regions overlapping more than 64 cells are tested for every location instead.
+ */
+- (id)initWithRegions:(NSArray*)regions;
+
+/**
+ * Test the sample and invoke the block for each region it entered or exited. Neither allocates nor scans all regions.
+ */
+- (void)evaluateSample:(DMLocationSample)sample usingBlock:(DMLocationGeofencerTransition)block;
+
+/**
+ * Apply a transition reported otherwise, e.g. by the monitoring of core location.
+ * Returns the region if its state changed, nil if it did not or the identifier is unknown.
+ */
+- (CLCircularRegion*)transitionRegionWithIdentifier:(NSString*)identifier inside:(BOOL)isInside;
+
+/**
+ * Returns up to the amount of the regions nearest to the sample, ordered by distance to their border.
+ * The distance to the border of the farthest one is returned by reference, if not NULL.
+ */
+- (NSArray*)nearestRegions:(NSUInteger)count toSample:(DMLocationSample)sample distance:(CLLocationDistance*)distance;
+
+/**
+ * Forget which regions the location is inside.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,413 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationGeofencer.h"
+
+#define DM_LOCATION_GEOFENCER_EARTH_RADIUS		6371008.8
+#define DM_LOCATION_GEOFENCER_METERS_PER_DEGREE	(M_PI / 180.0 * DM_LOCATION_GEOFENCER_EARTH_RADIUS)
+#define DM_LOCATION_GEOFENCER_MINIMUM_CELL		100.0
+#define DM_LOCATION_GEOFENCER_MAXIMUM_CELL		50000.0
+#define DM_LOCATION_GEOFENCER_MAXIMUM_CELLS		64		// Cells a region is entered into at most, larger ones are tested always
+
+struct DMLocationGeofencerCircle
+{
+	CLLocationDegrees		latitude;
+	CLLocationDegrees		longitude;
+	CLLocationDistance		radius;
+};
+
+struct DMLocationGeofencerEntry
+{
+	int64_t					cell;
+	uint32_t				region;
+};
+
+/**
+ * Returns the distance in meters between the coordinates, by the equirectangular projection which is exact enough for geofences.
+ */
+static CLLocationDistance DMLocationGeofencerDistance(CLLocationDegrees fromLatitude, CLLocationDegrees fromLongitude, CLLocationDegrees toLatitude, CLLocationDegrees toLongitude)
+{
+	double longitude	= remainder(toLongitude - fromLongitude, 360.0);
+	double x			= longitude * cos(0.5 * (fromLatitude + toLatitude) * M_PI / 180.0) * DM_LOCATION_GEOFENCER_METERS_PER_DEGREE;
+	double y			= (toLatitude - fromLatitude) * DM_LOCATION_GEOFENCER_METERS_PER_DEGREE;
+
+	return hypot(x, y);
+}
+
+static int DMLocationGeofencerCompareEntries(const void* first, const void* second)
+{
+	const DMLocationGeofencerEntry* a = first;
+	const DMLocationGeofencerEntry* b = second;
+
+	if (a->cell != b->cell)
+		return (a->cell < b->cell) ? -1 : 1;
+
+	return (a->region < b->region) ? -1 : (a->region > b->region);
+}
+
+static int DMLocationGeofencerCompareDistances(const void* first, const void* second)
+{
+	CLLocationDistance a = *(const CLLocationDistance*)first;
+	CLLocationDistance b = *(const CLLocationDistance*)second;
+
+	return (a < b) ? -1 : (a > b);
+}
+
+
+@interface DMLocationGeofencer (private)
+- (int32_t)rowOfLatitude:(CLLocationDegrees)latitude;
+- (int32_t)columnOfLongitude:(CLLocationDegrees)longitude;
+- (int64_t)cellOfRow:(int32_t)row column:(int32_t)column;
+- (void)buildCells;
+- (NSUInteger)firstEntryOfCell:(int64_t)cell;
+- (void)setInside:(BOOL)isInside ofRegion:(uint32_t)region;
+@end
+
+@implementation DMLocationGeofencer
+
+@synthesize regions		= _regions;
+@synthesize hysteresis	= _hysteresis;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithRegions:(NSArray*)regions
+{
+	self = [super init];
+	if (self != nil)
+	{
+		NSMutableArray* circularRegions	= [NSMutableArray arrayWithCapacity: [regions count]];
+		NSMutableDictionary* indexes	= [NSMutableDictionary dictionaryWithCapacity: [regions count]];
+
+		for (CLRegion* region in regions)
+		{
+			if (NO == [region isKindOfClass: [CLCircularRegion class]] || nil != [indexes objectForKey: region.identifier])
+				continue;
+
+			[indexes setObject: [NSNumber numberWithUnsignedInteger: [circularRegions count]] forKey: region.identifier];
+			[circularRegions addObject: region];
+		}
+
+		_regions		= [circularRegions copy];
+		_indexes		= [indexes copy];
+		_circles		= calloc(MAX([_regions count], 1), sizeof(DMLocationGeofencerCircle));
+		_isInside		= calloc(MAX([_regions count], 1), sizeof(uint8_t));
+		_insideIndexes	= calloc(MAX([_regions count], 1), sizeof(uint32_t));
+		_insideCount	= 0;
+		_largeIndexes	= calloc(MAX([_regions count], 1), sizeof(uint32_t));
+		_largeCount		= 0;
+		_hysteresis		= 20.0;
+
+		[self buildCells];
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[_regions release];
+	[_indexes release];
+
+	free(_circles);
+	free(_entries);
+	free(_isInside);
+	free(_insideIndexes);
+	free(_largeIndexes);
+
+	[super dealloc];
+}
+
+/**
+ * Enter each region into every cell its bounding box overlaps and sort the entries by cell for a binary search.
+ * Cells are squares in degrees, the columns wrap around the antimeridian. The median is not skewed by a few huge regions,
+ * which are kept apart so they do not flood the cells.
+ *
+ */
+- (void)buildCells
+{
+	CLLocationDistance* radii = malloc(MAX([_regions count], 1) * sizeof(CLLocationDistance));
+
+	for (NSUInteger i = 0; i < [_regions count]; i++)
+	{
+		CLCircularRegion* region = [_regions objectAtIndex: i];
+
+		_circles[i].latitude	= region.center.latitude;
+		_circles[i].longitude	= region.center.longitude;
+		_circles[i].radius		= MAX(region.radius, 0.0);
+
+		radii[i] = _circles[i].radius;
+	}
+
+	qsort(radii, [_regions count], sizeof(CLLocationDistance), DMLocationGeofencerCompareDistances);
+
+	CLLocationDistance diameter = (0 < [_regions count]) ? 2.0 * radii[[_regions count] / 2] : 0.0;
+	free(radii);
+
+	_cellSize		= MIN(MAX(diameter, DM_LOCATION_GEOFENCER_MINIMUM_CELL), DM_LOCATION_GEOFENCER_MAXIMUM_CELL) / DM_LOCATION_GEOFENCER_METERS_PER_DEGREE;
+	_columnCount	= (int32_t)ceil(360.0 / _cellSize);
+
+	NSUInteger capacity = MAX([_regions count], 1);
+	_entries			= malloc(capacity * sizeof(DMLocationGeofencerEntry));
+	_entryCount			= 0;
+
+	for (uint32_t i = 0; i < [_regions count]; i++)
+	{
+		const DMLocationGeofencerCircle* circle = &_circles[i];
+
+		CLLocationDegrees latitudeSpan	= circle->radius / DM_LOCATION_GEOFENCER_METERS_PER_DEGREE;
+		CLLocationDegrees longitudeSpan	= MIN(latitudeSpan / MAX(cos(circle->latitude * M_PI / 180.0), 0.01), 180.0);
+
+		int32_t firstRow		= [self rowOfLatitude: circle->latitude - latitudeSpan];
+		int32_t lastRow			= [self rowOfLatitude: circle->latitude + latitudeSpan];
+		int32_t firstColumn		= (int32_t)floor((circle->longitude - longitudeSpan + 180.0) / _cellSize);
+		int32_t columns			= MIN((int32_t)floor((circle->longitude + longitudeSpan + 180.0) / _cellSize) - firstColumn + 1, _columnCount);
+
+		if ((int64_t)(lastRow - firstRow + 1) * columns > DM_LOCATION_GEOFENCER_MAXIMUM_CELLS)
+		{
+			_largeIndexes[_largeCount++] = i;
+			continue;
+		}
+
+		for (int32_t row = firstRow; row <= lastRow; row++)
+		{
+			for (int32_t column = firstColumn; column < firstColumn + columns; column++)
+			{
+				if (_entryCount == capacity)
+				{
+					capacity	*= 2;
+					_entries	= realloc(_entries, capacity * sizeof(DMLocationGeofencerEntry));
+				}
+
+				_entries[_entryCount].cell		= [self cellOfRow: row column: column];
+				_entries[_entryCount].region	= i;
+				_entryCount++;
+			}
+		}
+	}
+
+	qsort(_entries, _entryCount, sizeof(DMLocationGeofencerEntry), DMLocationGeofencerCompareEntries);
+}
+
+
+#pragma mark -
+#pragma mark Cells
+
+- (int32_t)rowOfLatitude:(CLLocationDegrees)latitude
+{
+	return (int32_t)floor((MIN(MAX(latitude, -90.0), 90.0) + 90.0) / _cellSize);
+}
+
+- (int32_t)columnOfLongitude:(CLLocationDegrees)longitude
+{
+	return (int32_t)floor((longitude + 180.0) / _cellSize);
+}
+
+/**
+ * Returns the key of the cell, the column is wrapped around the antimeridian.
+ *
+ */
+- (int64_t)cellOfRow:(int32_t)row column:(int32_t)column
+{
+	column %= _columnCount;
+	if (column < 0)
+		column += _columnCount;
+
+	return ((int64_t)row << 32) | (uint32_t)column;
+}
+
+/**
+ * Returns the first entry of the cell or the one following it, if the cell is empty.
+ *
+ */
+- (NSUInteger)firstEntryOfCell:(int64_t)cell
+{
+	NSUInteger low	= 0;
+	NSUInteger high	= _entryCount;
+
+	while (low < high)
+	{
+		NSUInteger middle = low + (high - low) / 2;
+
+		if (_entries[middle].cell < cell)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+
+#pragma mark -
+#pragma mark Evaluation
+
+- (void)evaluateSample:(DMLocationSample)sample usingBlock:(DMLocationGeofencerTransition)block
+{
+	if (sample.horizontalAccuracy < 0.0)
+		return;
+
+	// Only the regions the location is inside can be exited, backwards as exited ones are swapped out
+	for (NSUInteger i = _insideCount; i > 0; i--)
+	{
+		uint32_t region							= _insideIndexes[i - 1];
+		const DMLocationGeofencerCircle* circle	= &_circles[region];
+
+		if (DMLocationGeofencerDistance(circle->latitude, circle->longitude, sample.latitude, sample.longitude) > circle->radius + _hysteresis)
+		{
+			[self setInside: NO ofRegion: region];
+			block([_regions objectAtIndex: region], NO);
+		}
+	}
+
+	// Only the regions overlapping the cell of the location can be entered
+	int64_t cell = [self cellOfRow: [self rowOfLatitude: sample.latitude] column: [self columnOfLongitude: sample.longitude]];
+
+	for (NSUInteger i = [self firstEntryOfCell: cell]; i < _entryCount && _entries[i].cell == cell; i++)
+	{
+		uint32_t region							= _entries[i].region;
+		const DMLocationGeofencerCircle* circle	= &_circles[region];
+
+		if (0 != _isInside[region])
+			continue;
+
+		if (DMLocationGeofencerDistance(circle->latitude, circle->longitude, sample.latitude, sample.longitude) <= circle->radius)
+		{
+			[self setInside: YES ofRegion: region];
+			block([_regions objectAtIndex: region], YES);
+		}
+	}
+
+	// The large regions are in no cell
+	for (NSUInteger i = 0; i < _largeCount; i++)
+	{
+		uint32_t region							= _largeIndexes[i];
+		const DMLocationGeofencerCircle* circle	= &_circles[region];
+
+		if (0 != _isInside[region])
+			continue;
+
+		if (DMLocationGeofencerDistance(circle->latitude, circle->longitude, sample.latitude, sample.longitude) <= circle->radius)
+		{
+			[self setInside: YES ofRegion: region];
+			block([_regions objectAtIndex: region], YES);
+		}
+	}
+}
+
+- (CLCircularRegion*)transitionRegionWithIdentifier:(NSString*)identifier inside:(BOOL)isInside
+{
+	NSNumber* index = [_indexes objectForKey: identifier];
+
+	if (nil == index)
+		return nil;
+
+	uint32_t region = (uint32_t)[index unsignedIntegerValue];
+
+	if ((0 != _isInside[region]) == isInside)
+		return nil;
+
+	[self setInside: isInside ofRegion: region];
+
+	return [_regions objectAtIndex: region];
+}
+
+/**
+ * Keep the flag and the list of the regions the location is inside in sync.
+ *
+ */
+- (void)setInside:(BOOL)isInside ofRegion:(uint32_t)region
+{
+	if (YES == isInside)
+	{
+		_isInside[region]				= 1;
+		_insideIndexes[_insideCount++]	= region;
+		return;
+	}
+
+	_isInside[region] = 0;
+
+	for (NSUInteger i = 0; i < _insideCount; i++)
+	{
+		if (_insideIndexes[i] == region)
+		{
+			_insideIndexes[i] = _insideIndexes[--_insideCount];
+			break;
+		}
+	}
+}
+
+/**
+ * Scans all regions, which is fine as it is needed only when the location moved far.
+ *
+ */
+- (NSArray*)nearestRegions:(NSUInteger)count toSample:(DMLocationSample)sample distance:(CLLocationDistance*)distance
+{
+	count = MIN(count, [_regions count]);
+
+	CLLocationDistance* distances	= malloc(MAX(count, 1) * sizeof(CLLocationDistance));
+	uint32_t* indexes				= malloc(MAX(count, 1) * sizeof(uint32_t));
+	NSUInteger found				= 0;
+
+	for (uint32_t region = 0; region < [_regions count] && 0 < count; region++)
+	{
+		const DMLocationGeofencerCircle* circle = &_circles[region];
+		CLLocationDistance border				= MAX(DMLocationGeofencerDistance(circle->latitude, circle->longitude, sample.latitude, sample.longitude) - circle->radius, 0.0);
+
+		if (found == count && border >= distances[found - 1])
+			continue;
+
+		// Insert sorted, dropping the farthest one if full
+		NSUInteger i = (found < count) ? found++ : found - 1;
+
+		for (; i > 0 && distances[i - 1] > border; i--)
+		{
+			distances[i]	= distances[i - 1];
+			indexes[i]		= indexes[i - 1];
+		}
+
+		distances[i]	= border;
+		indexes[i]		= region;
+	}
+
+	NSMutableArray* regions = [NSMutableArray arrayWithCapacity: found];
+
+	for (NSUInteger i = 0; i < found; i++)
+	{
+		[regions addObject: [_regions objectAtIndex: indexes[i]]];
+	}
+
+	if (NULL != distance)
+		*distance = (0 < found) ? distances[found - 1] : 0.0;
+
+	free(distances);
+	free(indexes);
+
+	return regions;
+}
+
+- (void)reset
+{
+	for (NSUInteger i = 0; i < _insideCount; i++)
+	{
+		_isInside[_insideIndexes[i]] = 0;
+	}
+
+	_insideCount = 0;
+}
+
+@end
@@ -0,0 +1,103 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+#import "DMLocationManager.h"
+
+/**
+ * The DMLocationHistory keeps the most recent location samples in a ring buffer which is allocated once.
+ * Adding a sample replaces the oldest one if the capacity is reached, so no memory is allocated per sample.
+ *
+ *		DMLocationSample samples[16];
+ *		NSUInteger count = [locationManager.history getLastSamples:samples count:16];
+ *
+ * Iterate the samples in place without copying them:
+ *
+ *		[locationManager.history enumerateSamplesUsingBlock:^(const DMLocationSample* samples, NSUInteger count, BOOL* stop) {
+ *			for (NSUInteger i = 0; i < count; i++)
+ *				[self drawSample:samples[i]];
+ *		}];
+ *
+ * The history is thread safe. Readers on any thread do not block each other.
+ */
+
+#pragma mark -
+#pragma mark DMLocationHistory
+
+@interface DMLocationHistory : NSObject
+{
+@private
+	DMLocationSample*	_samples;
+	NSUInteger			_capacity;
+	NSUInteger			_count;
+	NSUInteger			_head;				// Index of the oldest sample
+	pthread_rwlock_t	_lock;
+}
+
+/**
+ * The maximum amount of samples.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						capacity;
+
+/**
+ * The amount of samples in the history.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						count;
+
+/**
+ * Allocate the buffer for the amount of samples.
+ */
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/**
+ * Add the sample as newest one. Samples older than the newest one are ignored, so the history stays in chronological order.
+ */
+- (void)addSample:(DMLocationSample)sample;
+
+/**
+ * Copy the newest sample. Returns NO if the history is empty.
+ */
+- (BOOL)getLastSample:(DMLocationSample*)sample;
+
+/**
+ * Copy up to count newest samples in chronological order. Returns the amount of copied samples.
+ */
+- (NSUInteger)getLastSamples:(DMLocationSample*)samples count:(NSUInteger)count;
+
+/**
+ * Copy up to count samples with a timestamp from the start to the end time in chronological order. Returns the amount of copied samples.
+ * The times are monotonic comparable to DMLocationManagerMonotonicTime().
+ */
+- (NSUInteger)getSamples:(DMLocationSample*)samples count:(NSUInteger)count fromTime:(NSTimeInterval)startTime toTime:(NSTimeInterval)endTime;
+
+/**
+ * Returns the amount of samples with a timestamp from the start to the end time.
+ */
+- (NSUInteger)countOfSamplesFromTime:(NSTimeInterval)startTime toTime:(NSTimeInterval)endTime;
+
+/**
+ * Pass the samples in chronological order to the block without copying them. The ring buffer is passed in at most two contiguous parts.
+ * The history is locked for adding while enumerating, so do not keep the pointer or add samples from within the block.
+ */
+- (void)enumerateSamplesUsingBlock:(void (^)(const DMLocationSample* samples, NSUInteger count, BOOL* stop))block;
+
+/**
+ * Remove all samples.
+ */
+- (void)removeAllSamples;
+
+@end
@@ -0,0 +1,232 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationHistory.h"
+
+
+@interface DMLocationHistory (private)
+- (const DMLocationSample*)sampleAtIndex:(NSUInteger)index;
+- (NSUInteger)indexOfFirstSampleFromTime:(NSTimeInterval)time;
+- (NSUInteger)readSamples:(DMLocationSample*)samples fromIndex:(NSUInteger)index count:(NSUInteger)count;
+@end
+
+@implementation DMLocationHistory
+
+@synthesize capacity = _capacity;
+@dynamic	count;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)init
+{
+	return [self initWithCapacity: 256];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_capacity	= MAX(capacity, 1);
+		_samples	= calloc(_capacity, sizeof(DMLocationSample));
+		_count		= 0;
+		_head		= 0;
+		
+		pthread_rwlock_init(&_lock, NULL);
+		
+		if (NULL == _samples)
+		{
+			[self release];
+			return nil;
+		}
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	pthread_rwlock_destroy(&_lock);
+	
+	free(_samples);
+	
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Private
+
+/**
+ * Returns the sample at the chronological index, 0 being the oldest sample. The lock has to be held.
+ *
+ */
+- (const DMLocationSample*)sampleAtIndex:(NSUInteger)index
+{
+	return &_samples[(_head + index) % _capacity];
+}
+
+/**
+ * Binary search for the first sample not older than the time. Returns the count if all samples are older. The lock has to be held.
+ *
+ */
+- (NSUInteger)indexOfFirstSampleFromTime:(NSTimeInterval)time
+{
+	NSUInteger lower = 0;
+	NSUInteger upper = _count;
+	
+	while (lower < upper)
+	{
+		NSUInteger middle = lower + (upper - lower) / 2;
+		
+		if ([self sampleAtIndex: middle]->timestamp < time)
+			lower = middle + 1;
+		else
+			upper = middle;
+	}
+	
+	return lower;
+}
+
+/**
+ * Copy the samples from the chronological index with at most two copies. The lock has to be held.
+ *
+ */
+- (NSUInteger)readSamples:(DMLocationSample*)samples fromIndex:(NSUInteger)index count:(NSUInteger)count
+{
+	if (index >= _count)
+		return 0;
+	
+	count = MIN(count, _count - index);
+	
+	NSUInteger start	= (_head + index) % _capacity;
+	NSUInteger first	= MIN(count, _capacity - start);
+	
+	memcpy(samples, &_samples[start], first * sizeof(DMLocationSample));
+	memcpy(samples + first, _samples, (count - first) * sizeof(DMLocationSample));
+	
+	return count;
+}
+
+
+#pragma mark -
+#pragma mark Samples
+
+- (void)addSample:(DMLocationSample)sample
+{
+	pthread_rwlock_wrlock(&_lock);
+	
+	if (0 == _count || sample.timestamp >= [self sampleAtIndex: _count - 1]->timestamp)
+	{
+		if (_count < _capacity)
+		{
+			_samples[(_head + _count) % _capacity] = sample;
+			_count++;
+		}
+		else
+		{
+			_samples[_head] = sample;
+			_head			= (_head + 1) % _capacity;
+		}
+	}
+	
+	pthread_rwlock_unlock(&_lock);
+}
+
+- (BOOL)getLastSample:(DMLocationSample*)sample
+{
+	return (1 == [self getLastSamples: sample count: 1]);
+}
+
+- (NSUInteger)getLastSamples:(DMLocationSample*)samples count:(NSUInteger)count
+{
+	pthread_rwlock_rdlock(&_lock);
+	
+	count = MIN(count, _count);
+	count = [self readSamples: samples fromIndex: _count - count count: count];
+	
+	pthread_rwlock_unlock(&_lock);
+	
+	return count;
+}
+
+- (NSUInteger)getSamples:(DMLocationSample*)samples count:(NSUInteger)count fromTime:(NSTimeInterval)startTime toTime:(NSTimeInterval)endTime
+{
+	pthread_rwlock_rdlock(&_lock);
+	
+	NSUInteger lower = [self indexOfFirstSampleFromTime: startTime];
+	NSUInteger upper = [self indexOfFirstSampleFromTime: nextafter(endTime, DBL_MAX)];
+	
+	count = (upper > lower) ? [self readSamples: samples fromIndex: lower count: MIN(count, upper - lower)] : 0;
+	
+	pthread_rwlock_unlock(&_lock);
+	
+	return count;
+}
+
+- (NSUInteger)countOfSamplesFromTime:(NSTimeInterval)startTime toTime:(NSTimeInterval)endTime
+{
+	pthread_rwlock_rdlock(&_lock);
+	
+	NSUInteger lower = [self indexOfFirstSampleFromTime: startTime];
+	NSUInteger upper = [self indexOfFirstSampleFromTime: nextafter(endTime, DBL_MAX)];
+	
+	pthread_rwlock_unlock(&_lock);
+	
+	return (upper > lower) ? upper - lower : 0;
+}
+
+- (void)enumerateSamplesUsingBlock:(void (^)(const DMLocationSample* samples, NSUInteger count, BOOL* stop))block
+{
+	if (nil == block)
+		return;
+	
+	pthread_rwlock_rdlock(&_lock);
+	
+	BOOL stop			= NO;
+	NSUInteger first	= MIN(_count, _capacity - _head);
+	
+	if (first > 0)
+		block(&_samples[_head], first, &stop);
+	
+	if (NO == stop && _count > first)
+		block(_samples, _count - first, &stop);
+	
+	pthread_rwlock_unlock(&_lock);
+}
+
+- (void)removeAllSamples
+{
+	pthread_rwlock_wrlock(&_lock);
+	
+	_count	= 0;
+	_head	= 0;
+	
+	pthread_rwlock_unlock(&_lock);
+}
+
+- (NSUInteger)count
+{
+	pthread_rwlock_rdlock(&_lock);
+	NSUInteger count = _count;
+	pthread_rwlock_unlock(&_lock);
+	
+	return count;
+}
+
+@end
@@ -16,10 +16,16 @@
 
 #import <Foundation/Foundation.h>
 #import <CoreLocation/CoreLocation.h>
+#import "DMLocationSource.h"
+#import "DMLocationRequest.h"
+#import "DMLocationPointIndex.h"
+#import "DMLocationGeocoder.h"
+
+@class DMLocationUploader;
 
 /**
  * The DMLocationManager is a convinience wrapper for the CLLocationManager.
- * It accepts multiple delegate instances at one time.
+ * It accepts multiple delegate instances at one time, which are referenced weakly.
  *
  *		DMLocationManager* locationManager = [DMLocationManager sharedLocationManager];
  *		[locationManager addDelegate:self];
@@ -31,6 +37,21 @@
  *		locationManager.desiredAccuracy	   = kCLLocationAccuracyNearestTenMeters
  *		locationManager.queryingInterval   = 10.0;
  *
+ * To save energy stop querying once the accuracy does not improve anymore, although the desired accuracy was not reached.
+ *
+ *		locationManager.convergenceSampleCount	= 3;
+ *		locationManager.convergenceTimeInterval	= 3.0;
+ *
+ * For a fast first location start with a coarse accuracy and refine it afterwards:
+ *
+ *		locationManager.escalatesAccuracy	= YES;
+ *		locationManager.provisionalAccuracy	= kCLLocationAccuracyKilometer;
+ *
+ * The last location survives restarts of the app. Check its age before using it, e.g. for city-level positions:
+ *
+ *		if (locationManager.location && locationManager.locationAge < 3600.0)
+ *			[self showCity:locationManager.location];
+ *
  * To avoid getting cached location coordinates deactivate it by setting NO to 'useCache' property.
  *
  *		DMLocationManager* locationManager = [DMLocationManager sharedLocationManager];
@@ -46,6 +67,42 @@
  *		DMLocationManager* locationManager							= [DMLocationManager sharedLocationManager];
  *		locationManager.updateLocationOnApplicationDidBecomeActive	= YES;
  *
+ * To serve delegates immediately on (re-)activation of the app use the cached location and refresh it only if it is old enough:
+ *
+ *		locationManager.revalidatesCachedLocation	= YES;
+ *		locationManager.cacheAge					= 600.0;
+ *		locationManager.revalidationAge				= 60.0;
+ *
+ * Spare the delegates locations which hardly differ from the last delivered one, unless the accuracy improved clearly:
+ *
+ *		locationManager.suppressionDistance				= 20.0;
+ *		locationManager.suppressionInterval				= 30.0;
+ *		locationManager.suppressionAccuracyImprovement	= 50.0;
+ *
+ * Let the loop sleep long while parking and short while driving:
+ *
+ *		locationManager.adaptsLoopTimeInterval	= YES;
+ *		locationManager.minimumLoopTimeInterval	= 10.0;
+ *		locationManager.maximumLoopTimeInterval	= 300.0;
+ *
+ * Skip the loop while the device does not move, e.g. lying on a desk:
+ *
+ *		locationManager.pausesWhileStationary = YES;
+ *
+ * Instead of tuning 'queryingInterval' and 'loopTimeInterval' limit the time core location may spend per hour:
+ *
+ *		locationManager.energyBudget = 120.0;
+ *
+ * To track with little energy collect the locations of the loop and deliver them in batches to locationManager:didUpdateLocations:
+ *
+ *		locationManager.loop				= YES;
+ *		locationManager.batchesLocations	= YES;
+ *		locationManager.batchFlushInterval	= 300.0;
+ *
+ * Instead of stopping in background keep the location warm with little energy and resume on activation:
+ *
+ *		locationManager.backgroundPolicy = DMLocationManagerBackgroundPolicySignificantChange;
+ *
  * To keep the location permanent up to date the property 'loop' defines whether to repeadeatly determine new location coordinates.
  * The property 'loopTimeInterval' defines how long to sleep between determining the location successfully and beginning the next determination.
  *
@@ -91,12 +148,149 @@
  *
  *		[locationManager removeDelegate:self];
  *
+ * To keep the main thread free let the location manager process locations on a private queue. Delegates may choose the queue they are informed on:
+ *
+ *		locationManager.processesInBackground = YES;
+ *		[locationManager addDelegate:self queue:dispatch_get_main_queue()];
+ *
+ * Query the trail of the last ten minutes from the history instead of collecting the locations yourself:
+ *
+ *		DMLocationSample samples[64];
+ *		NSTimeInterval now = DMLocationManagerMonotonicTime();
+ *		NSUInteger count   = [locationManager.history getSamples:samples count:64 fromTime:now - 600.0 toTime:now];
+ *
+ * For long tracks keep only the significant locations, e.g. to store or upload them:
+ *
+ *		locationManager.simplificationTolerance = 10.0;
+ *		DMLocationHistory* track				= locationManager.simplifiedHistory;
+ *
+ * Record the raw locations in the field and replay them later to reproduce an issue, here ten times faster:
+ *
+ *		locationManager.traceRecordingPath = [documentsDirectory stringByAppendingPathComponent:@"field.trace"];
+ *		[locationManager replayTraceAtPath:tracePath speed:10.0];
+ *		[locationManager startUpdatingLocation];
+ *
+ * Discard jumps to cell towers and other impossible locations before they reach the queries, requests or subscriptions:
+ *
+ *		locationManager.locationFilter = [[DMLocationOutlierFilter new] autorelease];
+ *
+ * Smooth the locations by a shared Kalman filter instead of in every consumer, the estimate comes with the raw location:
+ *
+ *		locationManager.smoothsLocations = YES;
+ *
+ *		- (void)locationManager:(DMLocationManager*)manager didUpdateEstimate:(DMLocationEstimate)estimate ofLocation:(CLLocation*)location {
+ *		}
+ *
+ * Watch thousands of geofences, the nearest ones are monitored by core location for the background:
+ *
+ *		locationManager.geofences = stores;
+ *
+ *		- (void)locationManager:(DMLocationManager*)manager didEnterGeofence:(CLCircularRegion*)geofence {
+ *		}
+ *
+ * Keep the points of interest nearest to the location, without scanning them on every update:
+ *
+ *		locationManager.pointIndex = [[[DMLocationPointIndex alloc] initWithCoordinates:coordinates count:count] autorelease];
+ *
+ *		- (void)locationManagerDidUpdateNearestPoints:(DMLocationManager*)manager {
+ *			DMLocationPointNeighbor neighbors[10];
+ *			NSUInteger found = [manager getNearestPoints:neighbors count:10];
+ *		}
+ *
+ * Reverse geocode the location once per tile for all delegates instead of calling CLGeocoder on every update:
+ *
+ *		locationManager.reverseGeocodesLocation = YES;
+ *
+ *		- (void)locationManager:(DMLocationManager*)manager didUpdatePlacemark:(CLPlacemark*)placemark forLocation:(CLLocation*)location {
+ *		}
+ *
+ * Upload the recorded locations in compact batches with few wakeups of the radio, see DMLocationUploader.h:
+ *
+ *		locationManager.historyCapacity = 1024;
+ *		locationManager.uploader		= [[[DMLocationUploader alloc] initWithURL:url directory:[DMLocationUploader defaultDirectory]] autorelease];
+ *
+ * Read the last location from any thread without locking or allocating:
+ *
+ *		DMLocationSample sample;
+ *		if ([locationManager getLocationSnapshot:&sample]) {
+ *			NSTimeInterval age = DMLocationManagerMonotonicTime() - sample.timestamp;
+ *		}
+ *
+ * Ask once for a location with an own accuracy and timeout, without restarting the queries of other screens:
+ *
+ *		[locationManager requestLocationWithAccuracy:kCLLocationAccuracyHundredMeters maximumAge:60.0 timeout:10.0 completion:^(CLLocation* location, NSError* error) {
+ *		}];
+ *
+ * Continuous consumers subscribe with what they need. The location source follows the strictest of the subscriptions
+ * and relaxes as soon as the demanding one is removed:
+ *
+ *		[locationManager addDelegate:self queue:NULL subscription:DMLocationSubscriptionMake(kCLLocationAccuracyBest, 5.0, 1.0)];
+ *
+ * Measure how long the queries take before tuning them:
+ *
+ *		DMLocationManagerMetrics metrics = locationManager.metrics;
+ *		NSLog(@"first location after %f s, timeouts %f", metrics.meanTimeToFirstSample, metrics.timeoutRate);
+ *
  * Activate logging by setting the log level define e.g.:
  *
  *		#define DM_LOCATION_MANAGER_LOG_LEVEL	DM_LOCATION_MANAGER_LOG_LEVEL_INFO
  */
 
 @protocol DMLocationManagerDelegate;
+@protocol DMLocationFilter;
+@class DMLocationCache;
+@class DMLocationGeofencer;
+@class DMLocationHistory;
+@class DMLocationSimplifier;
+@class DMLocationSmoother;
+@class DMLocationTraceRecorder;
+@class CMMotionActivityManager;
+@class CMMotionManager;
+
+
+#pragma mark -
+#pragma mark DMLocationSample
+
+/**
+ * Plain location sample which can be copied and stored without any allocation or retain.
+ * The timestamp is the monotonic time of the fix in seconds comparable to DMLocationManagerMonotonicTime().
+ */
+typedef struct
+{
+	CLLocationDegrees		latitude;
+	CLLocationDegrees		longitude;
+	CLLocationAccuracy		horizontalAccuracy;
+	CLLocationAccuracy		verticalAccuracy;
+	CLLocationSpeed			speed;
+	CLLocationDirection		course;
+	NSTimeInterval			timestamp;
+} DMLocationSample;
+
+/**
+ * Position and velocity estimated by smoothing the locations, see 'smoothsLocations'. The velocity is in meters per second
+ * towards east and north, the accuracy is the deviation of the position in meters. The timestamp is monotonic like the one of DMLocationSample.
+ */
+typedef struct
+{
+	CLLocationDegrees		latitude;
+	CLLocationDegrees		longitude;
+	CLLocationAccuracy		horizontalAccuracy;
+	CLLocationSpeed			velocityEast;
+	CLLocationSpeed			velocityNorth;
+	CLLocationSpeed			speed;
+	CLLocationDirection		course;
+	NSTimeInterval			timestamp;
+} DMLocationEstimate;
+
+/**
+ * Returns the monotonic time in seconds, which is not affected by changes of the system clock and keeps running while the device sleeps.
+ */
+FOUNDATION_EXTERN NSTimeInterval DMLocationManagerMonotonicTime(void);
+
+/**
+ * Returns the sample of the location with its timestamp converted to monotonic time.
+ */
+FOUNDATION_EXTERN DMLocationSample DMLocationSampleMakeWithLocation(CLLocation* location);
 
 
 #pragma mark -
@@ -110,32 +304,351 @@
 
 #define DM_LOCATION_MANAGER_LOG_LEVEL			DM_LOCATION_MANAGER_LOG_LEVEL_INFO
 
-@interface DMLocationManager : NSObject <CLLocationManagerDelegate>
+// Mark the queries as os_signpost intervals for Instruments since iOS 12, 0 to deactivate
+#define DM_LOCATION_MANAGER_SIGNPOSTS			1
+
+/**
+ * How a query ended.
+ */
+typedef enum
+{
+	DMLocationManagerQueryOutcomeStopped = 0,			// Stopped before a location was determined
+	DMLocationManagerQueryOutcomeDetermined,			// The desired accuracy was reached or the accuracy converged
+	DMLocationManagerQueryOutcomeTimedOut,				// The 'queryingInterval' passed
+	DMLocationManagerQueryOutcomeFailed					// The location source failed
+} DMLocationManagerQueryOutcome;
+
+/**
+ * Measurements of a query. Times are in seconds since the start of the query, -1 if the event did not happen.
+ */
+typedef struct
+{
+	NSTimeInterval					duration;
+	NSTimeInterval					timeToFirstSample;
+	NSTimeInterval					timeToDesiredAccuracy;
+	NSTimeInterval					radioOnDuration;
+	NSUInteger						samplesReceived;
+	NSUInteger						samplesDiscarded;		// Too old for the 'cacheAge'
+	DMLocationManagerQueryOutcome	outcome;
+} DMLocationManagerQueryMetrics;
+
+/**
+ * Measurements of all queries since the start or the last reset. Means are -1 if no query had the event.
+ */
+typedef struct
+{
+	DMLocationManagerQueryMetrics	lastQuery;
+	NSUInteger						queryCount;
+	NSUInteger						timeoutCount;
+	double							timeoutRate;
+	NSTimeInterval					meanTimeToFirstSample;
+	NSTimeInterval					meanTimeToDesiredAccuracy;
+	NSTimeInterval					radioOnDuration;
+	NSUInteger						samplesReceived;
+	NSUInteger						samplesDiscarded;
+} DMLocationManagerMetrics;
+
+/**
+ * What a continuous delegate needs, see addDelegate:queue:subscription:.
+ */
+typedef struct
+{
+	CLLocationAccuracy				desiredAccuracy;
+	CLLocationDistance				distanceFilter;		// Meters to move before the delegate is informed again, kCLDistanceFilterNone for any
+	NSTimeInterval					updateInterval;		// Minimum seconds between two locations to the delegate, 0 for any
+} DMLocationSubscription;
+
+FOUNDATION_EXTERN DMLocationSubscription DMLocationSubscriptionMake(CLLocationAccuracy desiredAccuracy, CLLocationDistance distanceFilter, NSTimeInterval updateInterval);
+
+/**
+ * What to do with the updating of the location while the app is in background.
+ */
+typedef enum
+{
+	DMLocationManagerBackgroundPolicyStop = 0,			// Stop updating the location
+	DMLocationManagerBackgroundPolicySignificantChange,	// Monitor significant location changes
+	DMLocationManagerBackgroundPolicyLowAccuracy		// Update the location with 'backgroundAccuracy'
+} DMLocationManagerBackgroundPolicy;
+
+@interface DMLocationManager : NSObject <DMLocationSourceDelegate>
 {
 @private
-	NSMutableArray*		_delegates;			// Delegate instances which must be served
+	NSHashTable*		_delegates;			// Weakly referenced delegate instances which must be served
+	NSMapTable*			_delegateQueues;	// Queues on which delegates want to be informed
+	NSMapTable*			_delegateSubscriptions;	// Subscriptions of continuous delegates
+	NSLock*				_delegatesLock;
+	id					_dispatchTable;		// Delegates per callback with cached implementations, rebuilt on add/remove
 	
-	CLLocationManager*	_locationManager;	// Shared location manager instance
+	BOOL				_processesInBackground;
+	dispatch_queue_t	_engineQueue;		// Queue running filtering, timers and informing of delegates
+	NSTimeInterval		_timerLeeway;
+	
+	id<DMLocationSource>	_locationSource;	// Core location unless a custom source is set
+	BOOL				_isCustomLocationSource;
+	BOOL				_isSourceUpdating;
+	id<DMLocationFilter>	_locationFilter;	// Rejects raw locations before they are used
+	CLLocationAccuracy	_desiredAccuracy;
+	CLLocationAccuracy	_sessionAccuracy;	// Accuracy aimed by the current query
+	CLLocationAccuracy	_sourceAccuracy;	// Accuracy the engine needs from the source, requests may need a better one
 	CLLocation*			_location;
+	DMLocationSample	_snapshot;			// Copy of the location published by a sequence lock
+	uint32_t			_snapshotSequence;	// Odd while the snapshot is written, zero if never published
+	BOOL				_smoothsLocations;
+	DMLocationSmoother*	_smoother;
+	DMLocationEstimate	_estimate;			// Smoothed estimate published by a sequence lock like the snapshot
+	uint32_t			_estimateSequence;
+	DMLocationGeofencer*	_geofencer;
+	NSMutableArray*		_monitoredGeofences;	// Nearest geofences monitored by the source
+	CLCircularRegion*	_geofenceBoundary;	// Monitored around the nearest geofences, leaving it swaps them
+	NSUInteger			_maximumMonitoredGeofences;
+	DMLocationPointIndex*	_pointIndex;
+	NSUInteger			_nearestPointCount;
+	DMLocationPointNeighbor*	_nearestPoints;
+	DMLocationPointNeighbor*	_queriedPoints;		// One more than the count, to know how far the other points are
+	NSUInteger			_nearestPointsFound;
+	CLLocation*			_nearestPointsLocation;	// Location the nearest points were queried at
+	CLLocationDistance	_nearestPointsSlack;	// Distance the location may move before another point can become one of the nearest
+	BOOL				_reverseGeocodesLocation;
+	DMLocationGeocoder*	_geocoder;
+	CLPlacemark*		_placemark;
+	DMLocationGeocoderTile	_placemarkTile;		// Tile of the placemark or of its running lookup
+	BOOL				_hasPlacemarkTile;
+	DMLocationUploader*	_uploader;
 	BOOL				_useCache;
 	NSTimeInterval		_cacheAge;
 	BOOL				_isLocationServiceEnabled;
 	
 	BOOL				_updateLocationOnApplicationDidBecomeActive;
+	BOOL				_revalidatesCachedLocation;
+	NSTimeInterval		_revalidationAge;
+	CLLocationDistance	_revalidationDistance;
+	CLLocation*			_revalidatedLocation;	// Cached location the delegates were informed about on activation
+	
+	CLLocationDistance	_suppressionDistance;
+	NSTimeInterval		_suppressionInterval;
+	CLLocationAccuracy	_suppressionAccuracyImprovement;
+	CLLocation*			_deliveredLocation;	// Last location the delegates were informed about, passed as fromLocation
+	
+	DMLocationManagerBackgroundPolicy	_backgroundPolicy;
+	CLLocationAccuracy	_backgroundAccuracy;
+	BOOL				_isInBackgroundMode;
+	BOOL				_isMonitoringSignificantChanges;
+	BOOL				_resumesOnActivation;	// Updating was running when the app entered background
 	
 	BOOL				_loop;
 	NSTimeInterval		_loopTimeInterval;
-	NSTimer*			_loopTimer;			// Restart searching of new locations after one was found
+	dispatch_source_t	_loopTimer;			// Restart searching of new locations after one was found
+	BOOL				_isLoopTimerArmed;
+	
+	BOOL				_adaptsLoopTimeInterval;
+	NSTimeInterval		_minimumLoopTimeInterval;
+	NSTimeInterval		_maximumLoopTimeInterval;
+	CLLocationDistance	_adaptiveLoopDistance;
+	NSTimeInterval		_adaptiveLoopTimeInterval;	// Sleep of the next cycle derived from the speed
+	CLLocationAccuracy	_adaptiveAccuracy;			// Accuracy the next cycle may relax to, derived from the speed
+	CLLocation*			_previousLoopLocation;
+	
+	BOOL				_pausesWhileStationary;
+	BOOL				_isStationary;
+	BOOL				_isLoopPaused;		// The loop waits for motion instead of restarting
+	NSOperationQueue*	_motionQueue;
+	CMMotionActivityManager*	_activityManager;
+	CMMotionManager*	_accelerometerManager;
+	
+	NSTimeInterval		_energyBudget;
+	id					_energyMeter;		// Radio-on time of the last hour
+	NSTimeInterval		_radioStartTime;
+	
+	DMLocationManagerQueryMetrics	_queryMetrics;		// Metrics of the running or last query
+	DMLocationManagerMetrics		_metrics;
+	NSTimeInterval		_queryStartTime;
+	BOOL				_isMeasuringQuery;
+	NSUInteger			_firstSampleCount;
+	NSUInteger			_desiredAccuracyCount;
+	NSTimeInterval		_totalTimeToFirstSample;
+	NSTimeInterval		_totalTimeToDesiredAccuracy;
+	uint64_t			_querySignpost;
 	
 	NSTimeInterval		_queryingInterval;
-	NSTimer*			_queryingTimer;		// On timeout the updating of location will be stopped
+	dispatch_source_t	_queryingTimer;		// On timeout the updating of location will be stopped
+	BOOL				_isQueryingTimerArmed;
+	
+	BOOL				_batchesLocations;
+	NSTimeInterval		_batchFlushInterval;
+	CLLocationDistance	_batchFlushDistance;
+	dispatch_source_t	_batchTimer;		// Flushes the collected locations
+	NSMutableArray*		_batch;				// Locations collected since the last flush
+	BOOL				_isBatching;
+	BOOL				_isDeferringUpdates;
+	
+	NSUInteger			_convergenceSampleCount;
+	NSTimeInterval		_convergenceTimeInterval;
+	NSUInteger			_samplesWithoutImprovement;	// Samples of the current query which did not improve the accuracy
+	NSTimeInterval		_lastImprovementTime;		// Monotonic time the accuracy improved the last time
+	
+	BOOL				_escalatesAccuracy;
+	CLLocationAccuracy	_provisionalAccuracy;
+	BOOL				_isEscalatingAccuracy;		// The current query still waits for the provisional location
+	BOOL				_hasProvisionalLocation;	// The current query delivered a provisional location
+	BOOL				_hasSessionLocation;		// The current query determined a location
+	
+	BOOL				_persistsLocation;
+	DMLocationCache*	_cache;						// Memory-mapped location of the last launches
+	NSString*			_cachePath;					// File of the cache, nil if the manager never persists
+	
+	DMLocationHistory*	_history;
+	NSUInteger			_historyCapacity;
+	CLLocationDistance	_simplificationTolerance;
+	DMLocationSimplifier*	_simplifier;
+	
+	DMLocationTraceRecorder*	_traceRecorder;
+	
+	NSMutableArray*		_requests;			// Outstanding one-shot requests sharing the session of the source
+	NSUInteger			_subscriptionCount;	// Subscribed delegates as known by the engine
+	dispatch_source_t	_requestTimer;		// Fires at the nearest deadline of the requests
 }
 
 /**
  * Last determined location by location manager. If nil the location was or could not be updated.
+ * If 'persistsLocation' is YES it is restored from the last launch until a new location is determined.
  */
 @property (nonatomic, retain, readonly) CLLocation*						location;
 
+/**
+ * The age of 'location' in seconds. It may be restored from the last launch, check the age to decide whether to trust it.
+ * DBL_MAX if there is no location.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					locationAge;
+
+/**
+ * The most recent locations which were determined, newest first, surviving restarts of the app if 'persistsLocation' is YES.
+ */
+@property (nonatomic, retain, readonly) NSArray*						recentLocations;
+
+/**
+ * If YES every raw location which is not rejected by the 'locationFilter' is smoothed by a constant velocity Kalman filter.
+ * The estimate of position and velocity is passed with the raw location to locationManager:didUpdateEstimate:ofLocation:
+ * and can be read by getSmoothedEstimate: from any thread. Changing it starts a new filter.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							smoothsLocations;
+
+/**
+ * Circular regions whose enter and exit are informed by locationManager:didEnterGeofence: and locationManager:didExitGeofence:.
+ * Every raw location which is not rejected by the 'locationFilter' is evaluated against them, thousands are fine, see DMLocationGeofencer.h.
+ * The nearest ones are monitored by the location source as well, so the transitions are informed while the app is suspended.
+ * Setting them forgets which ones the location is inside.
+ * Default is nil.
+ */
+@property (nonatomic, copy)				NSArray*						geofences;
+
+/**
+ * How many regions the location source monitors natively. One of them is a boundary around the nearest geofences,
+ * leaving it swaps in the geofences nearest to the new location. Core location monitors at most 20 regions per app, 0 disables it.
+ * With 1 only the boundary is monitored, halfway to the nearest geofence, and the geofences are evaluated by the location after leaving it.
+ * Default is 20.
+ */
+@property (nonatomic, assign)			NSUInteger						maximumMonitoredGeofences;
+
+/**
+ * Points, e.g. of interest, whose nearest ones to the 'location' are kept up to date, see getNearestPoints:count:.
+ * Whenever the location changes, only the distances of the nearest points are updated as long as no other point can be nearer.
+ * locationManagerDidUpdateNearestPoints: informs when the nearest points or their order changed.
+ * Default is nil.
+ */
+@property (nonatomic, retain)			DMLocationPointIndex*			pointIndex;
+
+/**
+ * How many of the nearest points of the 'pointIndex' are kept.
+ * Default is 10.
+ */
+@property (nonatomic, assign)			NSUInteger						nearestPointCount;
+
+/**
+ * If YES the 'location' is reverse geocoded by the shared 'geocoder' whenever it entered another tile of it, see DMLocationGeocoder.h.
+ * The placemark is informed by locationManager:didUpdatePlacemark:forLocation:. If 'persistsLocation' is YES when it is set,
+ * the placemarks are persisted.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							reverseGeocodesLocation;
+
+/**
+ * The geocoder of the location, which delegates can use for own lookups sharing its cache. Nil unless 'reverseGeocodesLocation' is YES.
+ */
+@property (nonatomic, retain, readonly) DMLocationGeocoder*				geocoder;
+
+/**
+ * The placemark of the tile of the last reverse geocoded location. Nil if none was found yet.
+ */
+@property (nonatomic, retain, readonly) CLPlacemark*					placemark;
+
+/**
+ * The uploader the recorded locations are passed to. It collects them from the 'history', so 'historyCapacity' must not be 0.
+ * Collected locations are flushed when the app becomes active or enters background. The queued ones are also uploaded
+ * after a lookup of the 'geocoder' went to the network.
+ * Default is nil.
+ */
+@property (nonatomic, retain)			DMLocationUploader*				uploader;
+
+/**
+ * If YES the best location and a small history are persisted in a memory-mapped file and restored on initialization.
+ * The 'location' is then available immediately after launch, before core location delivers anything.
+ * Without cache path, see initWithCachePath:, it stays NO.
+ * Default is YES.
+ */
+@property (nonatomic, assign)			BOOL							persistsLocation;
+
+/**
+ * The samples of all locations core location delivered and which were not too old to use, oldest first.
+ * It can be read on any thread. Nil if 'historyCapacity' is 0.
+ */
+@property (nonatomic, retain, readonly) DMLocationHistory*				history;
+
+/**
+ * The maximum amount of samples in 'history'. Changing it starts a new empty history, 0 disables it.
+ * Default is 256.
+ */
+@property (nonatomic, assign)			NSUInteger						historyCapacity;
+
+/**
+ * The significant samples of the track, oldest first. Dropped samples are within 'simplificationTolerance' of the kept ones.
+ * The newest location is kept once the track leaves the tolerance, until then it is only in 'history'.
+ * Nil if 'simplificationTolerance' is 0.
+ */
+@property (nonatomic, retain, readonly) DMLocationHistory*				simplifiedHistory;
+
+/**
+ * The tolerance in meters the track is simplified with while recorded. Changing it starts a new simplified history
+ * of 'historyCapacity' samples, 0 disables it.
+ * Default is 0.
+ */
+@property (nonatomic, assign)			CLLocationDistance				simplificationTolerance;
+
+/**
+ * If set every raw location core location delivers is appended to a trace file at the path, see DMLocationTrace.h.
+ * Default is nil.
+ */
+@property (nonatomic, copy)				NSString*						traceRecordingPath;
+
+/**
+ * Returns whether a trace is replayed instead of using the locations of core location.
+ */
+@property (nonatomic, assign, readonly) BOOL							isReplayingTrace;
+
+/**
+ * The source of the raw locations, e.g. a DMSyntheticLocationSource to test without a device. A running update continues with the new source.
+ * The delegates get nil as CLLocationManager for locations of other sources than core location.
+ * Default is nil, which uses core location.
+ */
+@property (nonatomic, retain)			id<DMLocationSource>			locationSource;
+
+/**
+ * Rejects raw locations of the source before they are used at all, e.g. a DMLocationOutlierFilter, see DMLocationFilter.h.
+ * It is reset when the source changes.
+ * Default is nil.
+ */
+@property (nonatomic, retain)			id<DMLocationFilter>			locationFilter;
+
 /**
  * The accuracy which should be aimed. If the accuracy is the desired one, the updating process will be stopped before the query time is reached.
  * Default is -1.
@@ -148,6 +661,33 @@
  */
 @property (nonatomic, assign)			NSTimeInterval					queryingInterval;
 
+/**
+ * If the accuracy did not improve for this number of samples the querying is stopped successfully with the best location.
+ * Useful if the desired accuracy cannot be reached, e.g. indoors. 0 disables it.
+ * Default is 0.
+ */
+@property (nonatomic, assign)			NSUInteger						convergenceSampleCount;
+
+/**
+ * If the accuracy did not improve for this amount of time the querying is stopped successfully with the best location.
+ * It is checked whenever a new location arrives. 0 disables it.
+ * Default is 0.
+ */
+@property (nonatomic, assign)			NSTimeInterval					convergenceTimeInterval;
+
+/**
+ * If YES the querying starts with 'provisionalAccuracy' to deliver a fast first location and escalates to 'desiredAccuracy' afterwards.
+ * The first location and each refinement are delivered as provisional by locationManager:didUpdateLocation:provisional:.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							escalatesAccuracy;
+
+/**
+ * The coarse accuracy used for the provisional location if 'escalatesAccuracy' is YES.
+ * Default is kCLLocationAccuracyKilometer.
+ */
+@property (nonatomic, assign)			CLLocationAccuracy				provisionalAccuracy;
+
 /**
  * Returns whether the location manager currently searches for new locations.
  */
@@ -176,6 +716,110 @@
  */
 @property (nonatomic, assign)			BOOL							updateLocationOnApplicationDidBecomeActive;
 
+/**
+ * If YES and 'updateLocationOnApplicationDidBecomeActive' is YES the delegates are informed immediately about the last location
+ * on activation of the app, as long as it is not older than 'cacheAge'. A fresh location is queried afterwards and delivered
+ * only if it moved at least 'revalidationDistance'.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							revalidatesCachedLocation;
+
+/**
+ * If the last location is younger than this amount of time no fresh location is queried on revalidation at all.
+ * Default is 0 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					revalidationAge;
+
+/**
+ * The distance a fresh location must differ from the revalidated one to be delivered.
+ * Default is 100 meters.
+ */
+@property (nonatomic, assign)			CLLocationDistance				revalidationDistance;
+
+/**
+ * A determined location closer than this distance to the last delivered one is not passed to the delegates.
+ * Default is 0 meters.
+ */
+@property (nonatomic, assign)			CLLocationDistance				suppressionDistance;
+
+/**
+ * A determined location younger than this amount of time than the last delivered one is not passed to the delegates.
+ * Default is 0 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					suppressionInterval;
+
+/**
+ * A location suppressed by 'suppressionDistance' or 'suppressionInterval' is passed nevertheless if its accuracy
+ * is at least this amount of meters better than the one of the last delivered location. 0 disables it.
+ * Default is 0 meters.
+ */
+@property (nonatomic, assign)			CLLocationAccuracy				suppressionAccuracyImprovement;
+
+/**
+ * If YES the loop does not restart while core motion considers the device stationary and keeps serving the last location.
+ * The loop resumes as soon as motion is detected by the motion activity or the accelerometer.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							pausesWhileStationary;
+
+/**
+ * Returns whether the device is considered stationary. Only determined if 'pausesWhileStationary' is YES.
+ */
+@property (nonatomic, assign, readonly) BOOL							isStationary;
+
+/**
+ * The maximum amount of seconds per hour core location may update the location, 0 for no limit.
+ * Queries are shortened to the remaining budget and the sleep of the loop is stretched to stay within it.
+ * Default is 0.
+ */
+@property (nonatomic, assign)			NSTimeInterval					energyBudget;
+
+/**
+ * The amount of seconds core location updated the location within the last hour.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					energyBudgetSpent;
+
+/**
+ * Time to the first location and to the desired accuracy, discarded locations, radio time and timeouts of the queries.
+ * Use it to tune 'queryingInterval' and 'desiredAccuracy'. The queries are also marked as os_signpost intervals.
+ */
+@property (nonatomic, assign, readonly) DMLocationManagerMetrics		metrics;
+
+/**
+ * If YES and 'loop' is YES the location is updated continuously and the locations are delivered in batches
+ * by locationManager:didUpdateLocations: after 'batchFlushInterval' or 'batchFlushDistance'.
+ * If available core location defers the updates meanwhile, which requires the 'location' background mode of the app.
+ * Batching goes on in background.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							batchesLocations;
+
+/**
+ * The maximum amount of time locations are collected before they are delivered.
+ * Default is 300 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					batchFlushInterval;
+
+/**
+ * The distance to travel after which the collected locations are delivered.
+ * Default is 1000 meters.
+ */
+@property (nonatomic, assign)			CLLocationDistance				batchFlushDistance;
+
+/**
+ * Defines how to keep the location warm while the app is in background. Unless it is DMLocationManagerBackgroundPolicyStop
+ * 'location' is updated silently in background and a running updating is resumed on activation.
+ * Updating with low accuracy in background requires the 'location' background mode of the app.
+ * Default is DMLocationManagerBackgroundPolicyStop.
+ */
+@property (nonatomic, assign)			DMLocationManagerBackgroundPolicy	backgroundPolicy;
+
+/**
+ * The accuracy used in background by DMLocationManagerBackgroundPolicyLowAccuracy.
+ * Default is kCLLocationAccuracyThreeKilometers.
+ */
+@property (nonatomic, assign)			CLLocationAccuracy				backgroundAccuracy;
+
 /**
  * Repeat searching for new locations after a location was determined.
  * Default is NO.
@@ -189,17 +833,91 @@
 @property (nonatomic, assign)			NSTimeInterval					loopTimeInterval;
 
 /**
- * Returns the shared instance.
+ * If YES the sleep between loop cycles is derived from the speed instead of 'loopTimeInterval', so the device moves
+ * about 'adaptiveLoopDistance' per cycle. The accuracy of a cycle relaxes from 'desiredAccuracy' with the distance moved per cycle
+ * up to 100 meters. While stationary it sleeps 'maximumLoopTimeInterval' with that relaxed accuracy.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							adaptsLoopTimeInterval;
+
+/**
+ * The shortest sleep of the adaptive loop.
+ * Default is 10 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					minimumLoopTimeInterval;
+
+/**
+ * The longest sleep of the adaptive loop.
+ * Default is 300 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					maximumLoopTimeInterval;
+
+/**
+ * The distance the device should move between the cycles of the adaptive loop.
+ * Default is 250 meters.
+ */
+@property (nonatomic, assign)			CLLocationDistance				adaptiveLoopDistance;
+
+/**
+ * The sleep before the next loop cycle, which is 'loopTimeInterval' unless 'adaptsLoopTimeInterval' is YES.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					currentLoopTimeInterval;
+
+/**
+ * If YES the core location manager, the filtering of locations and the timers run on a private serial queue instead of the main thread.
+ * Delegates added without a queue are informed on this private queue as well.
+ * Changing the value stops updating the location and recreates the core location manager on next start.
+ * Default is NO.
+ */
+@property (nonatomic, assign)			BOOL							processesInBackground;
+
+/**
+ * The amount of time the querying and loop timers may be deferred by the system to coalesce wakeups and save energy.
+ * Default is 1 second.
+ */
+@property (nonatomic, assign)			NSTimeInterval					timerLeeway;
+
+/**
+ * Returns the shared instance. It is safe to call from any thread.
+ * The core location manager is not created before the first start of updating the location.
  */
 + (DMLocationManager*) sharedLocationManager;
 
+/**
+ * Create a manager persisting its location at the path instead of the file shared by the app, e.g. for tests and benchmarks.
+ * If the path is nil the manager neither reads nor writes any persisted location. Init uses the default path.
+ */
+- (id)initWithCachePath:(NSString*)cachePath;
+
 /**
  * Add a delegate of kind DMLocationManagerDelegate which must be served.
+ * The delegate is not retained and will be removed automatically on deallocation.
+ * Adding and removing rebuild the table of the delegates in O(n), so informing them stays O(1) per delegate without asking any of them.
  *
  * @see DMLocationManagerDelegate
  */
 - (void)addDelegate:(id<DMLocationManagerDelegate>) delegate;
 
+/**
+ * Add a delegate of kind DMLocationManagerDelegate which must be served on the given queue.
+ * If queue is NULL the delegate is informed on the queue processing the locations, which is the main queue unless 'processesInBackground' is YES.
+ * Adding a delegate again changes its queue.
+ *
+ * @see DMLocationManagerDelegate
+ */
+- (void)addDelegate:(id<DMLocationManagerDelegate>) delegate queue:(dispatch_queue_t)queue;
+
+/**
+ * Add a delegate which is informed continuously by locationManager:didUpdateToLocation:fromLocation: instead of by the queries.
+ * Every location of the source is passed on once it moved 'distanceFilter' and 'updateInterval' passed since the last one
+ * of the delegate, which is passed as fromLocation. The location source runs while any delegate is subscribed, with the
+ * strictest accuracy and distance filter of the subscriptions. It is adjusted without restart on adding and removing.
+ * Adding the delegate again changes its subscription, adding it without subscription ends it.
+ *
+ * @see DMLocationManagerDelegate
+ */
+- (void)addDelegate:(id<DMLocationManagerDelegate>) delegate queue:(dispatch_queue_t)queue subscription:(DMLocationSubscription)subscription;
+
 /**
  * Remove a delegate of kind DMLocationManagerDelegate which must not be served.
  *
@@ -207,6 +925,30 @@
  */
 - (void)removeDelegate:(id<DMLocationManagerDelegate>) delegate;
 
+/**
+ * Copy the last determined location into the sample. Can be called from any thread, never blocks and never allocates.
+ * Returns NO if no location was determined yet.
+ */
+- (BOOL)getLocationSnapshot:(DMLocationSample*)snapshot;
+
+/**
+ * Copy the last smoothed estimate. Can be called from any thread, never blocks and never allocates.
+ * Returns NO if 'smoothsLocations' is NO or no location was smoothed yet.
+ */
+- (BOOL)getSmoothedEstimate:(DMLocationEstimate*)estimate;
+
+/**
+ * Copy up to the amount of the points of the 'pointIndex' nearest to the 'location', ordered by distance.
+ * Returns how many were copied. Does not allocate.
+ */
+- (NSUInteger)getNearestPoints:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count;
+
+/**
+ * Copy up to the amount of the points of the 'pointIndex' within the radius in meters around the 'location', nearest first.
+ * Returns how many were copied. Does not allocate.
+ */
+- (NSUInteger)getPoints:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count withinRadius:(CLLocationDistance)radius;
+
 /**
  * Start updating the location
  */
@@ -217,6 +959,36 @@
  */
 - (void)stopUpdatingLocation;
 
+/**
+ * Request a location once. The completion is invoked on the engine queue as soon as a location is at most 'maximumAge' seconds old
+ * and reaches the accuracy, immediately if 'location' does, or after the timeout with an error. Requests do not inform the delegates.
+ * The location source runs at the strictest accuracy of all requests and running queries and stops after the last request finished.
+ * Returns the request to cancel it.
+ */
+- (DMLocationRequest*)requestLocationWithAccuracy:(CLLocationAccuracy)accuracy maximumAge:(NSTimeInterval)maximumAge timeout:(NSTimeInterval)timeout completion:(DMLocationRequestCompletion)completion;
+
+/**
+ * Finish the request without invoking its completion.
+ */
+- (void)cancelRequest:(DMLocationRequest*)request;
+
+/**
+ * Feed the locations of the trace file through the filters, timers and delegates as if core location delivered them.
+ * The trace replaces the 'locationSource' until its last location. A speed of 1.0 keeps the original intervals, higher speeds shorten them
+ * and 0 replays as fast as possible. Returns NO if the file is no trace.
+ */
+- (BOOL)replayTraceAtPath:(NSString*)path speed:(double)speed;
+
+/**
+ * Reset the 'metrics' of all queries.
+ */
+- (void)resetMetrics;
+
+/**
+ * Stop replaying and use the locations of core location again.
+ */
+- (void)stopReplayingTrace;
+
 @end
 
 
@@ -247,4 +1019,42 @@
  */
 - (void)locationManagerDidStopUpdateLocation:(DMLocationManager*)manager;
 
+/**
+ * Informs about a new location. If provisional the querying goes on to refine the location, else the querying is finished.
+ * Provisional locations are only delivered if 'escalatesAccuracy' is YES. After provisional ones the querying always ends with a location
+ * which is not provisional, even if it is not delivered as new location because of revalidation or suppression, unless the querying fails or is stopped.
+ *
+ * @see DMLocationManager
+ */
+- (void)locationManager:(DMLocationManager*)manager didUpdateLocation:(CLLocation*)location provisional:(BOOL)isProvisional;
+
+/**
+ * Informs about the smoothed estimate after each raw location, if 'smoothsLocations' is YES.
+ *
+ * @see DMLocationManager
+ */
+- (void)locationManager:(DMLocationManager*)manager didUpdateEstimate:(DMLocationEstimate)estimate ofLocation:(CLLocation*)location;
+
+/**
+ * Informs that the location entered or exited one of the 'geofences'.
+ *
+ * @see DMLocationManager
+ */
+- (void)locationManager:(DMLocationManager*)manager didEnterGeofence:(CLCircularRegion*)geofence;
+- (void)locationManager:(DMLocationManager*)manager didExitGeofence:(CLCircularRegion*)geofence;
+
+/**
+ * Informs that other points of the 'pointIndex' became the nearest ones or their order changed, see getNearestPoints:count:.
+ *
+ * @see DMLocationManager
+ */
+- (void)locationManagerDidUpdateNearestPoints:(DMLocationManager*)manager;
+
+/**
+ * Informs about the placemark after the location entered another tile, if 'reverseGeocodesLocation' is YES.
+ *
+ * @see DMLocationManager
+ */
+- (void)locationManager:(DMLocationManager*)manager didUpdatePlacemark:(CLPlacemark*)placemark forLocation:(CLLocation*)location;
+
 @end
\ No newline at end of file
@@ -15,29 +15,681 @@
 //
 
 #import "DMLocationManager.h"
+#import "DMLocationCache.h"
+#import "DMLocationHistory.h"
+#import "DMLocationSimplifier.h"
+#import "DMLocationTrace.h"
+#import "DMLocationSource.h"
+#import "DMLocationRequest.h"
+#import "DMLocationFilter.h"
+#import "DMLocationSmoother.h"
+#import "DMLocationGeofencer.h"
+#import "DMLocationUploader.h"
+#import <CoreMotion/CoreMotion.h>
+#import <objc/runtime.h>
+#import <mach/mach_time.h>
+#if DM_LOCATION_MANAGER_SIGNPOSTS
+#import <os/signpost.h>
+#endif
+
+
+#pragma mark -
+#pragma mark Samples
+
+NSTimeInterval DMLocationManagerMonotonicTime(void)
+{
+	static mach_timebase_info_data_t timebase;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		mach_timebase_info(&timebase);
+	});
+	
+	// Unlike mach_absolute_time it counts the sleep, so ages of locations recorded before are not too small
+	return (NSTimeInterval)mach_continuous_time() * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+DMLocationSample DMLocationSampleMakeWithLocation(CLLocation* location)
+{
+	DMLocationSample sample;
+	sample.latitude				= location.coordinate.latitude;
+	sample.longitude			= location.coordinate.longitude;
+	sample.horizontalAccuracy	= location.horizontalAccuracy;
+	sample.verticalAccuracy		= location.verticalAccuracy;
+	sample.speed				= location.speed;
+	sample.course				= location.course;
+	sample.timestamp			= DMLocationManagerMonotonicTime() + [location.timestamp timeIntervalSinceNow];
+	
+	return sample;
+}
+
+DMLocationSubscription DMLocationSubscriptionMake(CLLocationAccuracy desiredAccuracy, CLLocationDistance distanceFilter, NSTimeInterval updateInterval)
+{
+	DMLocationSubscription subscription;
+	subscription.desiredAccuracy	= desiredAccuracy;
+	subscription.distanceFilter		= distanceFilter;
+	subscription.updateInterval		= updateInterval;
+	
+	return subscription;
+}
+
+/**
+ * Field wise atomic copy of a sample, so concurrent readers and the writer of a sequence lock do not race.
+ */
+static inline void DMLocationSampleCopyRelaxed(DMLocationSample* destination, const DMLocationSample* source)
+{
+	__atomic_store_n(&destination->latitude,			__atomic_load_n(&source->latitude, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->longitude,			__atomic_load_n(&source->longitude, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->horizontalAccuracy,	__atomic_load_n(&source->horizontalAccuracy, __ATOMIC_RELAXED),	__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->verticalAccuracy,	__atomic_load_n(&source->verticalAccuracy, __ATOMIC_RELAXED),		__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->speed,				__atomic_load_n(&source->speed, __ATOMIC_RELAXED),					__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->course,				__atomic_load_n(&source->course, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->timestamp,			__atomic_load_n(&source->timestamp, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+}
+
+/**
+ * Field wise atomic copy of an estimate for its sequence lock.
+ */
+static inline void DMLocationEstimateCopyRelaxed(DMLocationEstimate* destination, const DMLocationEstimate* source)
+{
+	__atomic_store_n(&destination->latitude,			__atomic_load_n(&source->latitude, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->longitude,			__atomic_load_n(&source->longitude, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->horizontalAccuracy,	__atomic_load_n(&source->horizontalAccuracy, __ATOMIC_RELAXED),	__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->velocityEast,		__atomic_load_n(&source->velocityEast, __ATOMIC_RELAXED),			__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->velocityNorth,		__atomic_load_n(&source->velocityNorth, __ATOMIC_RELAXED),			__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->speed,				__atomic_load_n(&source->speed, __ATOMIC_RELAXED),					__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->course,				__atomic_load_n(&source->course, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+	__atomic_store_n(&destination->timestamp,			__atomic_load_n(&source->timestamp, __ATOMIC_RELAXED),				__ATOMIC_RELAXED);
+}
+
+
+#pragma mark -
+#pragma mark Dispatch table
+
+/**
+ * Callbacks of DMLocationManagerDelegate which are served by the location manager.
+ */
+typedef enum
+{
+	DMLocationManagerCallbackDidChangeLocationServiceEnabledState = 0,
+	DMLocationManagerCallbackWillUpdateLocation,
+	DMLocationManagerCallbackDidStopUpdateLocation,
+	DMLocationManagerCallbackDidUpdateToLocation,
+	DMLocationManagerCallbackDidFailWithError,
+	DMLocationManagerCallbackDidUpdateLocationProvisional,
+	DMLocationManagerCallbackDidUpdateLocations,
+	DMLocationManagerCallbackSubscribedUpdateToLocation,	// locationManager:didUpdateToLocation:fromLocation: of subscribed delegates
+	DMLocationManagerCallbackDidUpdateEstimate,
+	DMLocationManagerCallbackDidEnterGeofence,
+	DMLocationManagerCallbackDidExitGeofence,
+	DMLocationManagerCallbackDidUpdateNearestPoints,
+	DMLocationManagerCallbackDidUpdatePlacemark,
+	
+	DMLocationManagerCallbackCount
+} DMLocationManagerCallback;
+
+/**
+ * The subscription of a delegate and the last location it was informed about. The last location is only touched on the engine,
+ * the object survives rebuilding the dispatch table.
+ */
+@interface DMLocationManagerSubscription : NSObject
+{
+@private
+	DMLocationSubscription	_subscription;
+	CLLocation*				_lastLocation;
+	NSTimeInterval			_lastTime;		// Monotonic time the delegate was informed
+}
+
+@property (nonatomic, assign, readonly) DMLocationSubscription subscription;
+@property (nonatomic, retain, readonly) CLLocation* lastLocation;
+
+- (id)initWithSubscription:(DMLocationSubscription)subscription;
+- (BOOL)acceptsLocation:(CLLocation*)location atTime:(NSTimeInterval)time;
+- (void)setLastLocation:(CLLocation*)location atTime:(NSTimeInterval)time;
+
+@end
+
+@implementation DMLocationManagerSubscription
+
+@synthesize subscription = _subscription;
+@synthesize lastLocation = _lastLocation;
+
+- (id)initWithSubscription:(DMLocationSubscription)subscription
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_subscription = subscription;
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[_lastLocation release];
+	
+	[super dealloc];
+}
+
+/**
+ * Returns whether the delegate wants the location regarding the distance and the interval since its last one.
+ *
+ */
+- (BOOL)acceptsLocation:(CLLocation*)location atTime:(NSTimeInterval)time
+{
+	if (nil == _lastLocation)
+		return YES;
+	
+	if (time - _lastTime < _subscription.updateInterval)
+		return NO;
+	
+	return (_subscription.distanceFilter <= 0.0 || [location distanceFromLocation: _lastLocation] >= _subscription.distanceFilter);
+}
+
+- (void)setLastLocation:(CLLocation*)location atTime:(NSTimeInterval)time
+{
+	[_lastLocation release];
+	_lastLocation	= [location retain];
+	_lastTime		= time;
+}
+
+@end
+
+/**
+ * A weakly referenced delegate responding to a callback together with its cached implementation.
+ * The delegate must be accessed by objc_loadWeak() as it becomes nil on deallocation.
+ * If a queue is set the delegate is informed asynchronously on it, else directly on the engine queue.
+ * The subscription is only set for subscribed delegates.
+ */
+typedef struct
+{
+	id					delegate;
+	IMP					implementation;
+	dispatch_queue_t	queue;
+	DMLocationManagerSubscription*	subscription;
+} DMLocationManagerDispatchEntry;
+
+/**
+ * All delegates responding to one callback.
+ */
+typedef struct
+{
+	DMLocationManagerDispatchEntry*	entries;
+	NSUInteger						count;
+} DMLocationManagerDispatchList;
+
+static SEL DMLocationManagerSelectorForCallback(DMLocationManagerCallback callback)
+{
+	switch (callback)
+	{
+		case DMLocationManagerCallbackDidChangeLocationServiceEnabledState:
+			return @selector(locationManager:didChangeLocationServiceEnabledState:);
+		case DMLocationManagerCallbackWillUpdateLocation:
+			return @selector(locationManagerWillUpdateLocation:);
+		case DMLocationManagerCallbackDidStopUpdateLocation:
+			return @selector(locationManagerDidStopUpdateLocation:);
+		case DMLocationManagerCallbackDidUpdateToLocation:
+		case DMLocationManagerCallbackSubscribedUpdateToLocation:
+			return @selector(locationManager:didUpdateToLocation:fromLocation:);
+		case DMLocationManagerCallbackDidFailWithError:
+			return @selector(locationManager:didFailWithError:);
+		case DMLocationManagerCallbackDidUpdateLocationProvisional:
+			return @selector(locationManager:didUpdateLocation:provisional:);
+		case DMLocationManagerCallbackDidUpdateLocations:
+			return @selector(locationManager:didUpdateLocations:);
+		case DMLocationManagerCallbackDidUpdateEstimate:
+			return @selector(locationManager:didUpdateEstimate:ofLocation:);
+		case DMLocationManagerCallbackDidEnterGeofence:
+			return @selector(locationManager:didEnterGeofence:);
+		case DMLocationManagerCallbackDidExitGeofence:
+			return @selector(locationManager:didExitGeofence:);
+		case DMLocationManagerCallbackDidUpdateNearestPoints:
+			return @selector(locationManagerDidUpdateNearestPoints:);
+		case DMLocationManagerCallbackDidUpdatePlacemark:
+			return @selector(locationManager:didUpdatePlacemark:forLocation:);
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Immutable capability table of the delegates. It is built once whenever delegates are added or removed,
+ * so informing the delegates does not need to ask any of them whether it responds to a callback.
+ * Retain the table while iterating it to be safe against delegates changing the registry meanwhile.
+ * The table does not retain the delegates. Subscribed delegates get their locations by their own callback list,
+ * the table also aggregates what their subscriptions need.
+ * Informing is O(1) per delegate and only locks to retain the table, adding and removing rebuild the table in O(n) with a single
+ * allocation for all callback lists. Registries change rarely compared to the callbacks, so the cheap reading wins.
+ */
+@interface DMLocationManagerDispatchTable : NSObject
+{
+@private
+	DMLocationManagerDispatchEntry*	_storage;			// One allocation holding the lists of all callbacks
+	DMLocationManagerDispatchEntry*	_entries[DMLocationManagerCallbackCount];
+	NSUInteger						_counts[DMLocationManagerCallbackCount];
+	NSUInteger						_subscriptionCount;
+	DMLocationSubscription			_aggregateSubscription;	// Strictest accuracy and distance filter
+}
+
+@property (nonatomic, assign, readonly) NSUInteger subscriptionCount;
+@property (nonatomic, assign, readonly) DMLocationSubscription aggregateSubscription;
+
+- (id)initWithDelegates:(NSArray*)delegates queues:(NSMapTable*)queues subscriptions:(NSMapTable*)subscriptions;
+- (DMLocationManagerDispatchList)listForCallback:(DMLocationManagerCallback)callback;
+
+@end
+
+@implementation DMLocationManagerDispatchTable
+
+@synthesize subscriptionCount		= _subscriptionCount;
+@synthesize aggregateSubscription	= _aggregateSubscription;
+
+- (id)initWithDelegates:(NSArray*)delegates queues:(NSMapTable*)queues subscriptions:(NSMapTable*)subscriptions
+{
+	self = [super init];
+	if (self != nil)
+	{
+		NSUInteger delegateCount = [delegates count];
+		
+		_aggregateSubscription = DMLocationSubscriptionMake(DBL_MAX, DBL_MAX, 0.0);
+		
+		for (id delegate in delegates)
+		{
+			DMLocationManagerSubscription* subscription = [subscriptions objectForKey: delegate];
+			if (nil == subscription)
+				continue;
+			
+			_subscriptionCount++;
+			_aggregateSubscription.desiredAccuracy	= MIN(_aggregateSubscription.desiredAccuracy, subscription.subscription.desiredAccuracy);
+			_aggregateSubscription.distanceFilter	= MIN(_aggregateSubscription.distanceFilter, MAX(subscription.subscription.distanceFilter, kCLDistanceFilterNone));
+		}
+		
+		_storage = (delegateCount > 0) ? malloc(DMLocationManagerCallbackCount * delegateCount * sizeof(DMLocationManagerDispatchEntry)) : NULL;
+		
+		for (NSUInteger callback = 0; callback < DMLocationManagerCallbackCount; callback++)
+		{
+			SEL selector = DMLocationManagerSelectorForCallback(callback);
+			
+			_entries[callback]	= (delegateCount > 0) ? _storage + callback * delegateCount : NULL;
+			_counts[callback]	= 0;
+			
+			for (id delegate in delegates)
+			{
+				if (NO == [delegate respondsToSelector: selector])
+					continue;
+				
+				// Subscribed delegates get the locations by their subscription instead of the queries
+				DMLocationManagerSubscription* subscription = [subscriptions objectForKey: delegate];
+				
+				if ((DMLocationManagerCallbackDidUpdateToLocation == callback && nil != subscription) || (DMLocationManagerCallbackSubscribedUpdateToLocation == callback && nil == subscription))
+					continue;
+				
+				DMLocationManagerDispatchEntry* entry = &_entries[callback][_counts[callback]++];
+				entry->delegate			= nil;
+				entry->implementation	= [delegate methodForSelector: selector];
+				entry->queue			= [queues objectForKey: delegate];
+				entry->subscription		= [subscription retain];
+				objc_storeWeak(&entry->delegate, delegate);
+				
+				if (entry->queue)
+					dispatch_retain(entry->queue);
+			}
+		}
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	for (NSUInteger callback = 0; callback < DMLocationManagerCallbackCount; callback++)
+	{
+		for (NSUInteger i = 0; i < _counts[callback]; i++)
+		{
+			objc_storeWeak(&_entries[callback][i].delegate, nil);
+			[_entries[callback][i].subscription release];
+			
+			if (_entries[callback][i].queue)
+				dispatch_release(_entries[callback][i].queue);
+		}
+	}
+	
+	free(_storage);
+	
+	[super dealloc];
+}
+
+- (DMLocationManagerDispatchList)listForCallback:(DMLocationManagerCallback)callback
+{
+	DMLocationManagerDispatchList list;
+	list.entries	= _entries[callback];
+	list.count		= _counts[callback];
+	
+	return list;
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark Energy meter
+
+#define DM_LOCATION_MANAGER_ENERGY_WINDOW		3600.0	// The energy budget is spent per hour
+#define DM_LOCATION_MANAGER_ENERGY_CAPACITY		128		// Sessions remembered within the window, the oldest are dropped
+
+/**
+ * Meters the time the location radio was on within the last hour.
+ * Sessions are kept in a fixed ring, so metering does not allocate.
+ */
+@interface DMLocationManagerEnergyMeter : NSObject
+{
+@private
+	NSTimeInterval	_starts[DM_LOCATION_MANAGER_ENERGY_CAPACITY];
+	NSTimeInterval	_ends[DM_LOCATION_MANAGER_ENERGY_CAPACITY];
+	NSUInteger		_head;				// Index of the next session
+	NSUInteger		_count;
+	NSTimeInterval	_runningStart;		// Start of the running session, 0 if the radio is off
+	NSTimeInterval	_averageDuration;	// Moving average of the session durations
+}
+
+@property (nonatomic, assign, readonly) NSTimeInterval averageDuration;
+
+- (void)radioDidStartAtTime:(NSTimeInterval)time;
+- (void)radioDidStopAtTime:(NSTimeInterval)time;
+- (NSTimeInterval)spentAtTime:(NSTimeInterval)time;
+- (NSTimeInterval)delayUntilSpentFallsTo:(NSTimeInterval)spent atTime:(NSTimeInterval)time;
+
+@end
+
+@implementation DMLocationManagerEnergyMeter
+
+@synthesize averageDuration = _averageDuration;
+
+- (void)radioDidStartAtTime:(NSTimeInterval)time
+{
+	if (_runningStart > 0.0)
+		return;
+	
+	_runningStart = time;
+}
+
+- (void)radioDidStopAtTime:(NSTimeInterval)time
+{
+	if (_runningStart <= 0.0)
+		return;
+	
+	NSTimeInterval duration = time - _runningStart;
+	
+	_starts[_head]	= _runningStart;
+	_ends[_head]	= time;
+	_head			= (_head + 1) % DM_LOCATION_MANAGER_ENERGY_CAPACITY;
+	_count			= MIN(_count + 1, DM_LOCATION_MANAGER_ENERGY_CAPACITY);
+	_runningStart	= 0.0;
+	
+	_averageDuration = (_averageDuration > 0.0) ? 0.75 * _averageDuration + 0.25 * duration : duration;
+}
+
+/**
+ * Returns the radio-on time within the window ending at the time. A running session counts until the time.
+ *
+ */
+- (NSTimeInterval)spentAtTime:(NSTimeInterval)time
+{
+	NSTimeInterval windowStart	= time - DM_LOCATION_MANAGER_ENERGY_WINDOW;
+	NSTimeInterval spent		= 0.0;
+	
+	for (NSUInteger i = 0; i < _count; i++)
+	{
+		NSUInteger index = (_head + DM_LOCATION_MANAGER_ENERGY_CAPACITY - 1 - i) % DM_LOCATION_MANAGER_ENERGY_CAPACITY;
+		
+		if (_ends[index] <= windowStart)
+			break;
+		
+		spent += MIN(_ends[index], time) - MAX(_starts[index], windowStart);
+	}
+	
+	if (_runningStart > 0.0)
+	{
+		spent += time - MAX(_runningStart, windowStart);
+	}
+	
+	return MAX(spent, 0.0);
+}
+
+/**
+ * Returns how long to wait without radio until the spent time of the window falls to the given one.
+ *
+ */
+- (NSTimeInterval)delayUntilSpentFallsTo:(NSTimeInterval)spent atTime:(NSTimeInterval)time
+{
+	if ([self spentAtTime: time] <= spent)
+		return 0.0;
+	
+	// The spent time only decreases while the radio is off, so search the delay within the window
+	NSTimeInterval lower = 0.0;
+	NSTimeInterval upper = DM_LOCATION_MANAGER_ENERGY_WINDOW;
+	
+	for (NSUInteger i = 0; i < 16; i++)
+	{
+		NSTimeInterval delay = 0.5 * (lower + upper);
+		
+		if ([self spentAtTime: time + delay] <= spent)
+			upper = delay;
+		else
+			lower = delay;
+	}
+	
+	return upper;
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark Engine thread
+
+/**
+ * Thread hosting the run loop of the core location manager if processing is done in background.
+ * Core location informs its delegate on the run loop of the thread it was created on, which must be running.
+ */
+@interface DMLocationManagerEngineThread : NSThread
++ (DMLocationManagerEngineThread*)sharedEngineThread;
+@end
+
+@implementation DMLocationManagerEngineThread
+
++ (DMLocationManagerEngineThread*)sharedEngineThread
+{
+	static DMLocationManagerEngineThread* sharedEngineThread = nil;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		sharedEngineThread = [DMLocationManagerEngineThread new];
+		[sharedEngineThread setName: @"de.devmob.DMLocationManager.engine"];
+		[sharedEngineThread start];
+	});
+	
+	return sharedEngineThread;
+}
+
+- (void)main
+{
+	NSAutoreleasePool* pool = [NSAutoreleasePool new];
+	
+	// Keep the run loop alive without any other input source
+	NSRunLoop* runLoop = [NSRunLoop currentRunLoop];
+	[runLoop addPort: [NSMachPort port] forMode: NSDefaultRunLoopMode];
+	
+	[pool drain];
+	
+	while (YES)
+	{
+		pool = [NSAutoreleasePool new];
+		[runLoop runMode: NSDefaultRunLoopMode beforeDate: [NSDate distantFuture]];
+		[pool drain];
+	}
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationManager (private)
 
 @interface DMLocationManager (private)
 - (void)initLocationManager;
 - (void)initListener;
+- (void)initCache;
 - (void)update;
 
+- (void)startMotionUpdates;
+- (void)stopMotionUpdates;
+- (void)startAccelerometerUpdates;
+- (void)stopAccelerometerUpdates;
+- (void)motionHandler:(BOOL)isStationary;
+- (void)pauseLoop;
+- (void)resumeLoop:(BOOL)startsUpdating;
+
+- (void)adaptLoop;
+- (NSTimeInterval)budgetedQueryingInterval;
+- (NSTimeInterval)budgetedLoopTimeInterval:(NSTimeInterval)loopTimeInterval;
+
+- (void)startBatching;
+- (void)stopBatching;
+- (void)allowDeferredUpdates;
+- (void)batchLocationHandler:(CLLocation*)location;
+- (void)batchTimerPassed;
+- (void)flushBatch;
+
+- (void)enterBackgroundMode;
+- (void)leaveBackgroundMode;
+- (void)backgroundLocationHandler:(CLLocation*)location;
+
+- (void)revalidateLocation;
+- (void)clearRevalidation;
+- (BOOL)isRedundantLocation:(CLLocation*)location;
+- (void)informDidDeliverLocation:(CLLocation*)location provisional:(BOOL)isProvisional;
+- (void)determinedLocationHandler;
+
+- (void)initEngine;
+- (void)performOnEngine:(dispatch_block_t)block;
+- (void)performOnEngineAndWait:(dispatch_block_t)block;
+- (void)startLocationUpdates;
+- (void)stopLocationUpdates;
+- (BOOL)isOnEngine;
+- (void)createLocationSource;
+- (void)createLocationSourceIfNeeded;
+- (void)destroyLocationSource;
+- (CLLocationManager*)coreLocationManager;
+- (BOOL)isSourceNeeded;
+- (void)setSourceAccuracy:(CLLocationAccuracy)accuracy;
+- (CLLocationAccuracy)engineAccuracy;
+- (void)applySourceRequirements;
+
+- (void)initTimers;
+- (void)destroyTimers;
+- (dispatch_source_t)newTimerWithHandler:(dispatch_block_t)handler;
+- (void)destroyTimer:(dispatch_source_t*)timer;
+- (void)armTimer:(dispatch_source_t)timer interval:(NSTimeInterval)interval;
+- (void)disarmTimer:(dispatch_source_t)timer;
+
 - (void)startQueryingTimer;
 - (void)stopQueryingTimer;
+- (void)queryingTimerPassed;
 
 - (void)startLoopTimer;
 - (void)stopLoopTimer;
+- (void)loopTimerPassed;
+
+- (BOOL)hasSharedSessionClients;
+- (void)updateSharedSession;
+- (void)armRequestTimer;
+- (void)requestTimerPassed;
+- (void)requestLocationHandler:(CLLocation*)location;
+- (void)finishRequest:(DMLocationRequest*)request error:(NSError*)error;
+- (void)failRequestsWithError:(NSError*)error;
 
 - (void)willUpdateLocationHandler;
 
+- (void)beginQueryMetrics;
+- (void)endQueryMetrics;
+- (NSTimeInterval)queryTime;
+
+- (void)storeLocation:(CLLocation*)location;
+- (void)recordLocation:(CLLocation*)location;
+- (void)rebuildSimplifier;
+- (void)locationHandler:(CLLocation*)newLocation;
+- (BOOL)hasConverged;
+- (void)publishSnapshotOfLocation:(CLLocation*)location;
+- (void)smoothLocation:(CLLocation*)location;
+- (void)publishEstimate:(DMLocationEstimate)estimate;
+- (void)geofenceLocation:(CLLocation*)location;
+- (BOOL)canMonitorGeofences;
+- (void)monitorGeofencesNearLocation:(CLLocation*)location;
+- (void)stopMonitoringGeofences;
+- (void)updateNearestPoints;
+- (void)resetNearestPoints;
+- (void)geocodeLocation:(CLLocation*)location;
+
+- (void)addDelegate:(id<DMLocationManagerDelegate>)delegate queue:(dispatch_queue_t)queue subscriptionObject:(DMLocationManagerSubscription*)subscription;
+- (BOOL)rebuildDispatchTable;
+- (void)purgeDispatchTable;
+- (DMLocationManagerDispatchTable*)currentDispatchTable;
+
+- (void)informCallback:(DMLocationManagerCallback)callback usingBlock:(void (^)(id delegate, IMP implementation))block;
 - (void)informDidChangeLocationServiceEnabledState:(BOOL)locationServiceEnabled;
 - (void)informWillUpdateLocation;
 - (void)informDidStopUpdateLocation;
 - (void)informDidUpdateToLocation:(CLLocation*)newLocation fromLocation:(CLLocation*)oldLocation;
+- (void)informSubscribersOfLocation:(CLLocation*)location;
 - (void)informDidFailWithError:(NSError*)error;
+- (void)informDidUpdateLocation:(CLLocation*)location provisional:(BOOL)isProvisional;
+- (void)informDidUpdateLocations:(NSArray*)locations;
+- (void)informDidUpdateEstimate:(DMLocationEstimate)estimate ofLocation:(CLLocation*)location;
+- (void)informDidEnterGeofence:(CLCircularRegion*)geofence;
+- (void)informDidExitGeofence:(CLCircularRegion*)geofence;
+- (void)informDidUpdateNearestPoints;
+- (void)informDidUpdatePlacemark:(CLPlacemark*)placemark forLocation:(CLLocation*)location;
 @end
 
 static DMLocationManager* sharedLocationManager = nil;
 
+// Below this speed in meters per second the device is considered stationary
+#define DM_LOCATION_MANAGER_STATIONARY_SPEED			0.5
+
+// Coarsest accuracy the adaptive loop relaxes to and the share of the distance moved per cycle the accuracy may reach
+#define DM_LOCATION_MANAGER_ADAPTIVE_ACCURACY			kCLLocationAccuracyHundredMeters
+#define DM_LOCATION_MANAGER_ADAPTIVE_ACCURACY_SHARE		0.25
+
+// Accelerometer sampling while watching for motion, deviation from gravity in g counting as motion and calm samples until stationary
+#define DM_LOCATION_MANAGER_ACCELEROMETER_INTERVAL		0.5
+#define DM_LOCATION_MANAGER_MOTION_THRESHOLD			0.05
+#define DM_LOCATION_MANAGER_STATIONARY_SAMPLES			60
+
+#if DM_LOCATION_MANAGER_SIGNPOSTS
+static os_log_t DMLocationManagerSignpostLog(void) API_AVAILABLE(ios(12.0))
+{
+	static os_log_t log;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		log = os_log_create("de.devmob.DMLocationManager", "Query");
+	});
+	
+	return log;
+}
+#endif
+
+// Queries are not shortened below this amount of seconds by the energy budget
+#define DM_LOCATION_MANAGER_MINIMUM_BUDGETED_QUERY		2.0
+
+// Region monitored around the nearest geofences, its minimum radius in meters and the location requested after leaving it
+static NSString* const DMLocationManagerGeofenceBoundaryIdentifier = @"de.devmob.DMLocationManager.geofenceBoundary";
+#define DM_LOCATION_MANAGER_MINIMUM_GEOFENCE_BOUNDARY	100.0
+#define DM_LOCATION_MANAGER_GEOFENCE_BOUNDARY_ACCURACY	kCLLocationAccuracyHundredMeters
+#define DM_LOCATION_MANAGER_GEOFENCE_BOUNDARY_TIMEOUT	30.0
+
 @implementation DMLocationManager
 
 @synthesize location									= _location;
@@ -55,12 +707,70 @@ static DMLocationManager* sharedLocationManager = nil;
 @synthesize loopTimeInterval							= _loopTimeInterval;
 @synthesize loop										= _loop;
 
+@dynamic	processesInBackground;
+@synthesize timerLeeway									= _timerLeeway;
+
+@synthesize convergenceSampleCount						= _convergenceSampleCount;
+@synthesize convergenceTimeInterval						= _convergenceTimeInterval;
+
+@synthesize escalatesAccuracy							= _escalatesAccuracy;
+@synthesize provisionalAccuracy							= _provisionalAccuracy;
+
+@dynamic	persistsLocation;
+
+@dynamic	adaptsLoopTimeInterval;
+@synthesize minimumLoopTimeInterval						= _minimumLoopTimeInterval;
+@synthesize maximumLoopTimeInterval						= _maximumLoopTimeInterval;
+@synthesize adaptiveLoopDistance						= _adaptiveLoopDistance;
+@dynamic	currentLoopTimeInterval;
+
+@dynamic	pausesWhileStationary;
+@dynamic	isStationary;
+
+@synthesize energyBudget								= _energyBudget;
+@dynamic	energyBudgetSpent;
+
+@synthesize batchesLocations							= _batchesLocations;
+@synthesize batchFlushInterval							= _batchFlushInterval;
+@synthesize batchFlushDistance							= _batchFlushDistance;
+
+@synthesize backgroundPolicy							= _backgroundPolicy;
+@synthesize backgroundAccuracy							= _backgroundAccuracy;
+
+@synthesize revalidatesCachedLocation					= _revalidatesCachedLocation;
+@synthesize revalidationAge								= _revalidationAge;
+@synthesize revalidationDistance						= _revalidationDistance;
+@synthesize suppressionDistance							= _suppressionDistance;
+@synthesize suppressionInterval							= _suppressionInterval;
+@synthesize suppressionAccuracyImprovement				= _suppressionAccuracyImprovement;
+@dynamic	locationAge;
+@dynamic	recentLocations;
+@dynamic	history;
+@dynamic	historyCapacity;
+@dynamic	simplifiedHistory;
+@dynamic	simplificationTolerance;
+@dynamic	traceRecordingPath;
+@dynamic	isReplayingTrace;
+@dynamic	locationSource;
+@dynamic	locationFilter;
+@dynamic	smoothsLocations;
+@dynamic	geofences;
+@dynamic	maximumMonitoredGeofences;
+@dynamic	pointIndex;
+@dynamic	nearestPointCount;
+@dynamic	reverseGeocodesLocation;
+@dynamic	geocoder;
+@dynamic	placemark;
+@dynamic	uploader;
+@dynamic	metrics;
+
 + (DMLocationManager*) sharedLocationManager
 {
-	if (nil == sharedLocationManager)
-	{
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
 		sharedLocationManager = [[DMLocationManager alloc] init];
-	}
+	});
 	
 	return sharedLocationManager;
 }
@@ -70,11 +780,20 @@ static DMLocationManager* sharedLocationManager = nil;
 #pragma mark Initialization
 
 - (id) init
+{
+	return [self initWithCachePath: [DMLocationCache defaultPath]];
+}
+
+- (id)initWithCachePath:(NSString*)cachePath
 {
 	self = [super init];
 	if (self != nil)
 	{
+		_cachePath = [cachePath copy];
+		
+		[self initEngine];
 		[self initLocationManager];
+		[self initCache];
 		[self initListener];
 	}
 	
@@ -83,21 +802,65 @@ static DMLocationManager* sharedLocationManager = nil;
 
 - (void)dealloc
 {
-	_locationManager.delegate = nil;
-	[_locationManager release];
+	[self destroyLocationSource];
+	[_locationSource release];
+	[_locationFilter release];
+	[_smoother release];
+	[_geofencer release];
+	[_monitoredGeofences release];
+	[_pointIndex release];
+	[_nearestPointsLocation release];
+	free(_nearestPoints);
+	free(_queriedPoints);
+	[_geocoder release];
+	[_placemark release];
+	[_uploader release];
+	
+	[_location release];
+	[_revalidatedLocation release];
+	[_deliveredLocation release];
+	[_previousLoopLocation release];
+	[_batch release];
+	[_cache release];
+	[_cachePath release];
+	[_history release];
+	[_simplifier release];
+	[_traceRecorder release];
+	[_energyMeter release];
+	
+	for (DMLocationRequest* request in _requests)
+	{
+		[request invalidate];
+	}
+	[_requests release];
+	
+	[self stopMotionUpdates];
+	[_motionQueue release];
 	
 	[_delegates release];
+	[_delegateQueues release];
+	[_delegateSubscriptions release];
+	[_delegatesLock release];
+	[_dispatchTable release];
 	
-	[_queryingTimer release];
+	[self destroyTimers];
+	
+	dispatch_queue_set_specific(_engineQueue, &_engineQueue, NULL, NULL);
+	dispatch_release(_engineQueue);
 	
 	[super dealloc];
 }
 
 - (void)initLocationManager
 {
-	_locationManager	= [CLLocationManager new];
+	_delegates			= [[NSHashTable weakObjectsHashTable] retain];
+	_delegateQueues		= [[NSMapTable weakToStrongObjectsMapTable] retain];
+	_delegateSubscriptions	= [[NSMapTable weakToStrongObjectsMapTable] retain];
+	_delegatesLock		= [NSLock new];
+	_dispatchTable		= [[DMLocationManagerDispatchTable alloc] initWithDelegates: nil queues: nil subscriptions: nil];
 	
-	_delegates			= [NSMutableArray new];
+	_desiredAccuracy	= kCLLocationAccuracyBest;
+	_sourceAccuracy		= _desiredAccuracy;
 	
 	_useCache			= YES;
 	_cacheAge           = 10.0;
@@ -109,15 +872,111 @@ static DMLocationManager* sharedLocationManager = nil;
 	
 	_loop				= NO;
 	_loopTimeInterval	= 10.0;
-}
-
-- (void)initListener
-{
-	// Listen for 'did become active' of application
-	[[NSNotificationCenter defaultCenter] addObserver: self
-											 selector: @selector(update:)
-												 name: UIApplicationDidBecomeActiveNotification
-											   object: nil];
+	
+	_convergenceSampleCount		= 0;
+	_convergenceTimeInterval	= 0.0;
+	
+	_escalatesAccuracy			= NO;
+	_provisionalAccuracy		= kCLLocationAccuracyKilometer;
+	_hasProvisionalLocation		= NO;
+	
+	_persistsLocation			= YES;
+	
+	_historyCapacity			= 256;
+	_history					= [[DMLocationHistory alloc] initWithCapacity: _historyCapacity];
+	_simplificationTolerance	= 0.0;
+	_simplifier					= nil;
+	
+	_adaptsLoopTimeInterval		= NO;
+	_minimumLoopTimeInterval	= 10.0;
+	_maximumLoopTimeInterval	= 300.0;
+	_adaptiveLoopDistance		= 250.0;
+	_adaptiveLoopTimeInterval	= _loopTimeInterval;
+	_adaptiveAccuracy			= kCLLocationAccuracyBest;
+	
+	_pausesWhileStationary		= NO;
+	
+	_energyBudget				= 0.0;
+	_energyMeter				= [DMLocationManagerEnergyMeter new];
+	
+	_batchesLocations			= NO;
+	_batchFlushInterval			= 300.0;
+	_batchFlushDistance			= 1000.0;
+	
+	_backgroundPolicy			= DMLocationManagerBackgroundPolicyStop;
+	_backgroundAccuracy			= kCLLocationAccuracyThreeKilometers;
+	
+	_revalidatesCachedLocation	= NO;
+	_revalidationAge			= 0.0;
+	_revalidationDistance		= 100.0;
+	
+	_suppressionDistance			= 0.0;
+	_suppressionInterval			= 0.0;
+	_suppressionAccuracyImprovement	= 0.0;
+	
+	// The core location source is created lazily on first start of updating the location, unless a custom source is set
+	_locationSource			= nil;
+	_isCustomLocationSource	= NO;
+	_isSourceUpdating		= NO;
+	_locationFilter			= nil;
+	
+	_smoothsLocations		= NO;
+	_smoother				= nil;
+	
+	_geofencer					= nil;
+	_monitoredGeofences			= [NSMutableArray new];
+	_geofenceBoundary			= nil;
+	_maximumMonitoredGeofences	= 20;
+	
+	_pointIndex				= nil;
+	_nearestPointCount		= 10;
+	_nearestPoints			= calloc(_nearestPointCount + 1, sizeof(DMLocationPointNeighbor));
+	_queriedPoints			= calloc(_nearestPointCount + 1, sizeof(DMLocationPointNeighbor));
+	_nearestPointsFound		= 0;
+	_nearestPointsLocation	= nil;
+	_nearestPointsSlack		= 0.0;
+	
+	_reverseGeocodesLocation	= NO;
+	_geocoder					= nil;
+	_placemark					= nil;
+	_placemarkTile				= 0;
+	_hasPlacemarkTile			= NO;
+	
+	_uploader					= nil;
+	
+	_requests				= nil;
+	_subscriptionCount		= 0;
+}
+
+/**
+ * Map the persistent cache and restore the last location, so it is available before core location delivers anything.
+ *
+ */
+- (void)initCache
+{
+	if (nil == _cachePath)
+		_persistsLocation = NO;
+	
+	if (NO == _persistsLocation)
+		return;
+	
+	_cache = [[DMLocationCache alloc] initWithPath: _cachePath];
+	
+	CLLocation* location = [_cache bestLocation];
+	if (location)
+	{
+		_location = [location retain];
+		[self publishSnapshotOfLocation: _location];
+	}
+}
+
+- (void)initListener
+{
+	// Listen for 'did become active' of application
+	[[NSNotificationCenter defaultCenter] addObserver: self
+											 selector: @selector(update:)
+												 name: UIApplicationDidBecomeActiveNotification
+											   object: nil];
 	
 	// Listen for application enters background
 	[[NSNotificationCenter defaultCenter] addObserver: self
@@ -128,33 +987,349 @@ static DMLocationManager* sharedLocationManager = nil;
 
 
 #pragma mark -
-#pragma mark Update
+#pragma mark Engine
 
-- (void)update:(NSNotification*)notification
+/**
+ * The engine runs the core location manager, the filtering of locations, the timers and informs the delegates.
+ * By default it is the main queue. If 'processesInBackground' is YES it is a private serial queue
+ * and core location is hosted by a dedicated run loop thread.
+ *
+ */
+- (void)initEngine
+{
+	_processesInBackground	= NO;
+	_engineQueue			= dispatch_get_main_queue();
+	_timerLeeway			= 1.0;
+	
+	dispatch_retain(_engineQueue);
+	dispatch_queue_set_specific(_engineQueue, &_engineQueue, self, NULL);
+	
+	[self initTimers];
+}
+
+/**
+ * Returns whether the current code is executed by the engine. The key is the address of the queue ivar, unique per instance,
+ * so managers sharing the main queue do not overwrite each other.
+ *
+ */
+- (BOOL)isOnEngine
+{
+	return (dispatch_get_specific(&_engineQueue) == self);
+}
+
+/**
+ * Execute the block on the engine. If already on the engine it is executed immediately.
+ *
+ */
+- (void)performOnEngine:(dispatch_block_t)block
 {
-	// Update location manager after restart of app
-	if ([UIApplicationDidBecomeActiveNotification isEqualToString: [notification name]])
+	if ([self isOnEngine])
 	{
-		// Did location service changed enabled state?
-		BOOL locationServicesEnabled = [CLLocationManager locationServicesEnabled];
-		if (_isLocationServiceEnabled != locationServicesEnabled)
-		{			
-			_isLocationServiceEnabled = locationServicesEnabled;
-			[self informDidChangeLocationServiceEnabledState: _isLocationServiceEnabled];
-		}
+		block();
+	}
+	else
+	{
+		dispatch_async(_engineQueue, block);
+	}
+}
+
+/**
+ * Execute the block on the engine and wait until it finished. If already on the engine it is executed immediately.
+ *
+ */
+- (void)performOnEngineAndWait:(dispatch_block_t)block
+{
+	if ([self isOnEngine])
+	{
+		block();
+	}
+	else
+	{
+		dispatch_sync(_engineQueue, block);
+	}
+}
+
+/**
+ * Start the updates of the location source and meter the time the radio is on.
+ *
+ */
+- (void)startLocationUpdates
+{
+	if (NO == _isSourceUpdating)
+		_radioStartTime = DMLocationManagerMonotonicTime();
+	
+	_isSourceUpdating = YES;
+	[_locationSource startUpdatingLocation];
+	[_energyMeter radioDidStartAtTime: DMLocationManagerMonotonicTime()];
+}
+
+- (void)stopLocationUpdates
+{
+	if (YES == _isSourceUpdating)
+	{
+		NSTimeInterval radioOnDuration = DMLocationManagerMonotonicTime() - _radioStartTime;
 		
-		// Whether to update the location on becoming active again
-		if (YES == _updateLocationOnApplicationDidBecomeActive)
-		{
-			[self startUpdatingLocation];
-		}
+		_metrics.radioOnDuration += radioOnDuration;
+		if (YES == _isMeasuringQuery)
+			_queryMetrics.radioOnDuration += radioOnDuration;
+	}
+	
+	_isSourceUpdating = NO;
+	[_locationSource stopUpdatingLocation];
+	[_energyMeter radioDidStopAtTime: DMLocationManagerMonotonicTime()];
+}
+
+/**
+ * Create the core location source on the thread whose run loop informs about new locations.
+ *
+ */
+- (void)createLocationSource
+{
+	if (YES == _processesInBackground)
+	{
+		[self performSelector: @selector(createLocationSourceOnCurrentThread) onThread: [DMLocationManagerEngineThread sharedEngineThread] withObject: nil waitUntilDone: YES];
+	}
+	else
+	{
+		[self performSelectorOnMainThread: @selector(createLocationSourceOnCurrentThread) withObject: nil waitUntilDone: YES];
+	}
+}
+
+/**
+ * Create the core location source if it was not done yet or the engine changed.
+ *
+ */
+- (void)createLocationSourceIfNeeded
+{
+	if (nil == _locationSource)
+	{
+		[self createLocationSource];
+	}
+}
+
+- (void)createLocationSourceOnCurrentThread
+{
+	_locationSource = [DMCoreLocationSource new];
+	[self setSourceAccuracy: _desiredAccuracy];
+}
+
+/**
+ * Stop the location source. The core location source is released, a custom one is kept for the next start.
+ *
+ */
+- (void)destroyLocationSource
+{
+	[self stopMonitoringGeofences];
+	[self stopLocationUpdates];
+	_locationSource.delegate = nil;
+	
+	if (YES == _isCustomLocationSource)
+		return;
+	
+	[_locationSource release];
+	_locationSource = nil;
+}
+
+/**
+ * Returns the core location manager passed to the delegates, nil if the locations are of another source.
+ *
+ */
+- (CLLocationManager*)coreLocationManager
+{
+	if (NO == [_locationSource isKindOfClass: [DMCoreLocationSource class]])
+		return nil;
+	
+	return [(DMCoreLocationSource*)_locationSource locationManager];
+}
+
+/**
+ * Returns whether a query, the batching or the background mode needs the updates of the source, apart from the requests.
+ *
+ */
+- (BOOL)isSourceNeeded
+{
+	return (_isQueryingTimerArmed || _isBatching || (_isInBackgroundMode && NO == _isMonitoringSignificantChanges));
+}
+
+/**
+ * Set the accuracy the engine needs from the source. The source gets a better one while a request or subscription needs it.
+ *
+ */
+- (void)setSourceAccuracy:(CLLocationAccuracy)accuracy
+{
+	_sourceAccuracy = accuracy;
+	[self applySourceRequirements];
+}
+
+/**
+ * Returns the accuracy the current stage of the engine needs: the batching, the escalation or adaptive accuracy of a query,
+ * the background mode or else the desired accuracy.
+ *
+ */
+- (CLLocationAccuracy)engineAccuracy
+{
+	if (YES == _isBatching)
+		return _desiredAccuracy;
+	
+	if (YES == _isQueryingTimerArmed)
+		return (YES == _isEscalatingAccuracy) ? _provisionalAccuracy : _sessionAccuracy;
+	
+	if (YES == _isInBackgroundMode && NO == _isMonitoringSignificantChanges)
+		return _backgroundAccuracy;
+	
+	return _desiredAccuracy;
+}
+
+/**
+ * Let the source aim for the strictest accuracy of the engine, the outstanding requests and the subscriptions.
+ * If the source only runs for requests and subscriptions their accuracy is enough, and only subscriptions allow a distance filter.
+ * Changing them does not restart the source.
+ *
+ */
+- (void)applySourceRequirements
+{
+	DMLocationManagerDispatchTable* dispatchTable	= [self currentDispatchTable];
+	BOOL isSourceNeeded								= [self isSourceNeeded];
+	BOOL hasClients									= [self hasSharedSessionClients];
+	CLLocationAccuracy accuracy						= (NO == hasClients || YES == isSourceNeeded) ? _sourceAccuracy : DBL_MAX;
+	CLLocationDistance distanceFilter				= kCLDistanceFilterNone;
+	
+	for (DMLocationRequest* request in _requests)
+	{
+		accuracy = MIN(accuracy, request.desiredAccuracy);
 	}
 	
-	// Stop all processes on app entering background
-	else if ([UIApplicationDidEnterBackgroundNotification isEqualToString: [notification name]])
+	if (dispatchTable.subscriptionCount > 0)
 	{
+		accuracy = MIN(accuracy, dispatchTable.aggregateSubscription.desiredAccuracy);
+		
+		if (NO == isSourceNeeded && 0 == [_requests count])
+			distanceFilter = dispatchTable.aggregateSubscription.distanceFilter;
+	}
+	
+	if (_locationSource.desiredAccuracy != accuracy)
+		_locationSource.desiredAccuracy = accuracy;
+	
+	if (_locationSource.distanceFilter != distanceFilter)
+		_locationSource.distanceFilter = distanceFilter;
+}
+
+- (void)setProcessesInBackground:(BOOL)processesInBackground
+{
+	if (_processesInBackground == processesInBackground)
+		return;
+	
+	// Finish the current work of the engine before switching it
+	[self performOnEngineAndWait: ^{
 		[self stopUpdatingLocation];
+		[self destroyLocationSource];
+	}];
+	
+	dispatch_queue_set_specific(_engineQueue, &_engineQueue, NULL, NULL);
+	dispatch_release(_engineQueue);
+	
+	_processesInBackground = processesInBackground;
+	
+	if (YES == _processesInBackground)
+	{
+		_engineQueue = dispatch_queue_create("de.devmob.DMLocationManager.engine", DISPATCH_QUEUE_SERIAL);
+	}
+	else
+	{
+		_engineQueue = dispatch_get_main_queue();
+		dispatch_retain(_engineQueue);
 	}
+	
+	dispatch_queue_set_specific(_engineQueue, &_engineQueue, self, NULL);
+	
+	dispatch_set_target_queue(_queryingTimer, _engineQueue);
+	dispatch_set_target_queue(_loopTimer, _engineQueue);
+	dispatch_set_target_queue(_batchTimer, _engineQueue);
+	dispatch_set_target_queue(_requestTimer, _engineQueue);
+	
+	// Outstanding requests and the monitoring of the geofences go on with the new engine
+	[self performOnEngine: ^{
+		[self updateSharedSession];
+		[self monitorGeofencesNearLocation: _location];
+	}];
+}
+
+- (BOOL)processesInBackground
+{
+	return _processesInBackground;
+}
+
+
+#pragma mark -
+#pragma mark Update
+
+- (void)update:(NSNotification*)notification
+{
+	NSString* name = [notification name];
+	
+	[self performOnEngine: ^{
+		// Update location manager after restart of app
+		if ([UIApplicationDidBecomeActiveNotification isEqualToString: name])
+		{
+			BOOL resumesUpdating = _resumesOnActivation;
+			_resumesOnActivation = NO;
+			
+			// The radio is woken up anyway
+			[_uploader flush];
+			
+			// Keep core location running until it is known whether a query follows
+			[self leaveBackgroundMode];
+			
+			// Did location service changed enabled state?
+			BOOL locationServicesEnabled = [CLLocationManager locationServicesEnabled];
+			if (_isLocationServiceEnabled != locationServicesEnabled)
+			{
+				_isLocationServiceEnabled = locationServicesEnabled;
+				[self informDidChangeLocationServiceEnabledState: _isLocationServiceEnabled];
+			}
+			
+			// Whether to update the location on becoming active again
+			if (YES == _updateLocationOnApplicationDidBecomeActive && YES == _revalidatesCachedLocation)
+			{
+				[self revalidateLocation];
+			}
+			else if (YES == _updateLocationOnApplicationDidBecomeActive || YES == resumesUpdating)
+			{
+				[self startUpdatingLocation];
+			}
+			
+			// Stop the warm core location if no query, batching, request or subscription needs it
+			if (NO == [self isSourceNeeded] && NO == [self hasSharedSessionClients])
+			{
+				[self stopLocationUpdates];
+				
+				if (nil == _geofenceBoundary)
+					_locationSource.delegate = nil;
+			}
+		}
+		
+		// Stop all processes on app entering background
+		else if ([UIApplicationDidEnterBackgroundNotification isEqualToString: name])
+		{
+			// Upload while the app may still use the network
+			[_uploader flush];
+			
+			// Batching is meant to track continuously, core location defers the updates in background
+			if (YES == _isBatching)
+				return;
+			
+			BOOL isUpdating = (_isQueryingTimerArmed || _isLoopTimerArmed || _isLoopPaused);
+			
+			[self stopUpdatingLocation];
+			
+			// Keep the location warm with little energy instead of a cold start on activation
+			if (DMLocationManagerBackgroundPolicyStop != _backgroundPolicy)
+			{
+				_resumesOnActivation = isUpdating;
+				[self enterBackgroundMode];
+			}
+		}
+	}];
 }
 
 
@@ -162,196 +1337,2308 @@ static DMLocationManager* sharedLocationManager = nil;
 #pragma mark Delegates
 
 - (void)addDelegate:(id<DMLocationManagerDelegate>) delegate
-{	
+{
+	[self addDelegate: delegate queue: NULL];
+}
+
+- (void)addDelegate:(id<DMLocationManagerDelegate>) delegate queue:(dispatch_queue_t)queue
+{
+	[self addDelegate: delegate queue: queue subscriptionObject: nil];
+}
+
+- (void)addDelegate:(id<DMLocationManagerDelegate>) delegate queue:(dispatch_queue_t)queue subscription:(DMLocationSubscription)subscription
+{
+	DMLocationManagerSubscription* subscriptionObject = [[DMLocationManagerSubscription alloc] initWithSubscription: subscription];
+	
+	[self addDelegate: delegate queue: queue subscriptionObject: subscriptionObject];
+	[subscriptionObject release];
+}
+
+- (void)addDelegate:(id<DMLocationManagerDelegate>)delegate queue:(dispatch_queue_t)queue subscriptionObject:(DMLocationManagerSubscription*)subscription
+{
 	if (nil == delegate)
 		return;
 	
-	if ([_delegates containsObject: delegate])
-		return;
+	BOOL hasChangedSubscriptions = NO;
+	
+	[_delegatesLock lock];
+	
+	if (NO == [_delegates containsObject: delegate] || [_delegateQueues objectForKey: delegate] != queue || nil != subscription || nil != [_delegateSubscriptions objectForKey: delegate])
+	{
+		[_delegates addObject: delegate];
+		
+		if (queue)
+			[_delegateQueues setObject: queue forKey: delegate];
+		else
+			[_delegateQueues removeObjectForKey: delegate];
+		
+		if (subscription)
+			[_delegateSubscriptions setObject: subscription forKey: delegate];
+		else
+			[_delegateSubscriptions removeObjectForKey: delegate];
+		
+		hasChangedSubscriptions = [self rebuildDispatchTable];
+	}
+	
+	[_delegatesLock unlock];
 	
-	[_delegates addObject: delegate];
+	if (YES == hasChangedSubscriptions)
+	{
+		[self performOnEngine: ^{
+			[self updateSharedSession];
+		}];
+	}
 }
 
 - (void)removeDelegate:(id<DMLocationManagerDelegate>) delegate
 {
+	if (nil == delegate)
+		return;
+	
+	BOOL hasChangedSubscriptions = NO;
+	
+	[_delegatesLock lock];
+	
 	if ([_delegates containsObject: delegate])
+	{
 		[_delegates removeObject: delegate];
+		[_delegateQueues removeObjectForKey: delegate];
+		[_delegateSubscriptions removeObjectForKey: delegate];
+		hasChangedSubscriptions = [self rebuildDispatchTable];
+	}
+	
+	[_delegatesLock unlock];
+	
+	if (YES == hasChangedSubscriptions)
+	{
+		[self performOnEngine: ^{
+			[self updateSharedSession];
+		}];
+	}
 }
 
-
-#pragma mark -
-#pragma mark Inform delegates
-
-- (void)informDidChangeLocationServiceEnabledState:(BOOL)locationServiceEnabled
+/**
+ * Rebuild the capability table of the delegates. Must be called with the delegates lock held.
+ * Returns YES if the subscriptions changed, so the source must follow them.
+ *
+ */
+- (BOOL)rebuildDispatchTable
 {
-	for (id<DMLocationManagerDelegate> delegate in _delegates)
-	{
-		if ([delegate respondsToSelector: @selector(locationManager:didChangeLocationServiceEnabledState:)])
-			[delegate locationManager: self didChangeLocationServiceEnabledState: locationServiceEnabled];
-	}
+	DMLocationManagerDispatchTable* dispatchTable = [[DMLocationManagerDispatchTable alloc] initWithDelegates: [_delegates allObjects] queues: _delegateQueues subscriptions: _delegateSubscriptions];
+	
+	DMLocationSubscription previous	= _dispatchTable.aggregateSubscription;
+	DMLocationSubscription current	= dispatchTable.aggregateSubscription;
+	BOOL hasChangedSubscriptions	= (_dispatchTable.subscriptionCount != dispatchTable.subscriptionCount || previous.desiredAccuracy != current.desiredAccuracy || previous.distanceFilter != current.distanceFilter);
+	
+	[_dispatchTable release];
+	_dispatchTable = dispatchTable;
+	
+	return hasChangedSubscriptions;
 }
 
-- (void)informDidStopUpdateLocation
+/**
+ * Purge deallocated delegates from the capability table after they were detected while informing.
+ *
+ */
+- (void)purgeDispatchTable
 {
-	for (id<DMLocationManagerDelegate> delegate in _delegates)
+	[_delegatesLock lock];
+	BOOL hasChangedSubscriptions = [self rebuildDispatchTable];
+	[_delegatesLock unlock];
+	
+	if (YES == hasChangedSubscriptions)
 	{
-		if ([delegate respondsToSelector: @selector(locationManagerDidStopUpdateLocation:)])
-			[delegate locationManagerDidStopUpdateLocation: self];
+		[self performOnEngine: ^{
+			[self updateSharedSession];
+		}];
 	}
 }
 
-- (void)informWillUpdateLocation
+/**
+ * Returns the current capability table, which stays valid while the caller uses it.
+ *
+ */
+- (DMLocationManagerDispatchTable*)currentDispatchTable
+{
+	[_delegatesLock lock];
+	DMLocationManagerDispatchTable* dispatchTable = [_dispatchTable retain];
+	[_delegatesLock unlock];
+	
+	return [dispatchTable autorelease];
+}
+
+
+#pragma mark -
+#pragma mark Inform delegates
+
+/**
+ * Invoke the block for each delegate responding to the callback, either directly or on the queue of the delegate.
+ *
+ */
+- (void)informCallback:(DMLocationManagerCallback)callback usingBlock:(void (^)(id delegate, IMP implementation))block
+{
+	[_delegatesLock lock];
+	DMLocationManagerDispatchTable* dispatchTable	= [_dispatchTable retain];
+	[_delegatesLock unlock];
+	
+	DMLocationManagerDispatchList list				= [dispatchTable listForCallback: callback];
+	BOOL isStale									= NO;
+	
+	for (NSUInteger i = 0; i < list.count; i++)
+	{
+		id delegate = objc_loadWeak(&list.entries[i].delegate);
+		if (nil == delegate)
+		{
+			isStale = YES;
+			continue;
+		}
+		
+		IMP implementation = list.entries[i].implementation;
+		
+		if (list.entries[i].queue)
+		{
+			dispatch_async(list.entries[i].queue, ^{
+				block(delegate, implementation);
+			});
+		}
+		else
+		{
+			block(delegate, implementation);
+		}
+	}
+	
+	[dispatchTable release];
+	
+	if (YES == isStale)
+	{
+		[self purgeDispatchTable];
+	}
+}
+
+- (void)informDidChangeLocationServiceEnabledState:(BOOL)locationServiceEnabled
+{
+	[self informCallback: DMLocationManagerCallbackDidChangeLocationServiceEnabledState usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, BOOL))implementation)(delegate, @selector(locationManager:didChangeLocationServiceEnabledState:), self, locationServiceEnabled);
+	}];
+}
+
+- (void)informDidStopUpdateLocation
+{
+	[self informCallback: DMLocationManagerCallbackDidStopUpdateLocation usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*))implementation)(delegate, @selector(locationManagerDidStopUpdateLocation:), self);
+	}];
+}
+
+- (void)informWillUpdateLocation
+{
+	[self informCallback: DMLocationManagerCallbackWillUpdateLocation usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*))implementation)(delegate, @selector(locationManagerWillUpdateLocation:), self);
+	}];
+}
+
+- (void)informDidUpdateToLocation:(CLLocation*)newLocation fromLocation:(CLLocation*)oldLocation
+{
+	CLLocationManager* locationManager = [self coreLocationManager];
+	
+	[self informCallback: DMLocationManagerCallbackDidUpdateToLocation usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, CLLocationManager*, CLLocation*, CLLocation*))implementation)(delegate, @selector(locationManager:didUpdateToLocation:fromLocation:), locationManager, newLocation, oldLocation);
+	}];
+}
+
+/**
+ * Inform the subscribed delegates about the location, each one only if it moved and the interval of its subscription passed.
+ * The last location of the delegate is passed as the one it moved from.
+ *
+ */
+- (void)informSubscribersOfLocation:(CLLocation*)location
+{
+	[_delegatesLock lock];
+	DMLocationManagerDispatchTable* dispatchTable	= [_dispatchTable retain];
+	[_delegatesLock unlock];
+	
+	DMLocationManagerDispatchList list				= [dispatchTable listForCallback: DMLocationManagerCallbackSubscribedUpdateToLocation];
+	CLLocationManager* locationManager				= [self coreLocationManager];
+	NSTimeInterval now								= DMLocationManagerMonotonicTime();
+	BOOL isStale									= NO;
+	
+	for (NSUInteger i = 0; i < list.count; i++)
+	{
+		id delegate = objc_loadWeak(&list.entries[i].delegate);
+		if (nil == delegate)
+		{
+			isStale = YES;
+			continue;
+		}
+		
+		DMLocationManagerSubscription* subscription = list.entries[i].subscription;
+		if (NO == [subscription acceptsLocation: location atTime: now])
+			continue;
+		
+		CLLocation* fromLocation	= [subscription.lastLocation retain];
+		IMP implementation			= list.entries[i].implementation;
+		
+		[subscription setLastLocation: location atTime: now];
+		
+		if (list.entries[i].queue)
+		{
+			dispatch_async(list.entries[i].queue, ^{
+				((void (*)(id, SEL, CLLocationManager*, CLLocation*, CLLocation*))implementation)(delegate, @selector(locationManager:didUpdateToLocation:fromLocation:), locationManager, location, fromLocation);
+			});
+		}
+		else
+		{
+			((void (*)(id, SEL, CLLocationManager*, CLLocation*, CLLocation*))implementation)(delegate, @selector(locationManager:didUpdateToLocation:fromLocation:), locationManager, location, fromLocation);
+		}
+		
+		[fromLocation release];
+	}
+	
+	[dispatchTable release];
+	
+	if (YES == isStale)
+	{
+		[self purgeDispatchTable];
+	}
+}
+
+- (void)informDidUpdateLocation:(CLLocation*)location provisional:(BOOL)isProvisional
+{
+	[self informCallback: DMLocationManagerCallbackDidUpdateLocationProvisional usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, CLLocation*, BOOL))implementation)(delegate, @selector(locationManager:didUpdateLocation:provisional:), self, location, isProvisional);
+	}];
+}
+
+- (void)informDidUpdateLocations:(NSArray*)locations
+{
+	CLLocationManager* locationManager = [self coreLocationManager];
+	
+	[self informCallback: DMLocationManagerCallbackDidUpdateLocations usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, CLLocationManager*, NSArray*))implementation)(delegate, @selector(locationManager:didUpdateLocations:), locationManager, locations);
+	}];
+}
+
+- (void)informDidUpdateEstimate:(DMLocationEstimate)estimate ofLocation:(CLLocation*)location
+{
+	[self informCallback: DMLocationManagerCallbackDidUpdateEstimate usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, DMLocationEstimate, CLLocation*))implementation)(delegate, @selector(locationManager:didUpdateEstimate:ofLocation:), self, estimate, location);
+	}];
+}
+
+- (void)informDidEnterGeofence:(CLCircularRegion*)geofence
+{
+	[self informCallback: DMLocationManagerCallbackDidEnterGeofence usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, CLCircularRegion*))implementation)(delegate, @selector(locationManager:didEnterGeofence:), self, geofence);
+	}];
+}
+
+- (void)informDidExitGeofence:(CLCircularRegion*)geofence
+{
+	[self informCallback: DMLocationManagerCallbackDidExitGeofence usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, CLCircularRegion*))implementation)(delegate, @selector(locationManager:didExitGeofence:), self, geofence);
+	}];
+}
+
+- (void)informDidUpdateNearestPoints
+{
+	[self informCallback: DMLocationManagerCallbackDidUpdateNearestPoints usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*))implementation)(delegate, @selector(locationManagerDidUpdateNearestPoints:), self);
+	}];
+}
+
+- (void)informDidUpdatePlacemark:(CLPlacemark*)placemark forLocation:(CLLocation*)location
+{
+	[self informCallback: DMLocationManagerCallbackDidUpdatePlacemark usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, DMLocationManager*, CLPlacemark*, CLLocation*))implementation)(delegate, @selector(locationManager:didUpdatePlacemark:forLocation:), self, placemark, location);
+	}];
+}
+
+- (void)informDidFailWithError:(NSError*)error
+{
+	CLLocationManager* locationManager = [self coreLocationManager];
+	
+	[self informCallback: DMLocationManagerCallbackDidFailWithError usingBlock: ^(id delegate, IMP implementation) {
+		((void (*)(id, SEL, CLLocationManager*, NSError*))implementation)(delegate, @selector(locationManager:didFailWithError:), locationManager, error);
+	}];
+}
+
+
+#pragma mark -
+#pragma mark Location
+
+/**
+ * Start updating the location
+ *
+ */
+- (void)startUpdatingLocation
+{
+	[self performOnEngine: ^{
+		[self createLocationSourceIfNeeded];
+		[self leaveBackgroundMode];
+		
+		// Loop by continuous updates delivered in batches
+		if (YES == _loop && YES == _batchesLocations)
+		{
+			[self startBatching];
+			return;
+		}
+		
+		[self willUpdateLocationHandler];
+		
+		_locationSource.delegate = self;
+		[self startLocationUpdates];
+	}];
+}
+
+/**
+ * Stop updating the location
+ *
+ */
+- (void)stopUpdatingLocation
+{
+	[self performOnEngine: ^{
+		[self leaveBackgroundMode];
+		[self stopBatching];
+		[self resumeLoop: NO];
+		
+		// Outstanding requests and subscriptions keep the source running at their accuracy
+		if (NO == [self hasSharedSessionClients])
+		{
+			[self stopLocationUpdates];
+			
+			// The monitored geofences are informed by the delegate of the source
+			if (nil == _geofenceBoundary)
+				_locationSource.delegate = nil;
+		}
+		
+		[self stopQueryingTimer];
+		[self stopLoopTimer];
+		[self applySourceRequirements];
+		
+		[self endQueryMetrics];
+		
+		[self informDidStopUpdateLocation];
+	}];
+}
+
+
+#pragma mark -
+#pragma mark Background mode
+
+/**
+ * Monitor significant location changes or low accuracy locations while the app is in background.
+ * Significant location changes fall back to low accuracy if not available.
+ *
+ */
+- (void)enterBackgroundMode
+{
+	if (YES == _isInBackgroundMode)
+		return;
+	
+	[self createLocationSourceIfNeeded];
+	
+	_isInBackgroundMode			= YES;
+	_locationSource.delegate	= self;
+	
+	if (DMLocationManagerBackgroundPolicySignificantChange == _backgroundPolicy && [_locationSource respondsToSelector: @selector(significantLocationChangeMonitoringAvailable)] && [_locationSource significantLocationChangeMonitoringAvailable])
+	{
+		_isMonitoringSignificantChanges = YES;
+		[_locationSource startMonitoringSignificantLocationChanges];
+	}
+	else
+	{
+		[self setSourceAccuracy: _backgroundAccuracy];
+		[self startLocationUpdates];
+	}
+}
+
+/**
+ * Stop monitoring in background. A running update of core location is kept running, so a following query starts warm.
+ *
+ */
+- (void)leaveBackgroundMode
+{
+	if (NO == _isInBackgroundMode)
+		return;
+	
+	_isInBackgroundMode = NO;
+	
+	if (YES == _isMonitoringSignificantChanges)
+	{
+		_isMonitoringSignificantChanges = NO;
+		[_locationSource stopMonitoringSignificantLocationChanges];
+	}
+	
+	[self setSourceAccuracy: _desiredAccuracy];
+}
+
+/**
+ * Keep the newest location while in background without informing the delegates.
+ *
+ */
+- (void)backgroundLocationHandler:(CLLocation*)location
+{
+	if (nil != _location && [location.timestamp compare: _location.timestamp] != NSOrderedDescending)
+		return;
+	
+	[self storeLocation: location];
+}
+
+
+#pragma mark -
+#pragma mark Adaptive loop
+
+/**
+ * Derive the sleep and accuracy of the next loop cycle from the speed, so the device moves about 'adaptiveLoopDistance' per cycle.
+ * The speed is taken from core location or from the distance moved since the last cycle.
+ * The accuracy relaxes from 'desiredAccuracy' with the distance moved per cycle, an error small against it does not distort the track.
+ * When stationary sleep for 'maximumLoopTimeInterval' with the coarsest accuracy, which is enough to notice leaving.
+ *
+ */
+- (void)adaptLoop
+{
+	CLLocationSpeed speed = _location.speed;
+	
+	if (speed < 0.0 && nil != _previousLoopLocation)
+	{
+		NSTimeInterval duration = [_location.timestamp timeIntervalSinceDate: _previousLoopLocation.timestamp];
+		speed = (duration > 0.0) ? [_location distanceFromLocation: _previousLoopLocation] / duration : -1.0;
+	}
+	
+	[_previousLoopLocation release];
+	_previousLoopLocation = [_location retain];
+	
+	// Unknown speed, keep the current cycle
+	if (speed < 0.0)
+		return;
+	
+	CLLocationAccuracy coarseAccuracy = MAX(_desiredAccuracy, DM_LOCATION_MANAGER_ADAPTIVE_ACCURACY);
+	
+	if (speed < DM_LOCATION_MANAGER_STATIONARY_SPEED)
+	{
+		_adaptiveLoopTimeInterval	= _maximumLoopTimeInterval;
+		_adaptiveAccuracy			= coarseAccuracy;
+	}
+	else
+	{
+		_adaptiveLoopTimeInterval	= MIN(MAX(_adaptiveLoopDistance / speed, _minimumLoopTimeInterval), _maximumLoopTimeInterval);
+		_adaptiveAccuracy			= MIN(MAX(DM_LOCATION_MANAGER_ADAPTIVE_ACCURACY_SHARE * speed * _adaptiveLoopTimeInterval, _desiredAccuracy), coarseAccuracy);
+	}
+
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+	NSLog(@"locationManager adapts loop to %f seconds with accuracy %f at speed %f", _adaptiveLoopTimeInterval, _adaptiveAccuracy, speed);
+#endif
+}
+
+- (void)setAdaptsLoopTimeInterval:(BOOL)adaptsLoopTimeInterval
+{
+	[self performOnEngine: ^{
+		_adaptsLoopTimeInterval		= adaptsLoopTimeInterval;
+		_adaptiveLoopTimeInterval	= _loopTimeInterval;
+		_adaptiveAccuracy			= kCLLocationAccuracyBest;
+		
+		[_previousLoopLocation release];
+		_previousLoopLocation = nil;
+	}];
+}
+
+- (BOOL)adaptsLoopTimeInterval
+{
+	return _adaptsLoopTimeInterval;
+}
+
+- (NSTimeInterval)currentLoopTimeInterval
+{
+	return (YES == _adaptsLoopTimeInterval) ? _adaptiveLoopTimeInterval : _loopTimeInterval;
+}
+
+
+#pragma mark -
+#pragma mark Motion
+
+/**
+ * Observe the motion activity to know whether the device is stationary. Without motion activity the accelerometer decides.
+ *
+ */
+- (void)startMotionUpdates
+{
+	__block DMLocationManager* blockSelf = self;
+	
+	if (nil == _motionQueue)
+	{
+		_motionQueue = [NSOperationQueue new];
+		[_motionQueue setMaxConcurrentOperationCount: 1];
+	}
+	
+	if ([CMMotionActivityManager isActivityAvailable])
+	{
+		_activityManager = [CMMotionActivityManager new];
+		[_activityManager startActivityUpdatesToQueue: _motionQueue withHandler: ^(CMMotionActivity* activity) {
+			if (CMMotionActivityConfidenceLow == activity.confidence)
+				return;
+			
+			BOOL isStationary = (activity.stationary && NO == activity.walking && NO == activity.running && NO == activity.automotive && NO == activity.cycling);
+			
+			[blockSelf performOnEngine: ^{
+				[blockSelf motionHandler: isStationary];
+			}];
+		}];
+	}
+	else
+	{
+		[self startAccelerometerUpdates];
+	}
+}
+
+- (void)stopMotionUpdates
+{
+	[_activityManager stopActivityUpdates];
+	[_activityManager release];
+	_activityManager = nil;
+	
+	[self stopAccelerometerUpdates];
+	
+	_isStationary = NO;
+}
+
+/**
+ * The accelerometer detects motion fast. It runs while the loop is paused or if there is no motion activity.
+ * The device is stationary if the acceleration stays close to gravity for several samples.
+ *
+ */
+- (void)startAccelerometerUpdates
+{
+	if (nil != _accelerometerManager || nil == _motionQueue)
+		return;
+	
+	__block DMLocationManager* blockSelf = self;
+	__block NSUInteger calmSamples = 0;
+	
+	_accelerometerManager = [CMMotionManager new];
+	if (NO == [_accelerometerManager isAccelerometerAvailable])
+		return;
+	
+	_accelerometerManager.accelerometerUpdateInterval = DM_LOCATION_MANAGER_ACCELEROMETER_INTERVAL;
+	[_accelerometerManager startAccelerometerUpdatesToQueue: _motionQueue withHandler: ^(CMAccelerometerData* data, NSError* error) {
+		if (nil == data)
+			return;
+		
+		CMAcceleration acceleration	= data.acceleration;
+		double magnitude			= sqrt(acceleration.x * acceleration.x + acceleration.y * acceleration.y + acceleration.z * acceleration.z);
+		
+		if (fabs(magnitude - 1.0) > DM_LOCATION_MANAGER_MOTION_THRESHOLD)
+		{
+			calmSamples = 0;
+			[blockSelf performOnEngine: ^{
+				[blockSelf motionHandler: NO];
+			}];
+		}
+		else if (++calmSamples == DM_LOCATION_MANAGER_STATIONARY_SAMPLES)
+		{
+			[blockSelf performOnEngine: ^{
+				[blockSelf motionHandler: YES];
+			}];
+		}
+	}];
+}
+
+- (void)stopAccelerometerUpdates
+{
+	[_accelerometerManager stopAccelerometerUpdates];
+	[_accelerometerManager release];
+	_accelerometerManager = nil;
+}
+
+/**
+ * Handling a change of the motion. Moving resumes a paused loop immediately.
+ *
+ */
+- (void)motionHandler:(BOOL)isStationary
+{
+	if (NO == _pausesWhileStationary)
+		return;
+	
+	_isStationary = isStationary;
+	
+	if (NO == _isStationary && YES == _isLoopPaused)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+		NSLog(@"locationManager resumes loop on motion");
+#endif
+		[self resumeLoop: YES];
+	}
+}
+
+- (void)pauseLoop
+{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+	NSLog(@"locationManager pauses loop while stationary");
+#endif
+	_isLoopPaused = YES;
+	[self startAccelerometerUpdates];
+}
+
+- (void)resumeLoop:(BOOL)startsUpdating
+{
+	if (NO == _isLoopPaused)
+		return;
+	
+	_isLoopPaused = NO;
+	
+	if (nil != _activityManager)
+		[self stopAccelerometerUpdates];
+	
+	if (YES == startsUpdating)
+		[self startUpdatingLocation];
+}
+
+- (void)setPausesWhileStationary:(BOOL)pausesWhileStationary
+{
+	[self performOnEngine: ^{
+		if (_pausesWhileStationary == pausesWhileStationary)
+			return;
+		
+		_pausesWhileStationary = pausesWhileStationary;
+		
+		if (YES == _pausesWhileStationary)
+		{
+			[self startMotionUpdates];
+		}
+		else
+		{
+			[self stopMotionUpdates];
+			[self resumeLoop: YES];
+		}
+	}];
+}
+
+- (BOOL)pausesWhileStationary
+{
+	return _pausesWhileStationary;
+}
+
+- (BOOL)isStationary
+{
+	return _isStationary;
+}
+
+
+#pragma mark -
+#pragma mark Energy budget
+
+/**
+ * Shorten the query to the remaining budget of the current hour, but not below a minimal query.
+ *
+ */
+- (NSTimeInterval)budgetedQueryingInterval
+{
+	if (_energyBudget <= 0.0)
+		return _queryingInterval;
+	
+	NSTimeInterval remaining = _energyBudget - [_energyMeter spentAtTime: DMLocationManagerMonotonicTime()];
+	
+	return MIN(_queryingInterval, MAX(remaining, DM_LOCATION_MANAGER_MINIMUM_BUDGETED_QUERY));
+}
+
+/**
+ * Stretch the sleep of the loop, so the duty cycle of the average query stays within the budget,
+ * and wait until the spending of the last hour leaves room for the next query.
+ *
+ */
+- (NSTimeInterval)budgetedLoopTimeInterval:(NSTimeInterval)loopTimeInterval
+{
+	if (_energyBudget <= 0.0)
+		return loopTimeInterval;
+	
+	NSTimeInterval duration			= MAX([_energyMeter averageDuration], DM_LOCATION_MANAGER_MINIMUM_BUDGETED_QUERY);
+	NSTimeInterval dutyCycleSleep	= duration * (DM_LOCATION_MANAGER_ENERGY_WINDOW / MIN(_energyBudget, DM_LOCATION_MANAGER_ENERGY_WINDOW) - 1.0);
+	NSTimeInterval recoverySleep	= [_energyMeter delayUntilSpentFallsTo: MAX(_energyBudget - duration, 0.0) atTime: DMLocationManagerMonotonicTime()];
+	
+	return MAX(loopTimeInterval, MAX(dutyCycleSleep, recoverySleep));
+}
+
+- (NSTimeInterval)energyBudgetSpent
+{
+	__block NSTimeInterval spent = 0.0;
+	
+	[self performOnEngineAndWait: ^{
+		spent = [_energyMeter spentAtTime: DMLocationManagerMonotonicTime()];
+	}];
+	
+	return spent;
+}
+
+
+#pragma mark -
+#pragma mark Batching
+
+/**
+ * Update the location continuously and collect the locations, which are delivered to the delegates in batches
+ * after 'batchFlushInterval' or 'batchFlushDistance'. If available core location defers the updates meanwhile.
+ *
+ */
+- (void)startBatching
+{
+	if (YES == _isBatching)
+		return;
+	
+	_isBatching = YES;
+	
+	if (nil == _batch)
+		_batch = [NSMutableArray new];
+	
+	[self informWillUpdateLocation];
+	
+	_locationSource.delegate		= self;
+	_locationSource.distanceFilter	= kCLDistanceFilterNone;
+	[self setSourceAccuracy: _desiredAccuracy];
+	[self startLocationUpdates];
+	
+	[self allowDeferredUpdates];
+	[self armTimer: _batchTimer interval: _batchFlushInterval];
+}
+
+- (void)stopBatching
+{
+	if (NO == _isBatching)
+		return;
+	
+	[self flushBatch];
+	
+	_isBatching = NO;
+	[self disarmTimer: _batchTimer];
+	
+	if (YES == _isDeferringUpdates)
+	{
+		_isDeferringUpdates = NO;
+		[_locationSource disallowDeferredLocationUpdates];
+	}
+}
+
+- (void)allowDeferredUpdates
+{
+	if (YES == _isDeferringUpdates || NO == [_locationSource respondsToSelector: @selector(deferredLocationUpdatesAvailable)] || NO == [_locationSource deferredLocationUpdatesAvailable])
+		return;
+	
+	_isDeferringUpdates = YES;
+	[_locationSource allowDeferredLocationUpdatesUntilTraveled: _batchFlushDistance timeout: _batchFlushInterval];
+}
+
+/**
+ * Collect the location and flush if it is far enough from the first one of the batch.
+ *
+ */
+- (void)batchLocationHandler:(CLLocation*)location
+{
+	[_batch addObject: location];
+	
+	if ([location distanceFromLocation: [_batch objectAtIndex: 0]] >= _batchFlushDistance)
+	{
+		[self flushBatch];
+		[self armTimer: _batchTimer interval: _batchFlushInterval];
+	}
+}
+
+- (void)batchTimerPassed
+{
+	if (NO == _isBatching)
+		return;
+	
+	[self flushBatch];
+	[self armTimer: _batchTimer interval: _batchFlushInterval];
+}
+
+/**
+ * Deliver the collected locations to the delegates at once.
+ *
+ */
+- (void)flushBatch
+{
+	if (0 == [_batch count])
+		return;
+	
+	NSArray* locations = [_batch copy];
+	[_batch removeAllObjects];
+	
+	[self storeLocation: [locations lastObject]];
+	[_cache addRecentLocation: _location];
+	
+	[self informDidUpdateLocations: locations];
+	[locations release];
+}
+
+
+#pragma mark -
+#pragma mark Timers
+
+/**
+ * The querying and loop timers are dispatch sources on the engine queue. They are created once and only rearmed,
+ * fire independently of the run loop mode (e.g. while scrolling) and allow the system to coalesce wakeups within 'timerLeeway'.
+ *
+ */
+- (void)initTimers
+{
+	__block DMLocationManager* blockSelf = self;
+	
+	_queryingTimer = [self newTimerWithHandler: ^{
+		[blockSelf queryingTimerPassed];
+	}];
+	
+	_loopTimer = [self newTimerWithHandler: ^{
+		[blockSelf loopTimerPassed];
+	}];
+	
+	_batchTimer = [self newTimerWithHandler: ^{
+		[blockSelf batchTimerPassed];
+	}];
+	
+	_requestTimer = [self newTimerWithHandler: ^{
+		[blockSelf requestTimerPassed];
+	}];
+}
+
+- (void)destroyTimers
+{
+	[self destroyTimer: &_queryingTimer];
+	[self destroyTimer: &_loopTimer];
+	[self destroyTimer: &_batchTimer];
+	[self destroyTimer: &_requestTimer];
+}
+
+/**
+ * Create a disarmed timer on the engine queue. The handler must not retain the location manager.
+ *
+ */
+- (dispatch_source_t)newTimerWithHandler:(dispatch_block_t)handler
+{
+	dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _engineQueue);
+	
+	dispatch_source_set_timer(timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+	dispatch_source_set_event_handler(timer, handler);
+	dispatch_resume(timer);
+	
+	return timer;
+}
+
+- (void)destroyTimer:(dispatch_source_t*)timer
+{
+	if (NULL == *timer)
+		return;
+	
+	dispatch_source_cancel(*timer);
+	dispatch_release(*timer);
+	*timer = NULL;
+}
+
+/**
+ * Arm the one-shot timer to fire after the interval.
+ *
+ */
+- (void)armTimer:(dispatch_source_t)timer interval:(NSTimeInterval)interval
+{
+	dispatch_time_t start	= dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC));
+	uint64_t leeway			= (uint64_t)(MAX(_timerLeeway, 0.0) * NSEC_PER_SEC);
+	
+	dispatch_source_set_timer(timer, start, DISPATCH_TIME_FOREVER, leeway);
+}
+
+- (void)disarmTimer:(dispatch_source_t)timer
+{
+	dispatch_source_set_timer(timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+}
+
+
+#pragma mark -
+#pragma mark Querying timer
+
+- (void)startQueryingTimer
+{
+	_isQueryingTimerArmed = YES;
+	[self armTimer: _queryingTimer interval: [self budgetedQueryingInterval]];
+}
+
+- (void)stopQueryingTimer
+{
+	if (_isQueryingTimerArmed)
+	{
+		_isQueryingTimerArmed = NO;
+		[self disarmTimer: _queryingTimer];
+	}
+}
+
+- (void)queryingTimerPassed
+{
+	if (NO == _isQueryingTimerArmed)
+		return;
+	
+	_queryMetrics.outcome = DMLocationManagerQueryOutcomeTimedOut;
+	
+	[self stopUpdatingLocation];
+	[self stopQueryingTimer];
+	
+	if (YES == _hasSessionLocation)
+	{
+		[self determinedLocationHandler];
+	}
+	else
+	{
+		[self clearRevalidation];
+		[self informDidFailWithError: nil];
+	}
+}
+
+
+#pragma mark -
+#pragma mark Loop timer
+
+- (void)startLoopTimer
+{
+	_isLoopTimerArmed = YES;
+	[self armTimer: _loopTimer interval: [self budgetedLoopTimeInterval: [self currentLoopTimeInterval]]];
+}
+
+- (void)stopLoopTimer
+{
+	if (_isLoopTimerArmed)
+	{
+		_isLoopTimerArmed = NO;
+		[self disarmTimer: _loopTimer];
+	}
+}
+
+- (void)loopTimerPassed
+{
+	if (NO == _isLoopTimerArmed)
+		return;
+	
+	[self stopLoopTimer];
+	
+	// Keep serving the last location until the device moves
+	if (YES == _pausesWhileStationary && YES == _isStationary)
+	{
+		[self pauseLoop];
+		return;
+	}
+	
+	[self startUpdatingLocation];
+}
+
+
+#pragma mark -
+#pragma mark Desired accuracy
+
+- (void)setDesiredAccuracy:(CLLocationAccuracy)accuracy
+{
+	_desiredAccuracy = accuracy;
+	
+	[self performOnEngine: ^{
+		// A running query keeps its adaptive relaxation and escalation stage, only their base changes
+		if (YES == _isQueryingTimerArmed)
+		{
+			_sessionAccuracy		= (YES == _loop && YES == _adaptsLoopTimeInterval) ? MAX(_desiredAccuracy, _adaptiveAccuracy) : _desiredAccuracy;
+			_isEscalatingAccuracy	= (YES == _isEscalatingAccuracy && _provisionalAccuracy > _sessionAccuracy);
+		}
+		
+		[self setSourceAccuracy: [self engineAccuracy]];
+	}];
+}
+
+- (CLLocationAccuracy) desiredAccuracy
+{
+	return _desiredAccuracy;
+}
+
+
+#pragma mark -
+#pragma mark Convergence
+
+/**
+ * Returns whether the accuracy stopped improving for 'convergenceSampleCount' samples or 'convergenceTimeInterval' seconds.
+ *
+ */
+- (BOOL)hasConverged
+{
+	if (NO == _hasSessionLocation)
+		return NO;
+	
+	if (_convergenceSampleCount > 0 && _samplesWithoutImprovement >= _convergenceSampleCount)
+		return YES;
+	
+	if (_convergenceTimeInterval > 0.0 && DMLocationManagerMonotonicTime() - _lastImprovementTime >= _convergenceTimeInterval)
+		return YES;
+	
+	return NO;
+}
+
+
+#pragma mark -
+#pragma mark Location snapshot
+
+/**
+ * Keep the location as the last determined one.
+ *
+ */
+- (void)storeLocation:(CLLocation*)location
+{
+	if (location == _location)
+		return;
+	
+	[_location release];
+	_location = [location retain];
+	
+	[self publishSnapshotOfLocation: _location];
+	[_cache setBestLocation: _location];
+	
+	if (nil != _pointIndex)
+	{
+		[self updateNearestPoints];
+	}
+	
+	if (nil != _geocoder)
+	{
+		[self geocodeLocation: _location];
+	}
+}
+
+/**
+ * Add the location to the history. Unlike 'location' every delivered location is recorded, not only improvements.
+ *
+ */
+- (void)recordLocation:(CLLocation*)location
+{
+	DMLocationSample sample = DMLocationSampleMakeWithLocation(location);
+	
+	[_history addSample: sample];
+	[_simplifier addSample: sample];
+	
+	if (nil != _uploader && nil != _history)
+	{
+		[_uploader collectSamplesOfHistory: _history];
+	}
+}
+
+/**
+ * Start a new simplified track with the current tolerance and capacity.
+ *
+ */
+- (void)rebuildSimplifier
+{
+	[_simplifier release];
+	_simplifier = nil;
+	
+	if (_simplificationTolerance <= 0.0 || 0 == _historyCapacity)
+		return;
+	
+	DMLocationHistory* simplifiedHistory = [[DMLocationHistory alloc] initWithCapacity: _historyCapacity];
+	_simplifier = [[DMLocationSimplifier alloc] initWithTolerance: _simplificationTolerance history: simplifiedHistory];
+	[simplifiedHistory release];
+}
+
+/**
+ * Publish the location for readers on any thread. Only the engine writes the snapshot.
+ * The sequence is odd while writing, readers retry if it is odd or changed while reading.
+ *
+ */
+- (void)publishSnapshotOfLocation:(CLLocation*)location
+{
+	if (nil == location)
+		return;
+	
+	DMLocationSample sample = DMLocationSampleMakeWithLocation(location);
+	uint32_t sequence		= __atomic_load_n(&_snapshotSequence, __ATOMIC_RELAXED);
+	
+	__atomic_store_n(&_snapshotSequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	DMLocationSampleCopyRelaxed(&_snapshot, &sample);
+	
+	__atomic_store_n(&_snapshotSequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+- (BOOL)getLocationSnapshot:(DMLocationSample*)snapshot
+{
+	uint32_t begin;
+	uint32_t end;
+	
+	do
+	{
+		begin = __atomic_load_n(&_snapshotSequence, __ATOMIC_ACQUIRE);
+		if (0 == begin)
+			return NO;
+		
+		DMLocationSampleCopyRelaxed(snapshot, &_snapshot);
+		
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		end = __atomic_load_n(&_snapshotSequence, __ATOMIC_RELAXED);
+	}
+	while ((begin & 1) || begin != end);
+	
+	return YES;
+}
+
+
+#pragma mark -
+#pragma mark Smoothing
+
+/**
+ * Feed the location to the Kalman filter, publish the estimate and pass it with the location to the delegates.
+ *
+ */
+- (void)smoothLocation:(CLLocation*)location
+{
+	DMLocationEstimate estimate = [_smoother addSample: DMLocationSampleMakeWithLocation(location)];
+	
+	if (NO == [_smoother hasEstimate])
+		return;
+	
+	[self publishEstimate: estimate];
+	[self informDidUpdateEstimate: estimate ofLocation: location];
+}
+
+/**
+ * Publish the estimate for readers on any thread like the snapshot of the location.
+ *
+ */
+- (void)publishEstimate:(DMLocationEstimate)estimate
+{
+	uint32_t sequence = __atomic_load_n(&_estimateSequence, __ATOMIC_RELAXED);
+	
+	__atomic_store_n(&_estimateSequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	DMLocationEstimateCopyRelaxed(&_estimate, &estimate);
+	
+	__atomic_store_n(&_estimateSequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+- (BOOL)getSmoothedEstimate:(DMLocationEstimate*)estimate
+{
+	uint32_t begin;
+	uint32_t end;
+	
+	if (NO == _smoothsLocations)
+		return NO;
+	
+	do
+	{
+		begin = __atomic_load_n(&_estimateSequence, __ATOMIC_ACQUIRE);
+		if (0 == begin)
+			return NO;
+		
+		DMLocationEstimateCopyRelaxed(estimate, &_estimate);
+		
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		end = __atomic_load_n(&_estimateSequence, __ATOMIC_RELAXED);
+	}
+	while ((begin & 1) || begin != end);
+	
+	return YES;
+}
+
+- (void)setSmoothsLocations:(BOOL)smoothsLocations
+{
+	[self performOnEngine: ^{
+		if (_smoothsLocations == smoothsLocations)
+			return;
+		
+		_smoothsLocations = smoothsLocations;
+		
+		[_smoother release];
+		_smoother = (YES == _smoothsLocations) ? [DMLocationSmoother new] : nil;
+	}];
+}
+
+- (BOOL)smoothsLocations
+{
+	return _smoothsLocations;
+}
+
+
+#pragma mark -
+#pragma mark Geofencing
+
+/**
+ * Inform about the geofences the location entered or exited and swap the monitored ones once it left their boundary.
+ *
+ */
+- (void)geofenceLocation:(CLLocation*)location
+{
+	[_geofencer evaluateSample: DMLocationSampleMakeWithLocation(location) usingBlock: ^(CLCircularRegion* geofence, BOOL isInside) {
+		if (YES == isInside)
+			[self informDidEnterGeofence: geofence];
+		else
+			[self informDidExitGeofence: geofence];
+	}];
+	
+	if ((nil == _geofenceBoundary || NO == [_geofenceBoundary containsCoordinate: location.coordinate]) && [self canMonitorGeofences])
+	{
+		[self monitorGeofencesNearLocation: location];
+	}
+}
+
+- (BOOL)canMonitorGeofences
+{
+	return (nil != _geofencer && 0 < _maximumMonitoredGeofences && [_locationSource respondsToSelector: @selector(regionMonitoringAvailable)] && [_locationSource regionMonitoringAvailable]);
+}
+
+/**
+ * Let the source monitor the geofences nearest to the location and a boundary around the location.
+ * Geofences which are not monitored are farther than the farthest monitored one, so within the boundary of half that distance
+ * none of them can be entered. Monitored geofences which stay the nearest ones are not restarted.
+ *
+ */
+- (void)monitorGeofencesNearLocation:(CLLocation*)location
+{
+	if (nil != location && nil != _geofencer && 0 < _maximumMonitoredGeofences)
+	{
+		[self createLocationSourceIfNeeded];
+	}
+	
+	if (nil == location || NO == [self canMonitorGeofences])
+	{
+		[self stopMonitoringGeofences];
+		return;
+	}
+	
+	// With a single region only the boundary is monitored, halfway to the nearest geofence
+	NSUInteger count			= _maximumMonitoredGeofences - 1;
+	CLLocationDistance distance	= 0.0;
+	NSArray* geofences			= [_geofencer nearestRegions: MAX(count, 1) toSample: DMLocationSampleMakeWithLocation(location) distance: &distance];
+	
+	if ([geofences count] > count)
+	{
+		geofences = [geofences subarrayWithRange: NSMakeRange(0, count)];
+	}
+	
+	for (CLCircularRegion* geofence in [[_monitoredGeofences copy] autorelease])
+	{
+		if (NO == [geofences containsObject: geofence])
+		{
+			[_locationSource stopMonitoringForRegion: geofence];
+			[_monitoredGeofences removeObject: geofence];
+		}
+	}
+	
+	for (CLCircularRegion* geofence in geofences)
+	{
+		if (NO == [_monitoredGeofences containsObject: geofence])
+		{
+			[_locationSource startMonitoringForRegion: geofence];
+			[_monitoredGeofences addObject: geofence];
+		}
+	}
+	
+	CLLocationDistance radius = MAX(0.5 * distance, DM_LOCATION_MANAGER_MINIMUM_GEOFENCE_BOUNDARY);
+	
+	if ([_locationSource respondsToSelector: @selector(maximumRegionMonitoringDistance)] && 0.0 < [_locationSource maximumRegionMonitoringDistance])
+	{
+		radius = MIN(radius, [_locationSource maximumRegionMonitoringDistance]);
+	}
+	
+	if (nil != _geofenceBoundary)
+	{
+		[_locationSource stopMonitoringForRegion: _geofenceBoundary];
+		[_geofenceBoundary release];
+	}
+	
+	_geofenceBoundary			= [[CLCircularRegion alloc] initWithCenter: location.coordinate radius: radius identifier: DMLocationManagerGeofenceBoundaryIdentifier];
+	_geofenceBoundary.notifyOnEntry	= NO;
+	
+	[_locationSource startMonitoringForRegion: _geofenceBoundary];
+	_locationSource.delegate	= self;
+}
+
+- (void)stopMonitoringGeofences
+{
+	for (CLCircularRegion* geofence in _monitoredGeofences)
+	{
+		[_locationSource stopMonitoringForRegion: geofence];
+	}
+	[_monitoredGeofences removeAllObjects];
+	
+	if (nil != _geofenceBoundary)
+	{
+		[_locationSource stopMonitoringForRegion: _geofenceBoundary];
+		[_geofenceBoundary release];
+		_geofenceBoundary = nil;
+	}
+}
+
+- (void)setGeofences:(NSArray*)geofences
+{
+	NSArray* regions = [geofences copy];
+	
+	[self performOnEngine: ^{
+		[self stopMonitoringGeofences];
+		
+		[_geofencer release];
+		_geofencer = (0 < [regions count]) ? [[DMLocationGeofencer alloc] initWithRegions: regions] : nil;
+		[regions release];
+		
+		[self monitorGeofencesNearLocation: _location];
+	}];
+}
+
+- (NSArray*)geofences
+{
+	__block NSArray* geofences = nil;
+	
+	[self performOnEngineAndWait: ^{
+		geofences = [[_geofencer regions] retain];
+	}];
+	
+	return [geofences autorelease];
+}
+
+- (void)setMaximumMonitoredGeofences:(NSUInteger)maximumMonitoredGeofences
+{
+	[self performOnEngine: ^{
+		if (_maximumMonitoredGeofences == maximumMonitoredGeofences)
+			return;
+		
+		_maximumMonitoredGeofences = maximumMonitoredGeofences;
+		
+		[self stopMonitoringGeofences];
+		[self monitorGeofencesNearLocation: _location];
+	}];
+}
+
+- (NSUInteger)maximumMonitoredGeofences
+{
+	return _maximumMonitoredGeofences;
+}
+
+
+#pragma mark -
+#pragma mark Nearest points
+
+/**
+ * Keep the nearest points of the index to the location. The query returns one point more than kept, the first one which is not.
+ * Moving by d changes every distance by at most d, so the kept points stay the nearest while the location moved less than
+ * half the gap between the farthest kept point and that one. Until then only their distances and order are updated.
+ *
+ */
+- (void)updateNearestPoints
+{
+	if (0 == _nearestPointCount || nil == _location)
+		return;
+	
+	CLLocationCoordinate2D coordinate = _location.coordinate;
+	
+	if (nil != _nearestPointsLocation && [_location distanceFromLocation: _nearestPointsLocation] <= _nearestPointsSlack)
+	{
+		BOOL isReordered = NO;
+		
+		for (NSUInteger i = 0; i < _nearestPointsFound; i++)
+		{
+			_nearestPoints[i].distance = [_pointIndex distanceOfPoint: _nearestPoints[i].index toCoordinate: coordinate];
+			
+			for (NSUInteger j = i; j > 0 && _nearestPoints[j - 1].distance > _nearestPoints[j].distance; j--)
+			{
+				DMLocationPointNeighbor neighbor	= _nearestPoints[j];
+				_nearestPoints[j]					= _nearestPoints[j - 1];
+				_nearestPoints[j - 1]				= neighbor;
+				
+				isReordered = YES;
+			}
+		}
+		
+		if (YES == isReordered)
+		{
+			[self informDidUpdateNearestPoints];
+		}
+		return;
+	}
+	
+	NSUInteger found	= [_pointIndex getNearestNeighbors: _queriedPoints count: _nearestPointCount + 1 ofCoordinate: coordinate];
+	_nearestPointsSlack	= (found > _nearestPointCount) ? 0.5 * (_queriedPoints[_nearestPointCount].distance - _queriedPoints[_nearestPointCount - 1].distance) : DBL_MAX;
+	found				= MIN(found, _nearestPointCount);
+	
+	BOOL isChanged = (found != _nearestPointsFound);
+	
+	for (NSUInteger i = 0; i < found && NO == isChanged; i++)
+	{
+		isChanged = (_queriedPoints[i].index != _nearestPoints[i].index);
+	}
+	
+	memcpy(_nearestPoints, _queriedPoints, found * sizeof(DMLocationPointNeighbor));
+	_nearestPointsFound = found;
+	
+	[_nearestPointsLocation release];
+	_nearestPointsLocation = [_location retain];
+	
+	if (YES == isChanged)
+	{
+		[self informDidUpdateNearestPoints];
+	}
+}
+
+/**
+ * Forget the nearest points and query them again, e.g. for another index.
+ *
+ */
+- (void)resetNearestPoints
+{
+	BOOL hadPoints = (0 < _nearestPointsFound);
+	
+	_nearestPointsFound = 0;
+	[_nearestPointsLocation release];
+	_nearestPointsLocation = nil;
+	
+	if (nil != _pointIndex)
+	{
+		[self updateNearestPoints];
+	}
+	
+	if (YES == hadPoints && 0 == _nearestPointsFound)
+	{
+		[self informDidUpdateNearestPoints];
+	}
+}
+
+- (NSUInteger)getNearestPoints:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count
+{
+	__block NSUInteger found = 0;
+	
+	[self performOnEngineAndWait: ^{
+		found = MIN(count, _nearestPointsFound);
+		memcpy(neighbors, _nearestPoints, found * sizeof(DMLocationPointNeighbor));
+	}];
+	
+	return found;
+}
+
+- (NSUInteger)getPoints:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count withinRadius:(CLLocationDistance)radius
+{
+	__block NSUInteger found = 0;
+	
+	[self performOnEngineAndWait: ^{
+		if (nil != _pointIndex && nil != _location)
+			found = [_pointIndex getNeighbors: neighbors count: count withinRadius: radius ofCoordinate: _location.coordinate];
+	}];
+	
+	return found;
+}
+
+- (void)setPointIndex:(DMLocationPointIndex*)pointIndex
+{
+	[self performOnEngine: ^{
+		if (pointIndex == _pointIndex)
+			return;
+		
+		[_pointIndex release];
+		_pointIndex = [pointIndex retain];
+		
+		[self resetNearestPoints];
+	}];
+}
+
+- (DMLocationPointIndex*)pointIndex
+{
+	__block DMLocationPointIndex* pointIndex = nil;
+	
+	[self performOnEngineAndWait: ^{
+		pointIndex = [_pointIndex retain];
+	}];
+	
+	return [pointIndex autorelease];
+}
+
+- (void)setNearestPointCount:(NSUInteger)nearestPointCount
+{
+	[self performOnEngine: ^{
+		if (nearestPointCount == _nearestPointCount)
+			return;
+		
+		_nearestPointCount	= nearestPointCount;
+		_nearestPoints		= reallocf(_nearestPoints, (_nearestPointCount + 1) * sizeof(DMLocationPointNeighbor));
+		_queriedPoints		= reallocf(_queriedPoints, (_nearestPointCount + 1) * sizeof(DMLocationPointNeighbor));
+		
+		[self resetNearestPoints];
+	}];
+}
+
+- (NSUInteger)nearestPointCount
+{
+	return _nearestPointCount;
+}
+
+
+#pragma mark -
+#pragma mark Reverse geocoding
+
+/**
+ * Look up the placemark once the location entered another tile. Within the tile of the placemark or of its running lookup nothing is done.
+ * A failed lookup is retried with the next location.
+ *
+ */
+- (void)geocodeLocation:(CLLocation*)location
+{
+	DMLocationGeocoderTile tile = [_geocoder tileOfCoordinate: location.coordinate];
+	
+	if (YES == _hasPlacemarkTile && tile == _placemarkTile)
+		return;
+	
+	_placemarkTile		= tile;
+	_hasPlacemarkTile	= YES;
+	
+	DMLocationGeocoder* geocoder	= _geocoder;
+	BOOL isCached					= (nil != [_geocoder cachedPlacemarkForLocation: location]);
+	
+	[_geocoder reverseGeocodeLocation: location completion: ^(CLPlacemark* placemark, NSError* error) {
+		[self performOnEngine: ^{
+			// Core location just used the radio for the lookup, upload while it is still on
+			if (NO == isCached && nil == error)
+			{
+				[_uploader networkDidBecomeActive];
+			}
+			
+			// The location left the tile meanwhile or the geocoder was replaced
+			if (geocoder != _geocoder || NO == _hasPlacemarkTile || tile != _placemarkTile)
+				return;
+			
+			if (nil != error || nil == placemark)
+			{
+				_hasPlacemarkTile = NO;
+				return;
+			}
+			
+			if (placemark == _placemark)
+				return;
+			
+			[_placemark release];
+			_placemark = [placemark retain];
+			
+			[self informDidUpdatePlacemark: _placemark forLocation: location];
+		}];
+	}];
+}
+
+- (void)setReverseGeocodesLocation:(BOOL)reverseGeocodesLocation
+{
+	[self performOnEngine: ^{
+		if (_reverseGeocodesLocation == reverseGeocodesLocation)
+			return;
+		
+		_reverseGeocodesLocation	= reverseGeocodesLocation;
+		_hasPlacemarkTile			= NO;
+		
+		[_placemark release];
+		_placemark = nil;
+		
+		[_geocoder release];
+		_geocoder = (YES == _reverseGeocodesLocation) ? [[DMLocationGeocoder alloc] initWithPath: (YES == _persistsLocation) ? [DMLocationGeocoder defaultPath] : nil] : nil;
+		
+		if (nil != _geocoder && nil != _location)
+		{
+			[self geocodeLocation: _location];
+		}
+	}];
+}
+
+- (BOOL)reverseGeocodesLocation
+{
+	return _reverseGeocodesLocation;
+}
+
+- (DMLocationGeocoder*)geocoder
+{
+	__block DMLocationGeocoder* geocoder = nil;
+	
+	[self performOnEngineAndWait: ^{
+		geocoder = [_geocoder retain];
+	}];
+	
+	return [geocoder autorelease];
+}
+
+- (CLPlacemark*)placemark
+{
+	__block CLPlacemark* placemark = nil;
+	
+	[self performOnEngineAndWait: ^{
+		placemark = [_placemark retain];
+	}];
+	
+	return [placemark autorelease];
+}
+
+
+#pragma mark -
+#pragma mark Uploading
+
+- (void)setUploader:(DMLocationUploader*)uploader
+{
+	[self performOnEngine: ^{
+		if (uploader == _uploader)
+			return;
+		
+		[_uploader flush];
+		[_uploader release];
+		_uploader = [uploader retain];
+		
+		// Start with the locations recorded before
+		if (nil != _uploader && nil != _history)
+		{
+			[_uploader collectSamplesOfHistory: _history];
+		}
+	}];
+}
+
+- (DMLocationUploader*)uploader
+{
+	__block DMLocationUploader* uploader = nil;
+	
+	[self performOnEngineAndWait: ^{
+		uploader = [_uploader retain];
+	}];
+	
+	return [uploader autorelease];
+}
+
+
+#pragma mark -
+#pragma mark Revalidation
+
+/**
+ * Inform the delegates immediately about the cached location if it is still valid regarding 'cacheAge'.
+ * Query a fresh location only if the cached one is older than 'revalidationAge'.
+ *
+ */
+- (void)revalidateLocation
+{
+	NSTimeInterval age = [self locationAge];
+	
+	if (nil == _location || age > _cacheAge)
+	{
+		[self startUpdatingLocation];
+		return;
+	}
+	
+	BOOL isFresh = (age <= _revalidationAge);
+	
+	[self informDidDeliverLocation: _location provisional: (NO == isFresh)];
+	
+	if (YES == isFresh)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+		NSLog(@"locationManager skips revalidation of location with age %f", age);
+#endif
+		if (YES == _loop)
+		{
+			[self startLoopTimer];
+		}
+		return;
+	}
+	
+	// Must be set after starting, which clears it
+	[self startUpdatingLocation];
+	[self performOnEngine: ^{
+		[_revalidatedLocation release];
+		_revalidatedLocation = [_location retain];
+	}];
+}
+
+- (void)clearRevalidation
+{
+	[_revalidatedLocation release];
+	_revalidatedLocation = nil;
+}
+
+
+#pragma mark -
+#pragma mark Suppression
+
+/**
+ * Returns whether the location is too close in distance or time to the last delivered one, without improving the accuracy enough.
+ *
+ */
+- (BOOL)isRedundantLocation:(CLLocation*)location
+{
+	if (nil == _deliveredLocation)
+		return NO;
+	
+	BOOL isClose	= (_suppressionDistance > 0.0 && [location distanceFromLocation: _deliveredLocation] < _suppressionDistance);
+	BOOL isSoon		= (_suppressionInterval > 0.0 && [location.timestamp timeIntervalSinceDate: _deliveredLocation.timestamp] < _suppressionInterval);
+	
+	if (NO == isClose && NO == isSoon)
+		return NO;
+	
+	if (_suppressionAccuracyImprovement > 0.0 && _deliveredLocation.horizontalAccuracy - location.horizontalAccuracy >= _suppressionAccuracyImprovement)
+		return NO;
+	
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+	NSLog(@"locationManager suppresses location %@ close to %@", location, _deliveredLocation);
+#endif
+	
+	return YES;
+}
+
+/**
+ * Inform the delegates about the location, coming from the last delivered one.
+ *
+ */
+- (void)informDidDeliverLocation:(CLLocation*)location provisional:(BOOL)isProvisional
+{
+	CLLocation* fromLocation = _deliveredLocation;
+	_deliveredLocation = [location retain];
+	
+	[self informDidUpdateToLocation: location fromLocation: fromLocation];
+	[self informDidUpdateLocation: location provisional: isProvisional];
+	
+	[fromLocation release];
+}
+
+
+#pragma mark -
+#pragma mark Persistence
+
+- (void)setPersistsLocation:(BOOL)persistsLocation
+{
+	[self performOnEngine: ^{
+		if (_persistsLocation == persistsLocation || nil == _cachePath)
+			return;
+		
+		_persistsLocation = persistsLocation;
+		
+		if (YES == _persistsLocation)
+		{
+			_cache = [[DMLocationCache alloc] initWithPath: _cachePath];
+			[_cache setBestLocation: _location];
+		}
+		else
+		{
+			[_cache clear];
+			[_cache release];
+			_cache = nil;
+		}
+	}];
+}
+
+- (BOOL)persistsLocation
+{
+	return _persistsLocation;
+}
+
+- (NSArray*)recentLocations
+{
+	__block NSArray* recentLocations = nil;
+	
+	[self performOnEngineAndWait: ^{
+		recentLocations = [[_cache recentLocations] retain];
+	}];
+	
+	return (nil != recentLocations) ? [recentLocations autorelease] : [NSArray array];
+}
+
+- (void)setHistoryCapacity:(NSUInteger)historyCapacity
+{
+	[self performOnEngine: ^{
+		if (_historyCapacity == historyCapacity)
+			return;
+		
+		_historyCapacity = historyCapacity;
+		
+		[_history release];
+		_history = (_historyCapacity > 0) ? [[DMLocationHistory alloc] initWithCapacity: _historyCapacity] : nil;
+		
+		[self rebuildSimplifier];
+	}];
+}
+
+- (NSUInteger)historyCapacity
+{
+	return _historyCapacity;
+}
+
+- (DMLocationHistory*)history
+{
+	__block DMLocationHistory* history = nil;
+	
+	[self performOnEngineAndWait: ^{
+		history = [_history retain];
+	}];
+	
+	return [history autorelease];
+}
+
+- (void)setSimplificationTolerance:(CLLocationDistance)simplificationTolerance
+{
+	[self performOnEngine: ^{
+		if (_simplificationTolerance == simplificationTolerance)
+			return;
+		
+		_simplificationTolerance = simplificationTolerance;
+		
+		[self rebuildSimplifier];
+	}];
+}
+
+- (CLLocationDistance)simplificationTolerance
+{
+	return _simplificationTolerance;
+}
+
+- (DMLocationHistory*)simplifiedHistory
+{
+	__block DMLocationHistory* simplifiedHistory = nil;
+	
+	[self performOnEngineAndWait: ^{
+		simplifiedHistory = [[_simplifier history] retain];
+	}];
+	
+	return [simplifiedHistory autorelease];
+}
+
+- (NSTimeInterval)locationAge
+{
+	DMLocationSample sample;
+	
+	if (NO == [self getLocationSnapshot: &sample])
+		return DBL_MAX;
+	
+	return DMLocationManagerMonotonicTime() - sample.timestamp;
+}
+
+
+#pragma mark -
+#pragma mark Trace
+
+- (void)setTraceRecordingPath:(NSString*)traceRecordingPath
+{
+	traceRecordingPath = [[traceRecordingPath copy] autorelease];
+	
+	[self performOnEngine: ^{
+		if ([_traceRecorder path] == traceRecordingPath || [[_traceRecorder path] isEqualToString: traceRecordingPath])
+			return;
+		
+		[_traceRecorder release];
+		_traceRecorder = (nil != traceRecordingPath) ? [[DMLocationTraceRecorder alloc] initWithPath: traceRecordingPath] : nil;
+	}];
+}
+
+- (NSString*)traceRecordingPath
+{
+	__block NSString* traceRecordingPath = nil;
+	
+	[self performOnEngineAndWait: ^{
+		traceRecordingPath = [[_traceRecorder path] retain];
+	}];
+	
+	return [traceRecordingPath autorelease];
+}
+
+- (BOOL)isReplayingTrace
+{
+	__block BOOL isReplayingTrace = NO;
+	
+	[self performOnEngineAndWait: ^{
+		isReplayingTrace = [_locationSource isKindOfClass: [DMLocationTraceSource class]];
+	}];
+	
+	return isReplayingTrace;
+}
+
+- (BOOL)replayTraceAtPath:(NSString*)path speed:(double)speed
+{
+	DMLocationTraceSource* traceSource = [[DMLocationTraceSource alloc] initWithPath: path speed: speed];
+	if (nil == traceSource)
+		return NO;
+	
+	[self setLocationSource: traceSource];
+	[traceSource release];
+	
+	return YES;
+}
+
+- (void)stopReplayingTrace
+{
+	[self performOnEngine: ^{
+		if ([_locationSource isKindOfClass: [DMLocationTraceSource class]])
+		{
+			[self setLocationSource: nil];
+		}
+	}];
+}
+
+
+#pragma mark -
+#pragma mark Requests
+
+- (DMLocationRequest*)requestLocationWithAccuracy:(CLLocationAccuracy)accuracy maximumAge:(NSTimeInterval)maximumAge timeout:(NSTimeInterval)timeout completion:(DMLocationRequestCompletion)completion
+{
+	DMLocationRequest* request = [[DMLocationRequest alloc] initWithAccuracy: accuracy maximumAge: maximumAge timeout: timeout completion: completion];
+	
+	[self performOnEngine: ^{
+		// Serve the request by the last location if it is young and accurate enough
+		if ([request handleLocation: _location])
+		{
+			[request finishWithError: nil];
+			return;
+		}
+		
+		if (nil == _requests)
+			_requests = [NSMutableArray new];
+		
+		[_requests addObject: request];
+		[self updateSharedSession];
+	}];
+	
+	return [request autorelease];
+}
+
+- (void)cancelRequest:(DMLocationRequest*)request
+{
+	[self performOnEngine: ^{
+		if (NSNotFound == [_requests indexOfObjectIdenticalTo: request])
+			return;
+		
+		[request invalidate];
+		[_requests removeObjectIdenticalTo: request];
+		[self updateSharedSession];
+	}];
+}
+
+/**
+ * Returns whether requests are outstanding or delegates are subscribed, which share the session of the source.
+ *
+ */
+- (BOOL)hasSharedSessionClients
+{
+	return (0 < [_requests count] || 0 < _subscriptionCount);
+}
+
+/**
+ * Run the source while requests are outstanding or delegates are subscribed and wind it down after the last one,
+ * unless the engine needs it otherwise.
+ *
+ */
+- (void)updateSharedSession
+{
+	_subscriptionCount = [self currentDispatchTable].subscriptionCount;
+	
+	[self armRequestTimer];
+	
+	if ([self hasSharedSessionClients])
+	{
+		[self createLocationSourceIfNeeded];
+		[self applySourceRequirements];
+		
+		if (NO == _isSourceUpdating)
+		{
+			_locationSource.delegate = self;
+			[self startLocationUpdates];
+		}
+		return;
+	}
+	
+	[self applySourceRequirements];
+	
+	if (YES == _isSourceUpdating && NO == [self isSourceNeeded])
+	{
+		[self stopLocationUpdates];
+		
+		if (NO == _isInBackgroundMode && nil == _geofenceBoundary)
+			_locationSource.delegate = nil;
+	}
+}
+
+/**
+ * Arm the request timer for the nearest deadline.
+ *
+ */
+- (void)armRequestTimer
+{
+	NSTimeInterval deadline = DBL_MAX;
+	
+	for (DMLocationRequest* request in _requests)
+	{
+		deadline = MIN(deadline, request.deadline);
+	}
+	
+	if (DBL_MAX == deadline)
+	{
+		[self disarmTimer: _requestTimer];
+		return;
+	}
+	
+	[self armTimer: _requestTimer interval: MAX(deadline - DMLocationManagerMonotonicTime(), 0.0)];
+}
+
+- (void)requestTimerPassed
+{
+	NSTimeInterval now	= DMLocationManagerMonotonicTime();
+	NSError* error		= [NSError errorWithDomain: DMLocationRequestErrorDomain code: DMLocationRequestErrorTimedOut userInfo: nil];
+	NSArray* requests	= [_requests copy];
+	
+	for (DMLocationRequest* request in requests)
+	{
+		if (request.deadline <= now)
+			[self finishRequest: request error: error];
+	}
+	
+	[requests release];
+	
+	[self armRequestTimer];
+}
+
+/**
+ * Complete every request the location satisfies. A completion may add or cancel requests, so a copy is iterated.
+ *
+ */
+- (void)requestLocationHandler:(CLLocation*)location
+{
+	NSArray* requests = [_requests copy];
+	
+	for (DMLocationRequest* request in requests)
+	{
+		if ([request handleLocation: location])
+			[self finishRequest: request error: nil];
+	}
+	
+	[requests release];
+}
+
+/**
+ * Remove the request and update the session before completing it, so its completion sees the current state.
+ *
+ */
+- (void)finishRequest:(DMLocationRequest*)request error:(NSError*)error
+{
+	if (YES == request.isFinished)
+		return;
+	
+	[request retain];
+	
+	[_requests removeObjectIdenticalTo: request];
+	[self updateSharedSession];
+	
+	[request finishWithError: error];
+	[request release];
+}
+
+- (void)failRequestsWithError:(NSError*)error
+{
+	if (0 == [_requests count])
+		return;
+	
+	NSDictionary* userInfo	= (nil != error) ? [NSDictionary dictionaryWithObject: error forKey: NSUnderlyingErrorKey] : nil;
+	NSError* requestError	= [NSError errorWithDomain: DMLocationRequestErrorDomain code: DMLocationRequestErrorFailed userInfo: userInfo];
+	NSArray* requests		= [_requests copy];
+	
+	for (DMLocationRequest* request in requests)
+	{
+		[self finishRequest: request error: requestError];
+	}
+	
+	[requests release];
+}
+
+
+#pragma mark -
+#pragma mark Location source
+
+/**
+ * Swap the source of the locations. A running update continues with the new source.
+ *
+ */
+- (void)setLocationSource:(id<DMLocationSource>)locationSource
+{
+	[self performOnEngine: ^{
+		if (locationSource == _locationSource)
+			return;
+		
+		BOOL isUpdating = (_isSourceUpdating || _isMonitoringSignificantChanges);
+		
+		[self leaveBackgroundMode];
+		
+		if (YES == _isDeferringUpdates)
+		{
+			_isDeferringUpdates = NO;
+			[_locationSource disallowDeferredLocationUpdates];
+		}
+		
+		[self stopMonitoringGeofences];
+		[self stopLocationUpdates];
+		_locationSource.delegate = nil;
+		[_locationSource release];
+		_locationSource = nil;
+		
+		_isCustomLocationSource = (nil != locationSource);
+		[_locationFilter reset];
+		[_smoother reset];
+		[_geofencer reset];
+		
+		if (YES == _isCustomLocationSource)
+		{
+			_locationSource = [locationSource retain];
+			[self setSourceAccuracy: _desiredAccuracy];
+		}
+		
+		if (NO == isUpdating)
+			return;
+		
+		[self createLocationSourceIfNeeded];
+		
+		_locationSource.delegate = self;
+		[self setSourceAccuracy: [self engineAccuracy]];
+		[self startLocationUpdates];
+		
+		if (YES == _isBatching)
+		{
+			[self allowDeferredUpdates];
+		}
+	}];
+}
+
+- (id<DMLocationSource>)locationSource
 {
-	for (id<DMLocationManagerDelegate> delegate in _delegates)
-	{
-		if ([delegate respondsToSelector: @selector(locationManagerWillUpdateLocation:)])
-			[delegate locationManagerWillUpdateLocation: self];
-	}
+	__block id<DMLocationSource> locationSource = nil;
+	
+	[self performOnEngineAndWait: ^{
+		locationSource = [_locationSource retain];
+	}];
+	
+	return [locationSource autorelease];
 }
 
-- (void)informDidUpdateToLocation:(CLLocation*)newLocation fromLocation:(CLLocation*)oldLocation
+- (void)setLocationFilter:(id<DMLocationFilter>)locationFilter
 {
-	for (id<DMLocationManagerDelegate> delegate in _delegates)
-	{
-		if ([delegate respondsToSelector: @selector(locationManager:didUpdateToLocation:fromLocation:)])
-			[delegate locationManager: _locationManager didUpdateToLocation: newLocation fromLocation: oldLocation];
-	}
+	[self performOnEngine: ^{
+		if (locationFilter == _locationFilter)
+			return;
+		
+		[_locationFilter release];
+		_locationFilter = [locationFilter retain];
+		[_locationFilter reset];
+	}];
 }
 
-- (void)informDidFailWithError:(NSError*)error
+- (id<DMLocationFilter>)locationFilter
 {
-	for (id<DMLocationManagerDelegate> delegate in _delegates)
-	{
-		if ([delegate respondsToSelector: @selector(locationManager:didFailWithError:)])
-			[delegate locationManager: _locationManager didFailWithError: error];
-	}
+	__block id<DMLocationFilter> locationFilter = nil;
+	
+	[self performOnEngineAndWait: ^{
+		locationFilter = [_locationFilter retain];
+	}];
+	
+	return [locationFilter autorelease];
 }
 
 
 #pragma mark -
-#pragma mark Location
+#pragma mark Public getter
 
 /**
- * Start updating the location
+ * Returns whether the location manager currently searches for new locations.
  *
  */
-- (void)startUpdatingLocation
+- (BOOL)isQuerying
 {
-	[self willUpdateLocationHandler];
-	
-	_locationManager.delegate = self;
-	[_locationManager startUpdatingLocation];
+	return _isQueryingTimerArmed;
 }
 
+
+#pragma mark -
+#pragma mark Metrics
+
 /**
- * Stop updating the location
+ * Start measuring a query and mark its interval for Instruments.
  *
  */
-- (void)stopUpdatingLocation
+- (void)beginQueryMetrics
 {
-	[_locationManager stopUpdatingLocation];
-	_locationManager.delegate = nil;
-	
-	[self stopQueryingTimer];
-	[self stopLoopTimer];
+	memset(&_queryMetrics, 0, sizeof(_queryMetrics));
+	_queryMetrics.timeToFirstSample		= -1.0;
+	_queryMetrics.timeToDesiredAccuracy	= -1.0;
+	_queryMetrics.outcome				= DMLocationManagerQueryOutcomeStopped;
 	
-	[self informDidStopUpdateLocation];
-}
-
-
-#pragma mark -
-#pragma mark Querying timer
-
-- (void)startQueryingTimer
-{
-	[self stopQueryingTimer];
+	// Count the radio time of a warm source from now on
+	if (YES == _isSourceUpdating)
+		_radioStartTime = DMLocationManagerMonotonicTime();
 	
-	_queryingTimer = [[NSTimer scheduledTimerWithTimeInterval: _queryingInterval target: self selector: @selector(queryingTimerPassed:) userInfo: nil repeats: YES] retain];
-}
+	_queryStartTime		= DMLocationManagerMonotonicTime();
+	_isMeasuringQuery	= YES;
 
-- (void)stopQueryingTimer
-{
-	if (_queryingTimer)
+#if DM_LOCATION_MANAGER_SIGNPOSTS
+	if (@available(iOS 12.0, *))
 	{
-		if ([_queryingTimer isValid])
-		{
-			[_queryingTimer invalidate];
-		}
-		[_queryingTimer release];
-		_queryingTimer = nil;
+		os_log_t log	= DMLocationManagerSignpostLog();
+		_querySignpost	= os_signpost_id_generate(log);
+		os_signpost_interval_begin(log, _querySignpost, "Query", "desired accuracy %f", _sessionAccuracy);
 	}
+#endif
 }
 
-- (void)queryingTimerPassed:(NSTimer*)queryingTimer
+/**
+ * Finish measuring the query and add it to the metrics of all queries.
+ *
+ */
+- (void)endQueryMetrics
 {
-	[self stopUpdatingLocation];
-	[self stopQueryingTimer];
+	if (NO == _isMeasuringQuery)
+		return;
+	
+	_isMeasuringQuery		= NO;
+	_queryMetrics.duration	= [self queryTime];
+	
+	_metrics.lastQuery = _queryMetrics;
+	_metrics.queryCount++;
+	
+	if (DMLocationManagerQueryOutcomeTimedOut == _queryMetrics.outcome)
+		_metrics.timeoutCount++;
 	
-	if (_location)
+	if (_queryMetrics.timeToFirstSample >= 0.0)
 	{
-		[self informDidUpdateToLocation: _location fromLocation: nil];
+		_firstSampleCount++;
+		_totalTimeToFirstSample += _queryMetrics.timeToFirstSample;
 	}
-	else
+	
+	if (_queryMetrics.timeToDesiredAccuracy >= 0.0)
 	{
-		[self informDidFailWithError: nil];
+		_desiredAccuracyCount++;
+		_totalTimeToDesiredAccuracy += _queryMetrics.timeToDesiredAccuracy;
 	}
-}
-
-
-#pragma mark -
-#pragma mark Loop timer
 
-- (void)startLoopTimer
-{
-	[self stopLoopTimer];
-	
-	_loopTimer = [[NSTimer scheduledTimerWithTimeInterval: _loopTimeInterval target: self selector: @selector(loopTimerPassed:) userInfo: nil repeats: YES] retain];
-}
-
-- (void)stopLoopTimer
-{
-	if (_loopTimer)
+#if DM_LOCATION_MANAGER_SIGNPOSTS
+	if (@available(iOS 12.0, *))
 	{
-		if ([_loopTimer isValid])
-		{
-			[_loopTimer invalidate];
-		}
-		[_loopTimer release];
-		_loopTimer = nil;
+		os_signpost_interval_end(DMLocationManagerSignpostLog(), _querySignpost, "Query", "outcome %d samples %lu discarded %lu first sample %f", (int)_queryMetrics.outcome, (unsigned long)_queryMetrics.samplesReceived, (unsigned long)_queryMetrics.samplesDiscarded, _queryMetrics.timeToFirstSample);
 	}
+#endif
 }
 
-- (void)loopTimerPassed:(NSTimer*)loopTimer
-{	
-	[self stopLoopTimer];
-	[self startUpdatingLocation];
-}
-
-
-#pragma mark -
-#pragma mark Desired accuracy
-
-- (void)setDesiredAccuracy:(CLLocationAccuracy)accuracy
+/**
+ * Returns the seconds since the start of the query.
+ *
+ */
+- (NSTimeInterval)queryTime
 {
-	_locationManager.desiredAccuracy = accuracy;
+	return DMLocationManagerMonotonicTime() - _queryStartTime;
 }
 
-- (CLLocationAccuracy) desiredAccuracy
+- (DMLocationManagerMetrics)metrics
 {
-	return _locationManager.desiredAccuracy;
+	__block DMLocationManagerMetrics metrics;
+	
+	[self performOnEngineAndWait: ^{
+		metrics								= _metrics;
+		metrics.timeoutRate					= (metrics.queryCount > 0) ? (double)metrics.timeoutCount / metrics.queryCount : 0.0;
+		metrics.meanTimeToFirstSample		= (_firstSampleCount > 0) ? _totalTimeToFirstSample / _firstSampleCount : -1.0;
+		metrics.meanTimeToDesiredAccuracy	= (_desiredAccuracyCount > 0) ? _totalTimeToDesiredAccuracy / _desiredAccuracyCount : -1.0;
+	}];
+	
+	return metrics;
 }
 
-
-#pragma mark -
-#pragma mark Public getter
-
-/**
- * Returns whether the location manager currently searches for new locations.
- *
- */
-- (BOOL)isQuerying
+- (void)resetMetrics
 {
-	return [_queryingTimer isValid];
+	[self performOnEngine: ^{
+		memset(&_metrics, 0, sizeof(_metrics));
+		_firstSampleCount			= 0;
+		_desiredAccuracyCount		= 0;
+		_totalTimeToFirstSample		= 0.0;
+		_totalTimeToDesiredAccuracy	= 0.0;
+	}];
 }
 
 
@@ -364,7 +3651,22 @@ static DMLocationManager* sharedLocationManager = nil;
  */
 - (void)willUpdateLocationHandler
 {
+	[self clearRevalidation];
+	
+	_hasSessionLocation			= NO;
+	_hasProvisionalLocation		= NO;
+	_samplesWithoutImprovement	= 0;
+	_lastImprovementTime		= DMLocationManagerMonotonicTime();
+	
+	// The adaptive loop relaxes the desired accuracy of the cycle with the speed
+	_sessionAccuracy			= (YES == _loop && YES == _adaptsLoopTimeInterval) ? MAX(_desiredAccuracy, _adaptiveAccuracy) : _desiredAccuracy;
+	
+	// Begin with a coarse accuracy for a fast first location and escalate after it arrived
+	_isEscalatingAccuracy		= (YES == _escalatesAccuracy && _provisionalAccuracy > _sessionAccuracy);
+	
 	[self startQueryingTimer];
+	[self setSourceAccuracy: (YES == _isEscalatingAccuracy) ? _provisionalAccuracy : _sessionAccuracy];
+	[self beginQueryMetrics];
 	
 	[self informWillUpdateLocation];
 }
@@ -374,14 +3676,21 @@ static DMLocationManager* sharedLocationManager = nil;
  *
  */
 - (void)didUpdateLocationHandler
-{	
+{
+	_queryMetrics.outcome = DMLocationManagerQueryOutcomeDetermined;
+	
 	[self stopUpdatingLocation];
 	
-	[self informDidUpdateToLocation: _location fromLocation: nil];
+	[self determinedLocationHandler];
 	
 	// If YES start immedeatly searching new locations after one was found
 	if (YES == _loop)
 	{
+		if (YES == _adaptsLoopTimeInterval)
+		{
+			[self adaptLoop];
+		}
+		
 		[self startLoopTimer];
 	}
 }
@@ -392,93 +3701,328 @@ static DMLocationManager* sharedLocationManager = nil;
  */
 - (void)didFailWithErrorHandler:(NSError*)error
 {
+	_queryMetrics.outcome = DMLocationManagerQueryOutcomeFailed;
+	
 	[self stopUpdatingLocation];
+	[self clearRevalidation];
 	
 	[self informDidFailWithError: error];
 }
 
+/**
+ * Handling the final location of a query.
+ *
+ */
+- (void)determinedLocationHandler
+{
+	[_cache addRecentLocation: _location];
+	
+	// The delegates already got the revalidated location, inform only if the location moved significantly
+	BOOL hasMoved = (nil == _revalidatedLocation || [_location distanceFromLocation: _revalidatedLocation] >= _revalidationDistance);
+	[self clearRevalidation];
+	
+	BOOL hasProvisionalLocation = _hasProvisionalLocation;
+	_hasProvisionalLocation = NO;
+	
+	if (NO == hasMoved || YES == [self isRedundantLocation: _location])
+	{
+		// The delegates got provisional locations and wait for the final one, although it is no new location
+		if (YES == hasProvisionalLocation)
+		{
+			[self informDidUpdateLocation: _location provisional: NO];
+		}
+		return;
+	}
+	
+	[self informDidDeliverLocation: _location provisional: NO];
+}
+
 #pragma mark -
-#pragma mark CLLocationManagerDelegate
+#pragma mark DMLocationSourceDelegate
+
+/**
+ * Invoked when a new location of the source is available.
+ *
+ */
+- (void)locationSource:(id<DMLocationSource>)source didUpdateLocation:(CLLocation*)newLocation
+{
+	[self performOnEngine: ^{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+		NSLog(@"locationManager didUpdateLocation: %@", newLocation);
+#endif
+
+		if (source != _locationSource)
+			return;
+		
+		// Do not record a trace which is replayed
+		if (NO == [source isKindOfClass: [DMLocationTraceSource class]])
+		{
+			[_traceRecorder recordLocation: newLocation];
+		}
+		
+		[self locationHandler: newLocation];
+	}];
+}
 
 /**
- * Invoked when a new location is available. oldLocation may be nil if there is no previous location
+ * Processing a raw location of the source.
  *
  */
-- (void)locationManager:(CLLocationManager*)manager
-	 didUpdateToLocation:(CLLocation*)newLocation
-		    fromLocation:(CLLocation*)oldLocation
+- (void)locationHandler:(CLLocation*)newLocation
 {
+	// Impossible locations must not reach anything
+	if (nil != _locationFilter && NO == [_locationFilter acceptsSample: DMLocationSampleMakeWithLocation(newLocation)])
+	{
 #if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
-	NSLog(@"locationManager didUpdateToLocation: %@\nfrom: %@", newLocation, oldLocation);
+		NSLog(@"locationManager rejects location %@", newLocation);
 #endif
+		return;
+	}
+	
+	if (nil != _smoother)
+	{
+		[self smoothLocation: newLocation];
+	}
+	
+	if (nil != _geofencer)
+	{
+		[self geofenceLocation: newLocation];
+	}
+	
+	if (0 < [_requests count])
+	{
+		[self requestLocationHandler: newLocation];
+	}
+	
+	if (0 < _subscriptionCount)
+	{
+		[self informSubscribersOfLocation: newLocation];
+	}
+	
+	if (YES == _isInBackgroundMode)
+	{
+		[self backgroundLocationHandler: newLocation];
+		return;
+	}
+	
+	if (YES == _isBatching)
+	{
+		if (NO == _useCache && fabs([newLocation.timestamp timeIntervalSinceNow]) > _cacheAge)
+			return;
+		
+		[self recordLocation: newLocation];
+		[self batchLocationHandler: newLocation];
+		return;
+	}
+	
+	// Ignore locations which were delivered after the updating was stopped
+	if (NO == _isQueryingTimerArmed)
+		return;
+	
+	_queryMetrics.samplesReceived++;
+	_metrics.samplesReceived++;
 	
 	// If cache is deactivated do only use fresh locations within 'cache time interval'
 	if (NO == _useCache)
-	{        
+	{
 		NSDate* eventDate			= newLocation.timestamp;
 		NSTimeInterval howRecent	= [eventDate timeIntervalSinceNow];
 		
-		if(abs(howRecent) > _cacheAge)
+		if(fabs(howRecent) > _cacheAge)
 		{
 #if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
 			NSLog(@"locationManager didUpdateToLocation with timestamp %@ which is to old to use", newLocation.timestamp);
 #endif
+			_queryMetrics.samplesDiscarded++;
+			_metrics.samplesDiscarded++;
 			return;
 		}
 	}
 	
+	[self recordLocation: newLocation];
+	
+	if (_queryMetrics.timeToFirstSample < 0.0)
+	{
+		_queryMetrics.timeToFirstSample = [self queryTime];
+	}
+	
 	// If cache is activated or location is fresh enough determine the accuracy of the location in comparison to old locations
 	// If the desired accuracy is reached stop here with success, else let the location manager query again
-    
-    // We have a measurement that meets our requirements, so we can stop updating the location
-    if (newLocation.horizontalAccuracy <= manager.desiredAccuracy)
+	
+	// We have a measurement that meets our requirements, so we can stop updating the location
+	if (newLocation.horizontalAccuracy <= _sessionAccuracy)
 	{
-        [_location release];
-		_location = [newLocation retain];
+		[self storeLocation: newLocation];
+		_hasSessionLocation = YES;
+		
+		_queryMetrics.timeToDesiredAccuracy = [self queryTime];
 		
 		[self didUpdateLocationHandler];
 	}
-    // New location is better than the old one but does not reach the desired accuracy
-	else if (_location == nil || _location.horizontalAccuracy > newLocation.horizontalAccuracy)
+	// New location is the first one of this query or better than the old one but does not reach the desired accuracy
+	else if (NO == _hasSessionLocation || _location.horizontalAccuracy > newLocation.horizontalAccuracy)
+	{
+		[self storeLocation: newLocation];
+		_hasSessionLocation = YES;
+		
+		_samplesWithoutImprovement	= 0;
+		_lastImprovementTime		= DMLocationManagerMonotonicTime();
+		
+		// Deliver the refinement and aim for the desired accuracy after the provisional location
+		if (YES == _escalatesAccuracy)
+		{
+			[self informDidUpdateLocation: _location provisional: YES];
+			_hasProvisionalLocation = YES;
+		}
+		
+		if (YES == _isEscalatingAccuracy)
+		{
+			_isEscalatingAccuracy = NO;
+			[self setSourceAccuracy: _sessionAccuracy];
+		}
+	}
+	// The accuracy did not improve, stop early if it converged
+	else
 	{
-		[_location release];
-		_location = [newLocation retain];
+		_samplesWithoutImprovement++;
+		
+		if ([self hasConverged])
+		{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_DEBUG
+			NSLog(@"locationManager converged with accuracy %f after %lu samples without improvement", _location.horizontalAccuracy, (unsigned long)_samplesWithoutImprovement);
+#endif
+			[self didUpdateLocationHandler];
+		}
 	}
 }
 
+/**
+ * Invoked when the source stopped deferring updates, e.g. after the distance or timeout was reached.
+ *
+ */
+- (void)locationSource:(id<DMLocationSource>)source didFinishDeferredUpdatesWithError:(NSError*)error
+{
+	[self performOnEngine: ^{
+		if (source != _locationSource)
+			return;
+		
+		_isDeferringUpdates = NO;
+		
+		if (YES == _isBatching)
+		{
+			[self allowDeferredUpdates];
+		}
+	}];
+}
+
+/**
+ * Invoked when a monitored geofence was entered, possibly while the app was suspended.
+ *
+ */
+- (void)locationSource:(id<DMLocationSource>)source didEnterRegion:(CLRegion*)region
+{
+	[self performOnEngine: ^{
+		if (source != _locationSource)
+			return;
+		
+		CLCircularRegion* geofence = [_geofencer transitionRegionWithIdentifier: region.identifier inside: YES];
+		
+		if (nil != geofence)
+			[self informDidEnterGeofence: geofence];
+	}];
+}
+
+/**
+ * Invoked when a monitored geofence or the boundary around them was exited. After the boundary a location swaps in the nearest geofences.
+ *
+ */
+- (void)locationSource:(id<DMLocationSource>)source didExitRegion:(CLRegion*)region
+{
+	[self performOnEngine: ^{
+		if (source != _locationSource)
+			return;
+		
+		if ([region.identifier isEqualToString: DMLocationManagerGeofenceBoundaryIdentifier])
+		{
+			[self requestLocationWithAccuracy: DM_LOCATION_MANAGER_GEOFENCE_BOUNDARY_ACCURACY maximumAge: 0.0 timeout: DM_LOCATION_MANAGER_GEOFENCE_BOUNDARY_TIMEOUT completion: nil];
+			return;
+		}
+		
+		CLCircularRegion* geofence = [_geofencer transitionRegionWithIdentifier: region.identifier inside: NO];
+		
+		if (nil != geofence)
+			[self informDidExitGeofence: geofence];
+	}];
+}
+
 /**
  * Invoked when an error occurred. Check error domain and code for reason.
  *
  */
-- (void)locationManager:(CLLocationManager*)manager
-	    didFailWithError:(NSError*)error
+- (void)locationSource:(id<DMLocationSource>)source didFailWithError:(NSError*)error
 {
+	[self performOnEngine: ^{
 #if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
-	NSLog(@"locationManager didFailWithError: %@", [error domain]);
+		NSLog(@"locationManager didFailWithError: %@", [error domain]);
 #endif
-	
-	if ([error domain] == kCLErrorDomain)
-	{
-		switch ([error code])
+
+		if (source != _locationSource)
+			return;
+		
+		// Core location goes on trying after an unknown location, the requests may still be served
+		if (NO == ([error domain] == kCLErrorDomain && kCLErrorLocationUnknown == [error code]))
+		{
+			[self failRequestsWithError: error];
+		}
+		
+		if ([error domain] == kCLErrorDomain)
 		{
-			case kCLErrorDenied:
+			switch ([error code])
 			{
-				if (_isLocationServiceEnabled != NO)
-				{			
-					_isLocationServiceEnabled = NO;
-					[self informDidChangeLocationServiceEnabledState: _isLocationServiceEnabled];
+				case kCLErrorDenied:
+				{
+					if (_isLocationServiceEnabled != NO)
+					{
+						_isLocationServiceEnabled = NO;
+						[self informDidChangeLocationServiceEnabledState: _isLocationServiceEnabled];
+					}
+					
+					break;
+				}
+				default:
+				{
+					break;
 				}
-				
-				break;
-			}
-			default:
-			{
-				break;
 			}
 		}
-	}
-	
-	[self didFailWithErrorHandler: error];
+		
+		// Do not bother the delegates with errors of the background monitoring
+		if (YES == _isInBackgroundMode)
+		{
+			[self leaveBackgroundMode];
+			[self updateSharedSession];
+			
+			if (NO == _isSourceUpdating && nil == _geofenceBoundary)
+				_locationSource.delegate = nil;
+			return;
+		}
+		
+		[self didFailWithErrorHandler: error];
+	}];
+}
+
+/**
+ * Invoked when a replayed trace ended, core location delivers the locations again.
+ *
+ */
+- (void)locationSourceDidFinish:(id<DMLocationSource>)source
+{
+	[self performOnEngine: ^{
+		if (source == _locationSource && [source isKindOfClass: [DMLocationTraceSource class]])
+		{
+			[self setLocationSource: nil];
+		}
+	}];
 }
 
 @end
@@ -0,0 +1,80 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ * A DMLocationPointIndex answers nearest and within radius queries over tens of thousands of points, e.g. points of interest.
+ * It is built once from the coordinates as a flat k-d tree of unit vectors, so the distances are exact around the globe.
+ * The points are identified by their index in the coordinates. Queries fill a buffer of the caller and never allocate:
+ *
+ *		DMLocationPointIndex* index = [[DMLocationPointIndex alloc] initWithCoordinates:coordinates count:count];
+ *
+ *		DMLocationPointNeighbor neighbors[5];
+ *		NSUInteger found = [index getNearestNeighbors:neighbors count:5 ofCoordinate:location.coordinate];
+ *
+ * An index is immutable and can be queried from any thread.
+ */
+
+/**
+ * A point found by a query, with its index in the coordinates and its distance in meters.
+ */
+typedef struct
+{
+	NSUInteger				index;
+	CLLocationDistance		distance;
+} DMLocationPointNeighbor;
+
+typedef struct DMLocationPointIndexNode DMLocationPointIndexNode;
+
+#pragma mark -
+#pragma mark DMLocationPointIndex
+
+@interface DMLocationPointIndex : NSObject
+{
+@private
+	DMLocationPointIndexNode*	_nodes;				// The median of each range is the node splitting it
+	DMLocationPointIndexNode*	_points;			// The same vectors by index of the point
+	NSUInteger					_count;
+}
+
+/**
+ * The amount of points.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						count;
+
+/**
+ * Build the index of the coordinates, which are copied.
+ */
+- (id)initWithCoordinates:(const CLLocationCoordinate2D*)coordinates count:(NSUInteger)count;
+
+/**
+ * Fill the neighbors with up to the amount of the points nearest to the coordinate, ordered by distance. Returns how many were found.
+ */
+- (NSUInteger)getNearestNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count ofCoordinate:(CLLocationCoordinate2D)coordinate;
+
+/**
+ * Like getNearestNeighbors:count:ofCoordinate: but only points within the radius in meters. If there are more, the nearest ones are returned.
+ */
+- (NSUInteger)getNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count withinRadius:(CLLocationDistance)radius ofCoordinate:(CLLocationCoordinate2D)coordinate;
+
+/**
+ * Returns the distance in meters of the point to the coordinate.
+ */
+- (CLLocationDistance)distanceOfPoint:(NSUInteger)index toCoordinate:(CLLocationCoordinate2D)coordinate;
+
+@end
@@ -0,0 +1,351 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationPointIndex.h"
+
+#define DM_LOCATION_POINT_INDEX_EARTH_RADIUS	6371008.8
+
+/**
+ * A point as unit vector, the axis is only used by the nodes of the tree.
+ */
+struct DMLocationPointIndexNode
+{
+	double					vector[3];
+	uint32_t				index;
+	uint32_t				axis;
+};
+
+/**
+ * State of a query. The neighbors are a max heap by the squared chord while searching.
+ */
+typedef struct
+{
+	double						vector[3];
+	DMLocationPointNeighbor*	neighbors;
+	NSUInteger					capacity;
+	NSUInteger					count;
+	double						bound;				// Squared chord of the radius
+} DMLocationPointIndexQuery;
+
+static void DMLocationPointIndexVector(CLLocationCoordinate2D coordinate, double* vector)
+{
+	double latitude		= coordinate.latitude * M_PI / 180.0;
+	double longitude	= coordinate.longitude * M_PI / 180.0;
+
+	vector[0] = cos(latitude) * cos(longitude);
+	vector[1] = cos(latitude) * sin(longitude);
+	vector[2] = sin(latitude);
+}
+
+static inline double DMLocationPointIndexSquaredChord(const double* a, const double* b)
+{
+	double x = a[0] - b[0];
+	double y = a[1] - b[1];
+	double z = a[2] - b[2];
+
+	return x * x + y * y + z * z;
+}
+
+/**
+ * Returns the distance in meters along the surface for the squared chord between two unit vectors.
+ */
+static inline CLLocationDistance DMLocationPointIndexDistance(double squaredChord)
+{
+	return 2.0 * DM_LOCATION_POINT_INDEX_EARTH_RADIUS * asin(MIN(0.5 * sqrt(squaredChord), 1.0));
+}
+
+/**
+ * Partially sort the range, so the median is at its place with smaller values on the axis before and greater ones after it.
+ */
+static void DMLocationPointIndexSelect(DMLocationPointIndexNode* nodes, NSUInteger low, NSUInteger high, NSUInteger median, uint32_t axis)
+{
+	while (high - low > 1)
+	{
+		double pivot		= nodes[low + (high - low) / 2].vector[axis];
+		NSUInteger left		= low;
+		NSUInteger right	= high - 1;
+
+		while (left <= right)
+		{
+			while (nodes[left].vector[axis] < pivot)
+				left++;
+			while (nodes[right].vector[axis] > pivot)
+				right--;
+
+			if (left <= right)
+			{
+				DMLocationPointIndexNode node	= nodes[left];
+				nodes[left]						= nodes[right];
+				nodes[right]					= node;
+
+				left++;
+				if (0 == right)
+					break;
+				right--;
+			}
+		}
+
+		if (median <= right)
+			high = right + 1;
+		else if (median >= left)
+			low = left;
+		else
+			return;
+	}
+}
+
+/**
+ * Split each range at its median along the axis of the widest spread.
+ */
+static void DMLocationPointIndexBuild(DMLocationPointIndexNode* nodes, NSUInteger low, NSUInteger high)
+{
+	if (high - low < 2)
+	{
+		if (high > low)
+			nodes[low].axis = 0;
+		return;
+	}
+
+	double minimum[3]	= { DBL_MAX, DBL_MAX, DBL_MAX };
+	double maximum[3]	= { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+
+	for (NSUInteger i = low; i < high; i++)
+	{
+		for (uint32_t axis = 0; axis < 3; axis++)
+		{
+			minimum[axis] = MIN(minimum[axis], nodes[i].vector[axis]);
+			maximum[axis] = MAX(maximum[axis], nodes[i].vector[axis]);
+		}
+	}
+
+	uint32_t axis = 0;
+
+	for (uint32_t i = 1; i < 3; i++)
+	{
+		if (maximum[i] - minimum[i] > maximum[axis] - minimum[axis])
+			axis = i;
+	}
+
+	NSUInteger median = low + (high - low) / 2;
+
+	DMLocationPointIndexSelect(nodes, low, high, median, axis);
+	nodes[median].axis = axis;
+
+	DMLocationPointIndexBuild(nodes, low, median);
+	DMLocationPointIndexBuild(nodes, median + 1, high);
+}
+
+/**
+ * Returns the squared chord a point must be nearer than to be a neighbor.
+ */
+static inline double DMLocationPointIndexWorst(const DMLocationPointIndexQuery* query)
+{
+	return (query->count < query->capacity) ? query->bound : query->neighbors[0].distance;
+}
+
+static void DMLocationPointIndexSiftDown(DMLocationPointNeighbor* neighbors, NSUInteger count, NSUInteger i)
+{
+	for (;;)
+	{
+		NSUInteger largest	= i;
+		NSUInteger left		= 2 * i + 1;
+		NSUInteger right	= left + 1;
+
+		if (left < count && neighbors[left].distance > neighbors[largest].distance)
+			largest = left;
+		if (right < count && neighbors[right].distance > neighbors[largest].distance)
+			largest = right;
+
+		if (largest == i)
+			return;
+
+		DMLocationPointNeighbor neighbor	= neighbors[i];
+		neighbors[i]						= neighbors[largest];
+		neighbors[largest]					= neighbor;
+
+		i = largest;
+	}
+}
+
+static void DMLocationPointIndexConsider(DMLocationPointIndexQuery* query, const DMLocationPointIndexNode* node, double squaredChord)
+{
+	if (squaredChord > DMLocationPointIndexWorst(query) || (query->count == query->capacity && squaredChord == query->neighbors[0].distance))
+		return;
+
+	DMLocationPointNeighbor neighbor = { node->index, squaredChord };
+
+	// Replace the farthest neighbor if full, else sift the new one up
+	if (query->count == query->capacity)
+	{
+		query->neighbors[0] = neighbor;
+		DMLocationPointIndexSiftDown(query->neighbors, query->count, 0);
+		return;
+	}
+
+	NSUInteger i = query->count++;
+
+	while (i > 0 && query->neighbors[(i - 1) / 2].distance < squaredChord)
+	{
+		query->neighbors[i]	= query->neighbors[(i - 1) / 2];
+		i					= (i - 1) / 2;
+	}
+
+	query->neighbors[i] = neighbor;
+}
+
+/**
+ * Visit the side of the query first and the other side only if it can contain a nearer point. The depth is logarithmic.
+ */
+static void DMLocationPointIndexSearch(const DMLocationPointIndexNode* nodes, NSUInteger low, NSUInteger high, DMLocationPointIndexQuery* query)
+{
+	if (low >= high)
+		return;
+
+	NSUInteger median					= low + (high - low) / 2;
+	const DMLocationPointIndexNode* node	= &nodes[median];
+
+	DMLocationPointIndexConsider(query, node, DMLocationPointIndexSquaredChord(node->vector, query->vector));
+
+	double difference = query->vector[node->axis] - node->vector[node->axis];
+
+	if (difference < 0.0)
+	{
+		DMLocationPointIndexSearch(nodes, low, median, query);
+
+		if (difference * difference <= DMLocationPointIndexWorst(query))
+			DMLocationPointIndexSearch(nodes, median + 1, high, query);
+	}
+	else
+	{
+		DMLocationPointIndexSearch(nodes, median + 1, high, query);
+
+		if (difference * difference <= DMLocationPointIndexWorst(query))
+			DMLocationPointIndexSearch(nodes, low, median, query);
+	}
+}
+
+
+@interface DMLocationPointIndex (private)
+- (NSUInteger)getNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count boundedBy:(double)bound ofCoordinate:(CLLocationCoordinate2D)coordinate;
+@end
+
+@implementation DMLocationPointIndex
+
+@synthesize count = _count;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithCoordinates:(const CLLocationCoordinate2D*)coordinates count:(NSUInteger)count
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_count	= MIN(count, (NSUInteger)UINT32_MAX);
+		_points	= malloc(MAX(_count, 1) * sizeof(DMLocationPointIndexNode));
+		_nodes	= malloc(MAX(_count, 1) * sizeof(DMLocationPointIndexNode));
+
+		for (NSUInteger i = 0; i < _count; i++)
+		{
+			DMLocationPointIndexVector(coordinates[i], _points[i].vector);
+			_points[i].index	= (uint32_t)i;
+			_points[i].axis		= 0;
+		}
+
+		memcpy(_nodes, _points, _count * sizeof(DMLocationPointIndexNode));
+		DMLocationPointIndexBuild(_nodes, 0, _count);
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	free(_nodes);
+	free(_points);
+
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Queries
+
+- (NSUInteger)getNearestNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count ofCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	return [self getNeighbors: neighbors count: count boundedBy: DBL_MAX ofCoordinate: coordinate];
+}
+
+- (NSUInteger)getNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count withinRadius:(CLLocationDistance)radius ofCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	if (radius < 0.0)
+		return 0;
+
+	double chord = 2.0 * sin(0.5 * MIN(radius / DM_LOCATION_POINT_INDEX_EARTH_RADIUS, M_PI));
+
+	return [self getNeighbors: neighbors count: count boundedBy: chord * chord ofCoordinate: coordinate];
+}
+
+/**
+ * Search the tree with the heap in the buffer of the caller, then sort the heap and convert the chords to meters.
+ *
+ */
+- (NSUInteger)getNeighbors:(DMLocationPointNeighbor*)neighbors count:(NSUInteger)count boundedBy:(double)bound ofCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	if (0 == count || 0 == _count)
+		return 0;
+
+	DMLocationPointIndexQuery query;
+
+	DMLocationPointIndexVector(coordinate, query.vector);
+	query.neighbors	= neighbors;
+	query.capacity	= count;
+	query.count		= 0;
+	query.bound		= bound;
+
+	DMLocationPointIndexSearch(_nodes, 0, _count, &query);
+
+	for (NSUInteger i = query.count; i > 1; i--)
+	{
+		DMLocationPointNeighbor neighbor	= neighbors[0];
+		neighbors[0]						= neighbors[i - 1];
+		neighbors[i - 1]					= neighbor;
+
+		DMLocationPointIndexSiftDown(neighbors, i - 1, 0);
+	}
+
+	for (NSUInteger i = 0; i < query.count; i++)
+	{
+		neighbors[i].distance = DMLocationPointIndexDistance(neighbors[i].distance);
+	}
+
+	return query.count;
+}
+
+- (CLLocationDistance)distanceOfPoint:(NSUInteger)index toCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	double vector[3];
+
+	if (index >= _count)
+		return -1.0;
+
+	DMLocationPointIndexVector(coordinate, vector);
+
+	return DMLocationPointIndexDistance(DMLocationPointIndexSquaredChord(_points[index].vector, vector));
+}
+
+@end
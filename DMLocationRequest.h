@@ -0,0 +1,111 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ * A DMLocationRequest asks the DMLocationManager once for a location with its own accuracy, age and timeout.
+ * All outstanding requests share one session of the location source at the strictest accuracy, which stops after the last one finished:
+ *
+ *		[locationManager requestLocationWithAccuracy:kCLLocationAccuracyHundredMeters maximumAge:60.0 timeout:10.0 completion:^(CLLocation* location, NSError* error) {
+ *			if (nil == error)
+ *				[self showLocation:location];
+ *		}];
+ *
+ * On timeout the completion gets the best location so far, which may be nil, and a DMLocationRequestErrorTimedOut error.
+ */
+
+FOUNDATION_EXTERN NSString* const DMLocationRequestErrorDomain;
+
+typedef enum
+{
+	DMLocationRequestErrorTimedOut = 1,		// The timeout passed before the accuracy was reached
+	DMLocationRequestErrorFailed			// The location source failed, the underlying error is in the user info
+} DMLocationRequestError;
+
+/**
+ * Invoked once on the queue of the DMLocationManager engine, with the location or the best one until the error.
+ */
+typedef void (^DMLocationRequestCompletion)(CLLocation* location, NSError* error);
+
+#pragma mark -
+#pragma mark DMLocationRequest
+
+@interface DMLocationRequest : NSObject
+{
+@private
+	CLLocationAccuracy			_desiredAccuracy;
+	NSTimeInterval				_maximumAge;
+	NSTimeInterval				_timeout;
+	DMLocationRequestCompletion	_completion;
+	NSDate*						_startDate;
+	NSTimeInterval				_deadline;			// Monotonic time the request times out
+	CLLocation*					_location;			// Best location so far
+	BOOL						_isFinished;
+}
+
+/**
+ * The accuracy of the location which completes the request.
+ */
+@property (nonatomic, assign, readonly) CLLocationAccuracy				desiredAccuracy;
+
+/**
+ * How old in seconds a location may be, e.g. to complete with the last location immediately. 0 accepts only locations determined after the request.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					maximumAge;
+
+/**
+ * Seconds until the request completes with an error if the accuracy was not reached, 0 for no timeout.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					timeout;
+
+/**
+ * The monotonic time the request times out, comparable to DMLocationManagerMonotonicTime(). DBL_MAX without timeout.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval					deadline;
+
+/**
+ * The most accurate location of the request so far.
+ */
+@property (nonatomic, retain, readonly) CLLocation*						location;
+
+/**
+ * Returns whether the request completed or was cancelled.
+ */
+@property (nonatomic, assign, readonly) BOOL							isFinished;
+
+/**
+ * Create a request starting now. Requests are created by the DMLocationManager.
+ */
+- (id)initWithAccuracy:(CLLocationAccuracy)accuracy maximumAge:(NSTimeInterval)maximumAge timeout:(NSTimeInterval)timeout completion:(DMLocationRequestCompletion)completion;
+
+/**
+ * Keep the location if it is young enough and the most accurate one so far. Returns YES if it reaches the desired accuracy.
+ */
+- (BOOL)handleLocation:(CLLocation*)location;
+
+/**
+ * Complete with the best location so far and the error, if not finished yet.
+ */
+- (void)finishWithError:(NSError*)error;
+
+/**
+ * Finish without invoking the completion.
+ */
+- (void)invalidate;
+
+@end
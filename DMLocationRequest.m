@@ -0,0 +1,108 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationRequest.h"
+#import "DMLocationManager.h"
+
+NSString* const DMLocationRequestErrorDomain = @"de.devmob.DMLocationRequest";
+
+
+#pragma mark -
+#pragma mark DMLocationRequest
+
+@implementation DMLocationRequest
+
+@synthesize desiredAccuracy	= _desiredAccuracy;
+@synthesize maximumAge		= _maximumAge;
+@synthesize timeout			= _timeout;
+@synthesize deadline		= _deadline;
+@synthesize location		= _location;
+@synthesize isFinished		= _isFinished;
+
+- (id)initWithAccuracy:(CLLocationAccuracy)accuracy maximumAge:(NSTimeInterval)maximumAge timeout:(NSTimeInterval)timeout completion:(DMLocationRequestCompletion)completion
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_desiredAccuracy	= accuracy;
+		_maximumAge			= MAX(maximumAge, 0.0);
+		_timeout			= MAX(timeout, 0.0);
+		_completion			= [completion copy];
+		_startDate			= [NSDate new];
+		_deadline			= (_timeout > 0.0) ? DMLocationManagerMonotonicTime() + _timeout : DBL_MAX;
+		_location			= nil;
+		_isFinished			= NO;
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[_completion release];
+	[_startDate release];
+	[_location release];
+	
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Handling
+
+- (BOOL)handleLocation:(CLLocation*)location
+{
+	if (nil == location || YES == _isFinished || location.horizontalAccuracy < 0.0)
+		return NO;
+	
+	// Locations determined after the start of the request are always young enough
+	if (-[location.timestamp timeIntervalSinceNow] > _maximumAge && [location.timestamp compare: _startDate] == NSOrderedAscending)
+		return NO;
+	
+	if (nil == _location || location.horizontalAccuracy < _location.horizontalAccuracy)
+	{
+		[_location release];
+		_location = [location retain];
+	}
+	
+	return (location.horizontalAccuracy <= _desiredAccuracy);
+}
+
+- (void)finishWithError:(NSError*)error
+{
+	if (YES == _isFinished)
+		return;
+	
+	_isFinished = YES;
+	
+	DMLocationRequestCompletion completion = _completion;
+	_completion = nil;
+	
+	if (completion)
+		completion(_location, error);
+	
+	[completion release];
+}
+
+- (void)invalidate
+{
+	_isFinished = YES;
+	
+	[_completion release];
+	_completion = nil;
+}
+
+@end
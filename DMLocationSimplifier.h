@@ -0,0 +1,89 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "DMLocationManager.h"
+
+@class DMLocationHistory;
+
+/**
+ * The DMLocationSimplifier compresses a track while it is recorded. Only samples which are significant for the shape are kept,
+ * every dropped sample is within the tolerance of the line between the kept samples around it.
+ *
+ *		DMLocationHistory* track		= [[DMLocationHistory alloc] initWithCapacity:1024];
+ *		DMLocationSimplifier* simplifier = [[DMLocationSimplifier alloc] initWithTolerance:10.0 history:track];
+ *		[simplifier addSample:sample];
+ *
+ * It works like Douglas-Peucker with an opening window: a sample is kept as soon as the line from the last kept sample to the
+ * newest one does not cover the samples between them anymore. The window is bounded, so the memory and time per sample are too.
+ * The simplifier is not thread safe, the history it writes to is.
+ */
+
+#pragma mark -
+#pragma mark DMLocationSimplifier
+
+#define DM_LOCATION_SIMPLIFIER_WINDOW_CAPACITY		64
+
+@interface DMLocationSimplifier : NSObject
+{
+@private
+	DMLocationHistory*	_history;
+	CLLocationDistance	_tolerance;
+	DMLocationSample	_anchor;				// Last kept sample
+	BOOL				_hasAnchor;
+	DMLocationSample	_window[DM_LOCATION_SIMPLIFIER_WINDOW_CAPACITY];	// Samples since the anchor, the last one is floating
+	NSUInteger			_windowCount;
+	NSUInteger			_inputCount;
+	NSUInteger			_outputCount;
+}
+
+/**
+ * The history the kept samples are added to.
+ */
+@property (nonatomic, retain, readonly) DMLocationHistory*				history;
+
+/**
+ * The maximum distance in meters of a dropped sample to the simplified track.
+ */
+@property (nonatomic, assign, readonly) CLLocationDistance				tolerance;
+
+/**
+ * The amount of samples which were added and which were kept.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						inputCount;
+@property (nonatomic, assign, readonly) NSUInteger						outputCount;
+
+/**
+ * Simplify with the tolerance in meters into the history.
+ */
+- (id)initWithTolerance:(CLLocationDistance)tolerance history:(DMLocationHistory*)history;
+
+/**
+ * Add the next sample of the track. Returns YES if a sample was kept in the history.
+ */
+- (BOOL)addSample:(DMLocationSample)sample;
+
+/**
+ * Keep the newest sample, e.g. at the end of the track. Returns YES if a sample was kept.
+ */
+- (BOOL)finish;
+
+/**
+ * Start a new track, the history is kept.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,162 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationSimplifier.h"
+#import "DMLocationHistory.h"
+
+#define DM_LOCATION_SIMPLIFIER_EARTH_RADIUS		6371008.8
+
+/**
+ * Returns the distance in meters of the sample to the segment from the start to the end.
+ * Within the short distances of a window the earth is flat enough to project the samples around the start.
+ */
+static CLLocationDistance DMLocationSimplifierDistanceToSegment(const DMLocationSample* sample, const DMLocationSample* start, const DMLocationSample* end)
+{
+	double scale	= M_PI / 180.0 * DM_LOCATION_SIMPLIFIER_EARTH_RADIUS;
+	double cosine	= cos(start->latitude * M_PI / 180.0);
+	
+	double x		= (sample->longitude - start->longitude) * cosine * scale;
+	double y		= (sample->latitude - start->latitude) * scale;
+	double dx		= (end->longitude - start->longitude) * cosine * scale;
+	double dy		= (end->latitude - start->latitude) * scale;
+	double length	= dx * dx + dy * dy;
+	
+	double t		= (length > 0.0) ? (x * dx + y * dy) / length : 0.0;
+	t				= MIN(MAX(t, 0.0), 1.0);
+	
+	return hypot(x - t * dx, y - t * dy);
+}
+
+
+@interface DMLocationSimplifier (private)
+- (void)keepSample:(DMLocationSample)sample;
+- (BOOL)coversWindowWithSample:(const DMLocationSample*)sample;
+@end
+
+@implementation DMLocationSimplifier
+
+@synthesize history		= _history;
+@synthesize tolerance	= _tolerance;
+@synthesize inputCount	= _inputCount;
+@synthesize outputCount	= _outputCount;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithTolerance:(CLLocationDistance)tolerance history:(DMLocationHistory*)history
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_history		= [history retain];
+		_tolerance		= MAX(tolerance, 0.0);
+		_hasAnchor		= NO;
+		_windowCount	= 0;
+		_inputCount		= 0;
+		_outputCount	= 0;
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[_history release];
+	
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Private
+
+- (void)keepSample:(DMLocationSample)sample
+{
+	[_history addSample: sample];
+	
+	_anchor		= sample;
+	_hasAnchor	= YES;
+	_outputCount++;
+}
+
+/**
+ * Returns YES if every sample of the window is within the tolerance of the line from the anchor to the sample.
+ *
+ */
+- (BOOL)coversWindowWithSample:(const DMLocationSample*)sample
+{
+	for (NSUInteger i = 0; i < _windowCount; i++)
+	{
+		if (DMLocationSimplifierDistanceToSegment(&_window[i], &_anchor, sample) > _tolerance)
+			return NO;
+	}
+	
+	return YES;
+}
+
+
+#pragma mark -
+#pragma mark Simplification
+
+- (BOOL)addSample:(DMLocationSample)sample
+{
+	_inputCount++;
+	
+	if (NO == _hasAnchor)
+	{
+		[self keepSample: sample];
+		return YES;
+	}
+	
+	// The line still covers the skipped samples, the sample becomes the floating end of the window
+	if (_windowCount < DM_LOCATION_SIMPLIFIER_WINDOW_CAPACITY && [self coversWindowWithSample: &sample])
+	{
+		_window[_windowCount++] = sample;
+		return NO;
+	}
+	
+	// Keep the floating end, which was the last sample the line covered the window to
+	BOOL hasKept = (_windowCount > 0);
+	if (YES == hasKept)
+	{
+		[self keepSample: _window[_windowCount - 1]];
+	}
+	
+	_window[0]		= sample;
+	_windowCount	= 1;
+	
+	return hasKept;
+}
+
+- (BOOL)finish
+{
+	if (0 == _windowCount)
+		return NO;
+	
+	[self keepSample: _window[_windowCount - 1]];
+	_windowCount = 0;
+	
+	return YES;
+}
+
+- (void)reset
+{
+	_hasAnchor		= NO;
+	_windowCount	= 0;
+}
+
+@end
@@ -0,0 +1,81 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <simd/simd.h>
+#import "DMLocationManager.h"
+
+/**
+ * The DMLocationSmoother runs a constant velocity Kalman filter over the samples and estimates the position and velocity:
+ *
+ *		DMLocationSmoother* smoother = [DMLocationSmoother new];
+ *		DMLocationEstimate estimate	 = [smoother addSample:sample];
+ *
+ * The state is the position east and north of a local origin and the velocity, in meters and meters per second.
+ * The origin follows the estimate if it moves away, so the flat projection stays exact. The small matrices are SIMD types,
+ * a sample takes a few dozen vector operations without any allocation. The smoother is not thread safe.
+ */
+
+#pragma mark -
+#pragma mark DMLocationSmoother
+
+@interface DMLocationSmoother : NSObject
+{
+@private
+	double				_processNoise;
+	NSTimeInterval		_maximumGap;
+	simd_double4		_state;				// East, north, velocity east, velocity north
+	simd_double4x4		_covariance;
+	DMLocationSample	_origin;			// Latitude and longitude of the local frame
+	NSTimeInterval		_timestamp;			// Monotonic time of the state
+	BOOL				_hasState;
+}
+
+/**
+ * The variance of the acceleration in meters squared per second cubed, how fast the velocity may change.
+ * Higher values follow turns faster, lower ones smooth more.
+ * Default is 1.
+ */
+@property (nonatomic, assign)			double							processNoise;
+
+/**
+ * If samples are further apart than this amount of seconds the filter starts again at the next sample.
+ * Default is 60 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					maximumGap;
+
+/**
+ * Returns whether a sample was added since the start or the last reset.
+ */
+@property (nonatomic, assign, readonly) BOOL							hasEstimate;
+
+/**
+ * Predict the state to the time of the sample and correct it by the position of the sample. Returns the new estimate.
+ * Samples without a valid accuracy or older than the state are ignored and the current estimate is returned.
+ */
+- (DMLocationEstimate)addSample:(DMLocationSample)sample;
+
+/**
+ * Returns the current estimate.
+ */
+- (DMLocationEstimate)estimate;
+
+/**
+ * Forget the state, the next sample starts the filter again.
+ */
+- (void)reset;
+
+@end
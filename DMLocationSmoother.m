@@ -0,0 +1,236 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationSmoother.h"
+
+#define DM_LOCATION_SMOOTHER_EARTH_RADIUS				6371008.8
+
+// The origin of the local frame is moved to the estimate once it is further away in meters
+#define DM_LOCATION_SMOOTHER_ORIGIN_DISTANCE			10000.0
+
+// Deviation of the velocity in meters per second at the start, if the sample does not know it, else if it does
+#define DM_LOCATION_SMOOTHER_UNKNOWN_SPEED_DEVIATION	10.0
+#define DM_LOCATION_SMOOTHER_KNOWN_SPEED_DEVIATION		1.0
+
+static double DMLocationSmootherMetersPerDegree(void)
+{
+	return M_PI / 180.0 * DM_LOCATION_SMOOTHER_EARTH_RADIUS;
+}
+
+/**
+ * Returns the position east and north of the origin in meters.
+ */
+static simd_double2 DMLocationSmootherProject(const DMLocationSample* origin, CLLocationDegrees latitude, CLLocationDegrees longitude)
+{
+	double scale = DMLocationSmootherMetersPerDegree();
+	
+	return (simd_double2){ (longitude - origin->longitude) * cos(origin->latitude * M_PI / 180.0) * scale, (latitude - origin->latitude) * scale };
+}
+
+
+@interface DMLocationSmoother (private)
+- (void)startWithSample:(const DMLocationSample*)sample;
+- (void)predictToTime:(NSTimeInterval)time;
+- (void)correctWithSample:(const DMLocationSample*)sample;
+- (void)moveOriginIfNeeded;
+- (CLLocationCoordinate2D)coordinateOfPosition:(simd_double2)position;
+@end
+
+@implementation DMLocationSmoother
+
+@synthesize processNoise	= _processNoise;
+@synthesize maximumGap		= _maximumGap;
+@synthesize hasEstimate		= _hasState;
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)init
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_processNoise	= 1.0;
+		_maximumGap		= 60.0;
+		
+		[self reset];
+	}
+	
+	return self;
+}
+
+
+#pragma mark -
+#pragma mark Smoothing
+
+- (DMLocationEstimate)addSample:(DMLocationSample)sample
+{
+	if (sample.horizontalAccuracy <= 0.0 || (YES == _hasState && sample.timestamp < _timestamp))
+		return [self estimate];
+	
+	if (NO == _hasState || sample.timestamp - _timestamp > _maximumGap)
+	{
+		[self startWithSample: &sample];
+		return [self estimate];
+	}
+	
+	[self predictToTime: sample.timestamp];
+	[self correctWithSample: &sample];
+	[self moveOriginIfNeeded];
+	
+	return [self estimate];
+}
+
+- (DMLocationEstimate)estimate
+{
+	DMLocationEstimate estimate;
+	
+	if (NO == _hasState)
+	{
+		memset(&estimate, 0, sizeof(estimate));
+		estimate.horizontalAccuracy	= -1.0;
+		estimate.speed				= -1.0;
+		estimate.course				= -1.0;
+		
+		return estimate;
+	}
+	
+	CLLocationCoordinate2D coordinate = [self coordinateOfPosition: _state.xy];
+	
+	estimate.latitude			= coordinate.latitude;
+	estimate.longitude			= coordinate.longitude;
+	estimate.horizontalAccuracy	= sqrt(0.5 * (_covariance.columns[0][0] + _covariance.columns[1][1]));
+	estimate.velocityEast		= _state.z;
+	estimate.velocityNorth		= _state.w;
+	estimate.speed				= simd_length(_state.zw);
+	estimate.course				= fmod(atan2(_state.z, _state.w) * 180.0 / M_PI + 360.0, 360.0);
+	estimate.timestamp			= _timestamp;
+	
+	return estimate;
+}
+
+- (void)reset
+{
+	_hasState	= NO;
+	_state		= (simd_double4){ 0.0, 0.0, 0.0, 0.0 };
+	_covariance	= simd_diagonal_matrix((simd_double4){ 0.0, 0.0, 0.0, 0.0 });
+	_timestamp	= 0.0;
+}
+
+
+#pragma mark -
+#pragma mark Private
+
+/**
+ * Start at the position of the sample, with its velocity if it knows speed and course.
+ *
+ */
+- (void)startWithSample:(const DMLocationSample*)sample
+{
+	double positionVariance	= sample->horizontalAccuracy * sample->horizontalAccuracy;
+	double speedDeviation	= DM_LOCATION_SMOOTHER_UNKNOWN_SPEED_DEVIATION;
+	simd_double2 velocity	= (simd_double2){ 0.0, 0.0 };
+	
+	if (sample->speed >= 0.0 && sample->course >= 0.0)
+	{
+		double course	= sample->course * M_PI / 180.0;
+		velocity		= (simd_double2){ sample->speed * sin(course), sample->speed * cos(course) };
+		speedDeviation	= DM_LOCATION_SMOOTHER_KNOWN_SPEED_DEVIATION;
+	}
+	
+	_origin		= *sample;
+	_state		= (simd_double4){ 0.0, 0.0, velocity.x, velocity.y };
+	_covariance	= simd_diagonal_matrix((simd_double4){ positionVariance, positionVariance, speedDeviation * speedDeviation, speedDeviation * speedDeviation });
+	_timestamp	= sample->timestamp;
+	_hasState	= YES;
+}
+
+/**
+ * Move the state on with constant velocity. The uncertainty grows by a white noise acceleration.
+ *
+ */
+- (void)predictToTime:(NSTimeInterval)time
+{
+	double dt = time - _timestamp;
+	if (dt <= 0.0)
+		return;
+	
+	double dt2 = dt * dt;
+	double dt3 = dt2 * dt;
+	
+	simd_double4x4 transition = simd_matrix((simd_double4){ 1.0, 0.0, 0.0, 0.0 },
+											(simd_double4){ 0.0, 1.0, 0.0, 0.0 },
+											(simd_double4){ dt, 0.0, 1.0, 0.0 },
+											(simd_double4){ 0.0, dt, 0.0, 1.0 });
+	
+	simd_double4x4 noise = simd_matrix((simd_double4){ dt3 / 3.0, 0.0, dt2 / 2.0, 0.0 },
+									   (simd_double4){ 0.0, dt3 / 3.0, 0.0, dt2 / 2.0 },
+									   (simd_double4){ dt2 / 2.0, 0.0, dt, 0.0 },
+									   (simd_double4){ 0.0, dt2 / 2.0, 0.0, dt });
+	
+	_state		= simd_mul(transition, _state);
+	_covariance	= simd_add(simd_mul(simd_mul(transition, _covariance), simd_transpose(transition)), simd_mul(_processNoise, noise));
+	_timestamp	= time;
+}
+
+/**
+ * Correct the state by the measured position, whose variance is given by the accuracy of the sample.
+ *
+ */
+- (void)correctWithSample:(const DMLocationSample*)sample
+{
+	double variance				= sample->horizontalAccuracy * sample->horizontalAccuracy;
+	simd_double2 measurement	= DMLocationSmootherProject(&_origin, sample->latitude, sample->longitude);
+	
+	// Only the position is observed
+	simd_double4x2 observation	= simd_matrix((simd_double2){ 1.0, 0.0 }, (simd_double2){ 0.0, 1.0 }, (simd_double2){ 0.0, 0.0 }, (simd_double2){ 0.0, 0.0 });
+	
+	simd_double2x4 crossCovariance		= simd_mul(_covariance, simd_transpose(observation));
+	simd_double2x2 innovationCovariance	= simd_add(simd_mul(observation, crossCovariance), simd_diagonal_matrix((simd_double2){ variance, variance }));
+	simd_double2x4 gain					= simd_mul(crossCovariance, simd_inverse(innovationCovariance));
+	
+	_state = _state + simd_mul(gain, measurement - _state.xy);
+	
+	// Keep the covariance symmetric against rounding
+	simd_double4x4 covariance	= simd_sub(_covariance, simd_mul(gain, simd_mul(observation, _covariance)));
+	_covariance					= simd_linear_combination(0.5, covariance, 0.5, simd_transpose(covariance));
+}
+
+/**
+ * Move the origin to the estimate once it is far, the frame is flat only around the origin.
+ *
+ */
+- (void)moveOriginIfNeeded
+{
+	if (simd_length(_state.xy) < DM_LOCATION_SMOOTHER_ORIGIN_DISTANCE)
+		return;
+	
+	CLLocationCoordinate2D coordinate = [self coordinateOfPosition: _state.xy];
+	
+	_origin.latitude	= coordinate.latitude;
+	_origin.longitude	= coordinate.longitude;
+	_state.xy			= (simd_double2){ 0.0, 0.0 };
+}
+
+- (CLLocationCoordinate2D)coordinateOfPosition:(simd_double2)position
+{
+	double scale = DMLocationSmootherMetersPerDegree();
+	
+	return CLLocationCoordinate2DMake(_origin.latitude + position.y / scale, _origin.longitude + position.x / (scale * MAX(cos(_origin.latitude * M_PI / 180.0), 1e-6)));
+}
+
+@end
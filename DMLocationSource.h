@@ -0,0 +1,192 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ * A location source delivers the raw locations the DMLocationManager filters and passes to its delegates.
+ * By default it uses core location, other sources replay traces or generate locations, e.g. to test without a device:
+ *
+ *		DMSyntheticLocationSource* source = [[DMSyntheticLocationSource alloc] initWithCoordinate:coordinate];
+ *		source.speed					  = 10.0;
+ *		locationManager.locationSource	  = source;
+ *
+ * A source may inform its delegate on any thread. Methods of a source are invoked on the thread of the DMLocationManager engine.
+ */
+
+@protocol DMLocationSourceDelegate;
+
+#pragma mark -
+#pragma mark DMLocationSource
+
+@protocol DMLocationSource <NSObject>
+
+/**
+ * The delegate to inform about locations. Not retained.
+ */
+@property (nonatomic, assign)			id<DMLocationSourceDelegate>	delegate;
+
+/**
+ * The accuracy and the distance filter the source should aim for, like the ones of CLLocationManager.
+ */
+@property (nonatomic, assign)			CLLocationAccuracy				desiredAccuracy;
+@property (nonatomic, assign)			CLLocationDistance				distanceFilter;
+
+/**
+ * Start and stop delivering locations.
+ */
+- (void)startUpdatingLocation;
+- (void)stopUpdatingLocation;
+
+@optional
+
+/**
+ * Deliver locations only on significant changes with little energy, used in background. Only used if available.
+ */
+- (BOOL)significantLocationChangeMonitoringAvailable;
+- (void)startMonitoringSignificantLocationChanges;
+- (void)stopMonitoringSignificantLocationChanges;
+
+/**
+ * Collect the locations and deliver them at once after the distance or timeout, used while batching. Only used if available.
+ */
+- (BOOL)deferredLocationUpdatesAvailable;
+- (void)allowDeferredLocationUpdatesUntilTraveled:(CLLocationDistance)distance timeout:(NSTimeInterval)timeout;
+- (void)disallowDeferredLocationUpdates;
+
+/**
+ * Monitor the regions natively with little energy, also while the app is suspended, used for the nearest geofences. Only used if available.
+ */
+- (BOOL)regionMonitoringAvailable;
+- (CLLocationDistance)maximumRegionMonitoringDistance;
+- (void)startMonitoringForRegion:(CLRegion*)region;
+- (void)stopMonitoringForRegion:(CLRegion*)region;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationSourceDelegate
+
+@protocol DMLocationSourceDelegate <NSObject>
+
+/**
+ * Invoked for every raw location the source determined.
+ */
+- (void)locationSource:(id<DMLocationSource>)source didUpdateLocation:(CLLocation*)location;
+
+/**
+ * Invoked if the source could not determine a location.
+ */
+- (void)locationSource:(id<DMLocationSource>)source didFailWithError:(NSError*)error;
+
+@optional
+
+/**
+ * Invoked when the source stopped deferring the updates.
+ */
+- (void)locationSource:(id<DMLocationSource>)source didFinishDeferredUpdatesWithError:(NSError*)error;
+
+/**
+ * Invoked when a monitored region was entered or exited.
+ */
+- (void)locationSource:(id<DMLocationSource>)source didEnterRegion:(CLRegion*)region;
+- (void)locationSource:(id<DMLocationSource>)source didExitRegion:(CLRegion*)region;
+
+/**
+ * Invoked if the source has no more locations, e.g. at the end of a trace.
+ */
+- (void)locationSourceDidFinish:(id<DMLocationSource>)source;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMCoreLocationSource
+
+/**
+ * The source of core location. Core location informs on the run loop of the thread the source was created on.
+ */
+@interface DMCoreLocationSource : NSObject <DMLocationSource, CLLocationManagerDelegate>
+{
+@private
+	CLLocationManager*				_locationManager;
+	id<DMLocationSourceDelegate>	_delegate;
+}
+
+/**
+ * The core location manager of the source.
+ */
+@property (nonatomic, retain, readonly) CLLocationManager*				locationManager;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMSyntheticLocationSource
+
+/**
+ * Generates locations moving with constant speed and course, e.g. to test the filters, timers and delegates headlessly.
+ * Started it delivers a location every 'updateInterval' on a private queue. To drive tests at high rates generate locations directly.
+ */
+@interface DMSyntheticLocationSource : NSObject <DMLocationSource>
+{
+@private
+	id<DMLocationSourceDelegate>	_delegate;
+	CLLocationAccuracy				_desiredAccuracy;
+	CLLocationDistance				_distanceFilter;
+	CLLocationCoordinate2D			_coordinate;
+	CLLocationSpeed					_speed;
+	CLLocationDirection				_course;
+	CLLocationAccuracy				_horizontalAccuracy;
+	NSTimeInterval					_updateInterval;
+	dispatch_queue_t				_queue;
+	dispatch_source_t				_timer;
+}
+
+/**
+ * The coordinate of the next location.
+ */
+@property (nonatomic, assign)			CLLocationCoordinate2D			coordinate;
+
+/**
+ * The speed in meters per second and the course in degrees the locations move with. Default is 0 and 0.
+ */
+@property (nonatomic, assign)			CLLocationSpeed					speed;
+@property (nonatomic, assign)			CLLocationDirection				course;
+
+/**
+ * The accuracy of the locations. Default is kCLLocationAccuracyNearestTenMeters.
+ */
+@property (nonatomic, assign)			CLLocationAccuracy				horizontalAccuracy;
+
+/**
+ * Seconds between two locations, it also defines how far they are apart. Default is 1.
+ */
+@property (nonatomic, assign)			NSTimeInterval					updateInterval;
+
+/**
+ * Start the locations at the coordinate.
+ */
+- (id)initWithCoordinate:(CLLocationCoordinate2D)coordinate;
+
+/**
+ * Deliver the amount of locations at once on the private queue and wait for it, regardless whether the source is started.
+ */
+- (void)generateLocations:(NSUInteger)count;
+
+@end
@@ -0,0 +1,333 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationSource.h"
+
+#define DM_LOCATION_SOURCE_EARTH_RADIUS		6371008.8
+
+
+#pragma mark -
+#pragma mark DMCoreLocationSource
+
+@implementation DMCoreLocationSource
+
+@synthesize locationManager	= _locationManager;
+@synthesize delegate		= _delegate;
+@dynamic	desiredAccuracy;
+@dynamic	distanceFilter;
+
+- (id)init
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_locationManager			= [CLLocationManager new];
+		_locationManager.delegate	= self;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	_locationManager.delegate = nil;
+	[_locationManager release];
+
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark DMLocationSource
+
+- (void)setDesiredAccuracy:(CLLocationAccuracy)desiredAccuracy
+{
+	_locationManager.desiredAccuracy = desiredAccuracy;
+}
+
+- (CLLocationAccuracy)desiredAccuracy
+{
+	return _locationManager.desiredAccuracy;
+}
+
+- (void)setDistanceFilter:(CLLocationDistance)distanceFilter
+{
+	_locationManager.distanceFilter = distanceFilter;
+}
+
+- (CLLocationDistance)distanceFilter
+{
+	return _locationManager.distanceFilter;
+}
+
+- (void)startUpdatingLocation
+{
+	[_locationManager startUpdatingLocation];
+}
+
+- (void)stopUpdatingLocation
+{
+	[_locationManager stopUpdatingLocation];
+}
+
+- (BOOL)significantLocationChangeMonitoringAvailable
+{
+	return [CLLocationManager significantLocationChangeMonitoringAvailable];
+}
+
+- (void)startMonitoringSignificantLocationChanges
+{
+	[_locationManager startMonitoringSignificantLocationChanges];
+}
+
+- (void)stopMonitoringSignificantLocationChanges
+{
+	[_locationManager stopMonitoringSignificantLocationChanges];
+}
+
+- (BOOL)deferredLocationUpdatesAvailable
+{
+	return [CLLocationManager deferredLocationUpdatesAvailable];
+}
+
+- (void)allowDeferredLocationUpdatesUntilTraveled:(CLLocationDistance)distance timeout:(NSTimeInterval)timeout
+{
+	[_locationManager allowDeferredLocationUpdatesUntilTraveled: distance timeout: timeout];
+}
+
+- (void)disallowDeferredLocationUpdates
+{
+	[_locationManager disallowDeferredLocationUpdates];
+}
+
+- (BOOL)regionMonitoringAvailable
+{
+	return [CLLocationManager isMonitoringAvailableForClass: [CLCircularRegion class]];
+}
+
+- (CLLocationDistance)maximumRegionMonitoringDistance
+{
+	return _locationManager.maximumRegionMonitoringDistance;
+}
+
+- (void)startMonitoringForRegion:(CLRegion*)region
+{
+	[_locationManager startMonitoringForRegion: region];
+}
+
+- (void)stopMonitoringForRegion:(CLRegion*)region
+{
+	[_locationManager stopMonitoringForRegion: region];
+}
+
+
+#pragma mark -
+#pragma mark CLLocationManagerDelegate
+
+- (void)locationManager:(CLLocationManager*)manager
+	 didUpdateToLocation:(CLLocation*)newLocation
+		    fromLocation:(CLLocation*)oldLocation
+{
+	[_delegate locationSource: self didUpdateLocation: newLocation];
+}
+
+/**
+ * Invoked instead of locationManager:didUpdateToLocation:fromLocation: since iOS 6. Possibly several deferred locations are delivered at once.
+ *
+ */
+- (void)locationManager:(CLLocationManager*)manager
+	  didUpdateLocations:(NSArray*)locations
+{
+	for (CLLocation* location in locations)
+	{
+		[_delegate locationSource: self didUpdateLocation: location];
+	}
+}
+
+- (void)locationManager:(CLLocationManager*)manager
+didFinishDeferredUpdatesWithError:(NSError*)error
+{
+	if ([_delegate respondsToSelector: @selector(locationSource:didFinishDeferredUpdatesWithError:)])
+		[_delegate locationSource: self didFinishDeferredUpdatesWithError: error];
+}
+
+- (void)locationManager:(CLLocationManager*)manager
+	    didFailWithError:(NSError*)error
+{
+	[_delegate locationSource: self didFailWithError: error];
+}
+
+- (void)locationManager:(CLLocationManager*)manager
+		  didEnterRegion:(CLRegion*)region
+{
+	if ([_delegate respondsToSelector: @selector(locationSource:didEnterRegion:)])
+		[_delegate locationSource: self didEnterRegion: region];
+}
+
+- (void)locationManager:(CLLocationManager*)manager
+		   didExitRegion:(CLRegion*)region
+{
+	if ([_delegate respondsToSelector: @selector(locationSource:didExitRegion:)])
+		[_delegate locationSource: self didExitRegion: region];
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMSyntheticLocationSource
+
+@interface DMSyntheticLocationSource (private)
+- (void)deliverLocation;
+@end
+
+@implementation DMSyntheticLocationSource
+
+@synthesize delegate			= _delegate;
+@synthesize desiredAccuracy		= _desiredAccuracy;
+@synthesize distanceFilter		= _distanceFilter;
+@synthesize speed				= _speed;
+@synthesize course				= _course;
+@synthesize horizontalAccuracy	= _horizontalAccuracy;
+@synthesize updateInterval		= _updateInterval;
+@dynamic	coordinate;
+
+- (id)init
+{
+	return [self initWithCoordinate: CLLocationCoordinate2DMake(0.0, 0.0)];
+}
+
+- (id)initWithCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_coordinate			= coordinate;
+		_desiredAccuracy	= kCLLocationAccuracyBest;
+		_distanceFilter		= kCLDistanceFilterNone;
+		_speed				= 0.0;
+		_course				= 0.0;
+		_horizontalAccuracy	= kCLLocationAccuracyNearestTenMeters;
+		_updateInterval		= 1.0;
+		_queue				= dispatch_queue_create("de.devmob.DMSyntheticLocationSource", DISPATCH_QUEUE_SERIAL);
+		_timer				= NULL;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	if (_timer)
+	{
+		dispatch_source_cancel(_timer);
+		dispatch_release(_timer);
+	}
+
+	dispatch_release(_queue);
+
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark DMLocationSource
+
+- (void)startUpdatingLocation
+{
+	dispatch_sync(_queue, ^{
+		if (_timer)
+			return;
+
+		__block DMSyntheticLocationSource* blockSelf = self;
+
+		_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+		dispatch_source_set_event_handler(_timer, ^{
+			[blockSelf deliverLocation];
+		});
+		dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, 0), (uint64_t)(MAX(_updateInterval, 0.001) * NSEC_PER_SEC), 0);
+		dispatch_resume(_timer);
+	});
+}
+
+- (void)stopUpdatingLocation
+{
+	dispatch_sync(_queue, ^{
+		if (NULL == _timer)
+			return;
+
+		dispatch_source_cancel(_timer);
+		dispatch_release(_timer);
+		_timer = NULL;
+	});
+}
+
+
+#pragma mark -
+#pragma mark Generating
+
+- (void)generateLocations:(NSUInteger)count
+{
+	dispatch_sync(_queue, ^{
+		for (NSUInteger i = 0; i < count; i++)
+		{
+			[self deliverLocation];
+		}
+	});
+}
+
+/**
+ * Deliver a location at the coordinate and move the coordinate on by the distance of one interval.
+ *
+ */
+- (void)deliverLocation
+{
+	CLLocation* location = [[CLLocation alloc] initWithCoordinate: _coordinate
+														 altitude: 0.0
+											   horizontalAccuracy: _horizontalAccuracy
+												 verticalAccuracy: -1.0
+														   course: _course
+															speed: _speed
+														timestamp: [NSDate date]];
+
+	[_delegate locationSource: self didUpdateLocation: location];
+	[location release];
+
+	double distance			= _speed * _updateInterval / DM_LOCATION_SOURCE_EARTH_RADIUS;
+	double course			= _course * M_PI / 180.0;
+	_coordinate.latitude	+= distance * cos(course) * 180.0 / M_PI;
+	_coordinate.longitude	+= distance * sin(course) * 180.0 / M_PI / MAX(cos(_coordinate.latitude * M_PI / 180.0), 1e-6);
+}
+
+- (void)setCoordinate:(CLLocationCoordinate2D)coordinate
+{
+	dispatch_sync(_queue, ^{
+		_coordinate = coordinate;
+	});
+}
+
+- (CLLocationCoordinate2D)coordinate
+{
+	__block CLLocationCoordinate2D coordinate;
+
+	dispatch_sync(_queue, ^{
+		coordinate = _coordinate;
+	});
+
+	return coordinate;
+}
+
+@end
@@ -0,0 +1,175 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+#import "DMLocationSource.h"
+
+/**
+ * A trace is an append-only binary file of raw locations, e.g. to reproduce issues from the field or to test deterministically.
+ * The values are quantized and written as delta of the previous location in variable length, most locations take about 15 bytes.
+ * Every recording starts with a key location, so several recordings can be appended to the same file.
+ *
+ *		DMLocationTraceRecorder* recorder = [[DMLocationTraceRecorder alloc] initWithPath:path];
+ *		[recorder recordLocation:location];
+ *
+ * The replayer maps the file and delivers the locations with their original intervals, optionally accelerated:
+ *
+ *		DMLocationTraceReplayer* replayer = [[DMLocationTraceReplayer alloc] initWithPath:path];
+ *		[replayer startWithSpeed:10.0 handler:^(CLLocation* location) {
+ *		} completion:nil];
+ *
+ * To feed a trace through the DMLocationManager use it as location source:
+ *
+ *		locationManager.locationSource = [[[DMLocationTraceSource alloc] initWithPath:path speed:10.0] autorelease];
+ *
+ * Precision of the trace: 1e-7 degrees for coordinates and course in 1/100 degrees, centimeters for altitude, accuracies and speed,
+ * milliseconds for the timestamp.
+ */
+
+#pragma mark -
+#pragma mark DMLocationTraceRecorder
+
+@interface DMLocationTraceRecorder : NSObject
+{
+@private
+	NSString*			_path;
+	int					_fileDescriptor;
+	int64_t				_previous[8];		// Quantized values of the previous location
+	NSUInteger			_recordsSinceKey;
+	NSUInteger			_count;
+}
+
+/**
+ * The path of the trace file.
+ */
+@property (nonatomic, retain, readonly) NSString*						path;
+
+/**
+ * The amount of locations recorded by this recorder.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						count;
+
+/**
+ * Open the trace file at the path for appending. It is created if it does not exist or is no trace.
+ */
+- (id)initWithPath:(NSString*)path;
+
+/**
+ * Append the location to the trace. Every location is written immediately, so the trace survives a crash.
+ */
+- (BOOL)recordLocation:(CLLocation*)location;
+
+/**
+ * Close the file, further locations are not recorded.
+ */
+- (void)close;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationTraceReplayer
+
+@interface DMLocationTraceReplayer : NSObject
+{
+@private
+	NSString*			_path;
+	const uint8_t*		_map;				// Memory-mapped trace, NULL if it could not be mapped
+	size_t				_mapLength;
+	size_t				_offset;			// Offset of the next location to decode
+	int64_t				_current[8];		// Quantized values of the last decoded location
+	dispatch_queue_t	_queue;
+	dispatch_source_t	_timer;
+	void				(^_handler)(CLLocation* location);
+	void				(^_completion)(void);
+	double				_speed;
+	NSTimeInterval		_replayTime;		// Virtual timestamp of the current location, since 1970
+	NSTimeInterval		_recordedTime;		// Recorded timestamp of the current location
+	NSUInteger			_generation;		// Incremented by starting and stopping, so outdated deliveries stop
+	NSUInteger			_count;
+	BOOL				_isReplaying;
+}
+
+/**
+ * The path of the trace file.
+ */
+@property (nonatomic, retain, readonly) NSString*						path;
+
+/**
+ * The amount of locations delivered since the start.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						count;
+
+/**
+ * Returns whether the locations are being delivered.
+ */
+@property (nonatomic, assign, readonly) BOOL							isReplaying;
+
+/**
+ * Map the trace file at the path. Returns nil if the file is no trace.
+ */
+- (id)initWithPath:(NSString*)path;
+
+/**
+ * Deliver the locations of the trace on a private queue from the beginning. A speed of 1.0 keeps the original intervals,
+ * higher speeds shorten them and 0 delivers as fast as possible. The timestamps of the locations run in virtual time:
+ * the first one is stamped with the start and every following one keeps its recorded interval, regardless of the speed.
+ * Filters and smoothing see the original motion and the replay is deterministic. Going back in time, e.g. between appended
+ * recordings, counts as no interval. At speeds other than 1.0 the timestamps drift from the clock, so checks of the age
+ * like 'cacheAge' of the DMLocationManager with 'useCache' NO reject them after a while.
+ * The completion is invoked after the last location unless the replay is stopped.
+ */
+- (void)startWithSpeed:(double)speed handler:(void (^)(CLLocation* location))handler completion:(void (^)(void))completion;
+
+/**
+ * Stop delivering. Returns after a running delivery finished, so the handler and completion are not invoked anymore afterwards.
+ */
+- (void)stop;
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationTraceSource
+
+/**
+ * A location source replaying a trace. The replay starts with the first start of updating and continues while updating is stopped,
+ * like the world goes on while core location is stopped, only the locations are not delivered meanwhile.
+ */
+@interface DMLocationTraceSource : NSObject <DMLocationSource>
+{
+@private
+	DMLocationTraceReplayer*		_replayer;
+	id<DMLocationSourceDelegate>	_delegate;
+	CLLocationAccuracy				_desiredAccuracy;
+	CLLocationDistance				_distanceFilter;
+	double							_speed;
+	BOOL							_hasStarted;
+	BOOL							_isUpdating;
+}
+
+/**
+ * The replayer of the trace.
+ */
+@property (nonatomic, retain, readonly) DMLocationTraceReplayer*		replayer;
+
+/**
+ * Replay the trace file at the path with the speed, see startWithSpeed:handler:completion:. Returns nil if the file is no trace.
+ */
+- (id)initWithPath:(NSString*)path speed:(double)speed;
+
+@end
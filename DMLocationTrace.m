@@ -0,0 +1,596 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationTrace.h"
+#import "DMLocationManager.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DM_LOCATION_TRACE_MAGIC				0x544C4D44	// 'DMLT'
+#define DM_LOCATION_TRACE_VERSION			1
+#define DM_LOCATION_TRACE_HEADER_LENGTH		8
+
+// Tags of the records, a key record holds absolute values
+#define DM_LOCATION_TRACE_TAG_KEY			0x4B
+#define DM_LOCATION_TRACE_TAG_DELTA			0x44
+
+static char DMLocationTraceReplayerQueueKey;
+
+// Every amount of records a key record is written, so a damaged record does not spoil the rest of the trace
+#define DM_LOCATION_TRACE_KEY_INTERVAL		256
+
+#define DM_LOCATION_TRACE_FIELD_COUNT		8
+#define DM_LOCATION_TRACE_RECORD_LENGTH		(1 + DM_LOCATION_TRACE_FIELD_COUNT * 10)
+
+/**
+ * The fields of a record in the order they are written and the factors they are quantized with.
+ */
+typedef enum
+{
+	DMLocationTraceFieldLatitude = 0,
+	DMLocationTraceFieldLongitude,
+	DMLocationTraceFieldAltitude,
+	DMLocationTraceFieldHorizontalAccuracy,
+	DMLocationTraceFieldVerticalAccuracy,
+	DMLocationTraceFieldCourse,
+	DMLocationTraceFieldSpeed,
+	DMLocationTraceFieldTimestamp
+} DMLocationTraceField;
+
+static const double DMLocationTraceFieldFactors[DM_LOCATION_TRACE_FIELD_COUNT] = {1e7, 1e7, 100.0, 100.0, 100.0, 100.0, 100.0, 1000.0};
+
+static void DMLocationTraceQuantizeLocation(CLLocation* location, int64_t* values)
+{
+	double fields[DM_LOCATION_TRACE_FIELD_COUNT] =
+	{
+		location.coordinate.latitude,
+		location.coordinate.longitude,
+		location.altitude,
+		location.horizontalAccuracy,
+		location.verticalAccuracy,
+		location.course,
+		location.speed,
+		[location.timestamp timeIntervalSince1970]
+	};
+	
+	for (NSUInteger i = 0; i < DM_LOCATION_TRACE_FIELD_COUNT; i++)
+	{
+		values[i] = llround(fields[i] * DMLocationTraceFieldFactors[i]);
+	}
+}
+
+static double DMLocationTraceFieldValue(const int64_t* values, DMLocationTraceField field)
+{
+	return (double)values[field] / DMLocationTraceFieldFactors[field];
+}
+
+static size_t DMLocationTraceWriteVarint(uint8_t* buffer, int64_t value)
+{
+	// Zigzag maps small negative deltas to small unsigned values
+	uint64_t zigzag	= ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	size_t length	= 0;
+	
+	while (zigzag >= 0x80)
+	{
+		buffer[length++]	= (uint8_t)(zigzag | 0x80);
+		zigzag				>>= 7;
+	}
+	buffer[length++] = (uint8_t)zigzag;
+	
+	return length;
+}
+
+static BOOL DMLocationTraceReadVarint(const uint8_t* buffer, size_t length, size_t* offset, int64_t* value)
+{
+	uint64_t zigzag	= 0;
+	unsigned shift	= 0;
+	
+	while (*offset < length && shift < 64)
+	{
+		uint8_t byte = buffer[(*offset)++];
+		zigzag |= (uint64_t)(byte & 0x7F) << shift;
+		
+		if (0 == (byte & 0x80))
+		{
+			*value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			return YES;
+		}
+		
+		shift += 7;
+	}
+	
+	return NO;
+}
+
+
+#pragma mark -
+#pragma mark DMLocationTraceRecorder
+
+@implementation DMLocationTraceRecorder
+
+@synthesize path	= _path;
+@synthesize count	= _count;
+
+- (id)initWithPath:(NSString*)path
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_path				= [path copy];
+		_recordsSinceKey	= DM_LOCATION_TRACE_KEY_INTERVAL;
+		_count				= 0;
+		_fileDescriptor		= open([_path fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, 0600);
+		
+		if (_fileDescriptor < 0)
+		{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+			NSLog(@"DMLocationTraceRecorder could not open %@", _path);
+#endif
+			[self release];
+			return nil;
+		}
+		
+		// Start a new trace if the file is empty or no trace
+		uint32_t header[2]	= {0, 0};
+		BOOL isValid		= (sizeof(header) == pread(_fileDescriptor, header, sizeof(header), 0) && DM_LOCATION_TRACE_MAGIC == header[0] && DM_LOCATION_TRACE_VERSION == header[1]);
+		
+		if (NO == isValid)
+		{
+			header[0] = DM_LOCATION_TRACE_MAGIC;
+			header[1] = DM_LOCATION_TRACE_VERSION;
+			
+			if (0 != ftruncate(_fileDescriptor, 0) || sizeof(header) != write(_fileDescriptor, header, sizeof(header)))
+			{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+				NSLog(@"DMLocationTraceRecorder could not write %@", _path);
+#endif
+				[self release];
+				return nil;
+			}
+		}
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[self close];
+	
+	[_path release];
+	
+	[super dealloc];
+}
+
+- (BOOL)recordLocation:(CLLocation*)location
+{
+	if (_fileDescriptor < 0 || nil == location)
+		return NO;
+	
+	int64_t values[DM_LOCATION_TRACE_FIELD_COUNT];
+	uint8_t buffer[DM_LOCATION_TRACE_RECORD_LENGTH];
+	size_t length	= 0;
+	BOOL isKey		= (_recordsSinceKey >= DM_LOCATION_TRACE_KEY_INTERVAL);
+	
+	DMLocationTraceQuantizeLocation(location, values);
+	
+	buffer[length++] = isKey ? DM_LOCATION_TRACE_TAG_KEY : DM_LOCATION_TRACE_TAG_DELTA;
+	
+	for (NSUInteger i = 0; i < DM_LOCATION_TRACE_FIELD_COUNT; i++)
+	{
+		length		+= DMLocationTraceWriteVarint(buffer + length, isKey ? values[i] : values[i] - _previous[i]);
+		_previous[i] = values[i];
+	}
+	
+	// A partially written record would end the decoding, so it is cut off again
+	off_t offset	= lseek(_fileDescriptor, 0, SEEK_END);
+	size_t written	= 0;
+	
+	while (offset >= 0 && written < length)
+	{
+		ssize_t result = write(_fileDescriptor, buffer + written, length - written);
+		
+		if (result > 0)
+			written += (size_t)result;
+		else if (result < 0 && EINTR == errno)
+			continue;
+		else
+			break;
+	}
+	
+	if (written != length)
+	{
+		if (offset >= 0)
+			ftruncate(_fileDescriptor, offset);
+		
+		// The previous values are unknown to the trace now, continue with a key record
+		_recordsSinceKey = DM_LOCATION_TRACE_KEY_INTERVAL;
+		return NO;
+	}
+	
+	_recordsSinceKey = isKey ? 1 : _recordsSinceKey + 1;
+	_count++;
+	
+	return YES;
+}
+
+- (void)close
+{
+	if (_fileDescriptor >= 0)
+	{
+		close(_fileDescriptor);
+		_fileDescriptor = -1;
+	}
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationTraceReplayer
+
+@interface DMLocationTraceReplayer (private)
+- (BOOL)decodeNextLocation;
+- (CLLocation*)newCurrentLocation;
+- (void)replayCurrentLocation:(NSUInteger)generation;
+- (void)finishReplay:(NSUInteger)generation;
+- (NSUInteger)generation;
+- (void)performOnQueueAndWait:(dispatch_block_t)block;
+@end
+
+@implementation DMLocationTraceReplayer
+
+@synthesize path		= _path;
+@synthesize count		= _count;
+@synthesize isReplaying	= _isReplaying;
+
+- (id)initWithPath:(NSString*)path
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_path	= [path copy];
+		_map	= NULL;
+		
+		int fileDescriptor = open([_path fileSystemRepresentation], O_RDONLY);
+		struct stat status;
+		
+		if (fileDescriptor >= 0 && 0 == fstat(fileDescriptor, &status) && status.st_size >= DM_LOCATION_TRACE_HEADER_LENGTH)
+		{
+			_mapLength	= (size_t)status.st_size;
+			_map		= mmap(NULL, _mapLength, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+			
+			if (MAP_FAILED == _map)
+				_map = NULL;
+		}
+		
+		// The mapping stays valid after closing the file
+		if (fileDescriptor >= 0)
+			close(fileDescriptor);
+		
+		const uint32_t* header = (const uint32_t*)_map;
+		if (NULL == _map || DM_LOCATION_TRACE_MAGIC != header[0] || DM_LOCATION_TRACE_VERSION != header[1])
+		{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+			NSLog(@"DMLocationTraceReplayer could not map trace %@", _path);
+#endif
+			[self release];
+			return nil;
+		}
+		
+		_queue = dispatch_queue_create("de.devmob.DMLocationTraceReplayer", DISPATCH_QUEUE_SERIAL);
+		dispatch_queue_set_specific(_queue, &DMLocationTraceReplayerQueueKey, self, NULL);
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	// Wait for a running delivery, the timer handler does not retain the replayer
+	if (_queue)
+	{
+		[self performOnQueueAndWait: ^{
+			if (_timer)
+			{
+				dispatch_source_cancel(_timer);
+				dispatch_release(_timer);
+				_timer = NULL;
+			}
+		}];
+		
+		dispatch_queue_set_specific(_queue, &DMLocationTraceReplayerQueueKey, NULL, NULL);
+		dispatch_release(_queue);
+	}
+	
+	if (_map)
+		munmap((void*)_map, _mapLength);
+	
+	[_handler release];
+	[_completion release];
+	[_path release];
+	
+	[super dealloc];
+}
+
+
+#pragma mark -
+#pragma mark Decoding
+
+/**
+ * Decode the record at the offset into the current values. Returns NO at the end of the trace or if the record is damaged.
+ *
+ */
+- (BOOL)decodeNextLocation
+{
+	if (_offset >= _mapLength)
+		return NO;
+	
+	uint8_t tag = _map[_offset++];
+	if (DM_LOCATION_TRACE_TAG_KEY != tag && DM_LOCATION_TRACE_TAG_DELTA != tag)
+		return NO;
+	
+	int64_t values[DM_LOCATION_TRACE_FIELD_COUNT];
+	for (NSUInteger i = 0; i < DM_LOCATION_TRACE_FIELD_COUNT; i++)
+	{
+		if (NO == DMLocationTraceReadVarint(_map, _mapLength, &_offset, &values[i]))
+			return NO;
+	}
+	
+	for (NSUInteger i = 0; i < DM_LOCATION_TRACE_FIELD_COUNT; i++)
+	{
+		_current[i] = (DM_LOCATION_TRACE_TAG_KEY == tag) ? values[i] : _current[i] + values[i];
+	}
+	
+	return YES;
+}
+
+- (CLLocation*)newCurrentLocation
+{
+	CLLocationCoordinate2D coordinate = CLLocationCoordinate2DMake(DMLocationTraceFieldValue(_current, DMLocationTraceFieldLatitude), DMLocationTraceFieldValue(_current, DMLocationTraceFieldLongitude));
+	
+	return [[CLLocation alloc] initWithCoordinate: coordinate
+										 altitude: DMLocationTraceFieldValue(_current, DMLocationTraceFieldAltitude)
+							   horizontalAccuracy: DMLocationTraceFieldValue(_current, DMLocationTraceFieldHorizontalAccuracy)
+								 verticalAccuracy: DMLocationTraceFieldValue(_current, DMLocationTraceFieldVerticalAccuracy)
+										   course: DMLocationTraceFieldValue(_current, DMLocationTraceFieldCourse)
+											speed: DMLocationTraceFieldValue(_current, DMLocationTraceFieldSpeed)
+										timestamp: [NSDate dateWithTimeIntervalSince1970: _replayTime]];
+}
+
+
+#pragma mark -
+#pragma mark Replay
+
+- (void)startWithSpeed:(double)speed handler:(void (^)(CLLocation* location))handler completion:(void (^)(void))completion
+{
+	if (nil == handler)
+		return;
+	
+	NSUInteger generation = __atomic_add_fetch(&_generation, 1, __ATOMIC_RELAXED);
+	_isReplaying = YES;
+	
+	handler		= [handler copy];
+	completion	= [completion copy];
+	
+	dispatch_async(_queue, ^{
+		[_handler release];
+		[_completion release];
+		_handler	= handler;
+		_completion	= completion;
+		_speed		= MAX(speed, 0.0);
+		_offset		= DM_LOCATION_TRACE_HEADER_LENGTH;
+		_count		= 0;
+		
+		if (_timer)
+		{
+			dispatch_source_cancel(_timer);
+			dispatch_release(_timer);
+			_timer = NULL;
+		}
+		
+		if (_speed > 0.0)
+		{
+			__block DMLocationTraceReplayer* blockSelf = self;
+			
+			_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+			dispatch_source_set_event_handler(_timer, ^{
+				[blockSelf replayCurrentLocation: generation];
+			});
+			dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+			dispatch_resume(_timer);
+		}
+		
+		if (NO == [self decodeNextLocation])
+		{
+			[self finishReplay: generation];
+			return;
+		}
+		
+		_replayTime		= [[NSDate date] timeIntervalSince1970];
+		_recordedTime	= DMLocationTraceFieldValue(_current, DMLocationTraceFieldTimestamp);
+		
+		[self replayCurrentLocation: generation];
+	});
+}
+
+/**
+ * Deliver the decoded location and wait for the interval to the next one. Without speed deliver all at once.
+ *
+ */
+- (void)replayCurrentLocation:(NSUInteger)generation
+{
+	while (generation == [self generation])
+	{
+		// The handler may stop the replay, which releases it
+		void (^handler)(CLLocation* location) = [_handler retain];
+		CLLocation* location = [self newCurrentLocation];
+		handler(location);
+		[location release];
+		[handler release];
+		
+		_count++;
+		
+		if (NO == [self decodeNextLocation])
+		{
+			[self finishReplay: generation];
+			return;
+		}
+		
+		// The recorded interval advances the virtual time, the speed only the delivery
+		NSTimeInterval recordedTime		= DMLocationTraceFieldValue(_current, DMLocationTraceFieldTimestamp);
+		NSTimeInterval recordedInterval	= MAX(recordedTime - _recordedTime, 0.0);
+		
+		_replayTime		+= recordedInterval;
+		_recordedTime	= recordedTime;
+		
+		if (_speed > 0.0)
+		{
+			NSTimeInterval interval = recordedInterval / _speed;
+			
+			dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC)), DISPATCH_TIME_FOREVER, 0);
+			return;
+		}
+	}
+}
+
+- (void)finishReplay:(NSUInteger)generation
+{
+	if (generation != [self generation])
+		return;
+	
+	_isReplaying = NO;
+	
+	// The completion may stop the replay, which releases it
+	void (^completion)(void) = [_completion retain];
+	if (completion)
+		completion();
+	[completion release];
+	
+	if (generation != [self generation])
+		return;
+	
+	[_handler release];
+	[_completion release];
+	_handler	= nil;
+	_completion	= nil;
+}
+
+- (void)stop
+{
+	__atomic_add_fetch(&_generation, 1, __ATOMIC_RELAXED);
+	_isReplaying = NO;
+	
+	[self performOnQueueAndWait: ^{
+		if (_timer)
+		{
+			dispatch_source_cancel(_timer);
+			dispatch_release(_timer);
+			_timer = NULL;
+		}
+		
+		[_handler release];
+		[_completion release];
+		_handler	= nil;
+		_completion	= nil;
+	}];
+}
+
+- (NSUInteger)generation
+{
+	return __atomic_load_n(&_generation, __ATOMIC_RELAXED);
+}
+
+- (void)performOnQueueAndWait:(dispatch_block_t)block
+{
+	if (dispatch_get_specific(&DMLocationTraceReplayerQueueKey) == self)
+		block();
+	else
+		dispatch_sync(_queue, block);
+}
+
+@end
+
+
+#pragma mark -
+#pragma mark DMLocationTraceSource
+
+@implementation DMLocationTraceSource
+
+@synthesize replayer		= _replayer;
+@synthesize delegate		= _delegate;
+@synthesize desiredAccuracy	= _desiredAccuracy;
+@synthesize distanceFilter	= _distanceFilter;
+
+- (id)initWithPath:(NSString*)path speed:(double)speed
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_replayer = [[DMLocationTraceReplayer alloc] initWithPath: path];
+		if (nil == _replayer)
+		{
+			[self release];
+			return nil;
+		}
+		
+		_desiredAccuracy	= kCLLocationAccuracyBest;
+		_distanceFilter		= kCLDistanceFilterNone;
+		_speed				= speed;
+		_hasStarted			= NO;
+		_isUpdating			= NO;
+	}
+	
+	return self;
+}
+
+- (void)dealloc
+{
+	[_replayer stop];
+	[_replayer release];
+	
+	[super dealloc];
+}
+
+- (void)startUpdatingLocation
+{
+	__atomic_store_n(&_isUpdating, YES, __ATOMIC_RELAXED);
+	
+	if (YES == _hasStarted)
+		return;
+	
+	_hasStarted = YES;
+	
+	__block DMLocationTraceSource* blockSelf = self;
+	
+	[_replayer startWithSpeed: _speed handler: ^(CLLocation* location) {
+		if (__atomic_load_n(&blockSelf->_isUpdating, __ATOMIC_RELAXED))
+			[blockSelf->_delegate locationSource: blockSelf didUpdateLocation: location];
+	} completion: ^{
+		if ([blockSelf->_delegate respondsToSelector: @selector(locationSourceDidFinish:)])
+			[blockSelf->_delegate locationSourceDidFinish: blockSelf];
+	}];
+}
+
+- (void)stopUpdatingLocation
+{
+	__atomic_store_n(&_isUpdating, NO, __ATOMIC_RELAXED);
+}
+
+@end
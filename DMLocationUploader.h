@@ -0,0 +1,160 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "DMLocationManager.h"
+
+@class DMLocationHistory;
+
+/**
+ * The DMLocationUploader ships the recorded locations to a backend in few, small requests instead of one JSON request per location.
+ * It collects the new samples of the history of the DMLocationManager and seals them into segments after 'batchSize' samples
+ * or 'maximumAge' seconds. The segments are queued as files, so they survive the app being terminated, and are uploaded together
+ * by one POST request when a segment is sealed, the app changes between foreground and background or other traffic of the app
+ * keeps the radio on anyway. Failed uploads are retried with exponential backoff.
+ *
+ *		DMLocationUploader* uploader = [[DMLocationUploader alloc] initWithURL:url directory:[DMLocationUploader defaultDirectory]];
+ *		locationManager.uploader	 = uploader;
+ *
+ *		// Whenever the app sends own requests, the radio is on anyway
+ *		[uploader networkDidBecomeActive];
+ *
+ * The body of the request is the concatenation of segments, all integers are little endian base 128 varints:
+ *
+ *		segment		"DMLU", version 1 as byte, count of samples, samples
+ *		sample		time, latitude, longitude, accuracy, speed, course
+ *
+ * The time is in milliseconds since 1970, the coordinates in millionths of degrees, both as difference to the previous sample
+ * of the segment, the coordinates zigzag encoded. The accuracy in meters, the speed in decimeters per second and the course
+ * in degrees are absolute and increased by 1, 0 means invalid.
+ *
+ * The uploader is thread safe, it works on a private queue.
+ */
+
+#pragma mark -
+#pragma mark DMLocationUploader
+
+@interface DMLocationUploader : NSObject
+{
+@private
+	NSURL*				_URL;
+	NSString*			_directory;
+	NSDictionary*		_HTTPHeaders;
+	NSUInteger			_batchSize;
+	NSTimeInterval		_maximumAge;
+	NSUInteger			_maximumUploadLength;
+	NSUInteger			_maximumQueueLength;
+	NSTimeInterval		_minimumRetryInterval;
+	NSTimeInterval		_maximumRetryInterval;
+	
+	dispatch_queue_t	_queue;				// Serializes the samples, the queue and the uploads
+	NSURLSession*		_session;
+	
+	DMLocationSample*	_samples;			// Collected samples not sealed yet
+	NSUInteger			_sampleCount;
+	NSUInteger			_sampleCapacity;
+	NSTimeInterval		_lastTimestamp;		// Newest collected sample, monotonic
+	NSUInteger			_batchNumber;		// Incremented by sealing, so an outdated age check does nothing
+	
+	NSMutableArray*		_segments;			// File names of the queued segments, oldest first
+	NSUInteger			_queueLength;		// Bytes of the queued segments
+	uint64_t			_segmentNumber;
+	BOOL				_isUploading;
+	NSUInteger			_uploadingCount;	// Oldest segments sent by the running upload
+	NSUInteger			_failureCount;
+	NSTimeInterval		_retryTime;			// Monotonic time before which no upload is started
+	NSUInteger			_retryNumber;		// Incremented by each backoff, so an outdated retry does nothing
+}
+
+/**
+ * The URL the segments are posted to.
+ */
+@property (nonatomic, retain, readonly) NSURL*							URL;
+
+/**
+ * The directory the segments are queued in.
+ */
+@property (nonatomic, retain, readonly) NSString*						directory;
+
+/**
+ * Additional header fields of the requests, e.g. for authorization.
+ * Default is nil.
+ */
+@property (nonatomic, copy)				NSDictionary*					HTTPHeaders;
+
+/**
+ * The amount of samples sealed into a segment, which is uploaded right away.
+ * Default is 256.
+ */
+@property (nonatomic, assign)			NSUInteger						batchSize;
+
+/**
+ * Seconds after which collected samples are sealed and uploaded, even if less than 'batchSize'.
+ * Default is 900 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					maximumAge;
+
+/**
+ * Bytes of segments uploaded by one request at most. A larger segment is uploaded alone.
+ * Default is 64 kilobytes.
+ */
+@property (nonatomic, assign)			NSUInteger						maximumUploadLength;
+
+/**
+ * Bytes of segments the queue keeps at most, the oldest ones are dropped beyond.
+ * Default is 4 megabytes.
+ */
+@property (nonatomic, assign)			NSUInteger						maximumQueueLength;
+
+/**
+ * Seconds to wait after the first failed upload, doubled with each further failure up to the maximum.
+ * Default is 30 and 3600 seconds.
+ */
+@property (nonatomic, assign)			NSTimeInterval					minimumRetryInterval;
+@property (nonatomic, assign)			NSTimeInterval					maximumRetryInterval;
+
+/**
+ * The amount of segments waiting for upload.
+ */
+@property (nonatomic, assign, readonly) NSUInteger						queuedSegmentCount;
+
+/**
+ * Returns the directory in the application support directory used by default.
+ */
++ (NSString*)defaultDirectory;
+
+/**
+ * Create the uploader posting to the URL. The segments queued in the directory by a previous launch are uploaded as well.
+ */
+- (id)initWithURL:(NSURL*)URL directory:(NSString*)directory;
+
+/**
+ * Collect the samples of the history newer than the ones collected before. Invoked by the DMLocationManager for every recorded location.
+ */
+- (void)collectSamplesOfHistory:(DMLocationHistory*)history;
+
+/**
+ * Seal the collected samples and upload the queue, unless backing off.
+ */
+- (void)flush;
+
+/**
+ * Upload the queue while the radio is on anyway, e.g. because the app sends own requests, unless backing off. Does not seal the collected samples.
+ * The DMLocationManager invokes it after its reverse geocoding went to the network, other traffic of the app has to be reported by the app.
+ */
+- (void)networkDidBecomeActive;
+
+@end
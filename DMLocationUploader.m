@@ -0,0 +1,505 @@
+//
+// Copyright devmob (Martin Stolz) | devmob.de
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import "DMLocationUploader.h"
+#import "DMLocationHistory.h"
+
+#define DM_LOCATION_UPLOADER_VERSION			1
+#define DM_LOCATION_UPLOADER_EXTENSION			@"dmlu"
+
+static const uint8_t DMLocationUploaderMagic[4] = { 'D', 'M', 'L', 'U' };
+
+/**
+ * Append the integer as little endian base 128 varint.
+ */
+static void DMLocationUploaderAppendVarint(NSMutableData* data, uint64_t value)
+{
+	uint8_t bytes[10];
+	NSUInteger length = 0;
+
+	do
+	{
+		bytes[length] = (uint8_t)(value & 0x7F);
+		value >>= 7;
+
+		if (0 != value)
+			bytes[length] |= 0x80;
+
+		length++;
+	}
+	while (0 != value);
+
+	[data appendBytes: bytes length: length];
+}
+
+/**
+ * Append the signed integer zigzag encoded, so small negative differences stay small.
+ */
+static inline void DMLocationUploaderAppendSignedVarint(NSMutableData* data, int64_t value)
+{
+	DMLocationUploaderAppendVarint(data, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/**
+ * Returns the value increased by 1 in the unit, or 0 if it is invalid.
+ */
+static inline uint64_t DMLocationUploaderOptional(double value, double unit)
+{
+	return (value < 0.0) ? 0 : (uint64_t)llround(value / unit) + 1;
+}
+
+
+@interface DMLocationUploader (private)
+- (void)performAfter:(NSTimeInterval)interval block:(dispatch_block_t)block;
+- (void)restoreSegments;
+- (void)ensureSampleCapacity:(NSUInteger)capacity;
+- (void)sealSamples;
+- (NSData*)encodeSamples;
+- (void)enqueueSegment:(NSData*)segment;
+- (void)removeSegmentsInRange:(NSRange)range;
+- (void)upload;
+- (void)uploadDidFinishWithResponse:(NSURLResponse*)response error:(NSError*)error;
+- (void)backOff;
+@end
+
+@implementation DMLocationUploader
+
+@synthesize URL						= _URL;
+@synthesize directory				= _directory;
+@synthesize HTTPHeaders				= _HTTPHeaders;
+@synthesize batchSize				= _batchSize;
+@synthesize maximumAge				= _maximumAge;
+@synthesize maximumUploadLength		= _maximumUploadLength;
+@synthesize maximumQueueLength		= _maximumQueueLength;
+@synthesize minimumRetryInterval	= _minimumRetryInterval;
+@synthesize maximumRetryInterval	= _maximumRetryInterval;
+@dynamic	queuedSegmentCount;
+
++ (NSString*)defaultDirectory
+{
+	NSString* applicationSupportDirectory = [NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES) lastObject];
+
+	return [applicationSupportDirectory stringByAppendingPathComponent: @"DMLocationUploader"];
+}
+
+
+#pragma mark -
+#pragma mark Initialization
+
+- (id)initWithURL:(NSURL*)URL directory:(NSString*)directory
+{
+	self = [super init];
+	if (self != nil)
+	{
+		_URL					= [URL retain];
+		_directory				= [directory copy];
+		_HTTPHeaders			= nil;
+		_batchSize				= 256;
+		_maximumAge				= 900.0;
+		_maximumUploadLength	= 64 * 1024;
+		_maximumQueueLength		= 4 * 1024 * 1024;
+		_minimumRetryInterval	= 30.0;
+		_maximumRetryInterval	= 3600.0;
+
+		_queue					= dispatch_queue_create("de.devmob.DMLocationUploader", DISPATCH_QUEUE_SERIAL);
+		_session				= [[NSURLSession sessionWithConfiguration: [NSURLSessionConfiguration defaultSessionConfiguration]] retain];
+
+		_samples				= NULL;
+		_sampleCount			= 0;
+		_sampleCapacity			= 0;
+		_lastTimestamp			= -DBL_MAX;
+		_batchNumber			= 0;
+
+		_segments				= [NSMutableArray new];
+		_queueLength			= 0;
+		_segmentNumber			= 0;
+		_isUploading			= NO;
+		_uploadingCount			= 0;
+		_failureCount			= 0;
+		_retryTime				= 0.0;
+		_retryNumber			= 0;
+
+		dispatch_async(_queue, ^{
+			[self restoreSegments];
+			[self upload];
+		});
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[_session finishTasksAndInvalidate];
+	[_session release];
+
+	[_URL release];
+	[_directory release];
+	[_HTTPHeaders release];
+	[_segments release];
+
+	free(_samples);
+
+	dispatch_release(_queue);
+
+	[super dealloc];
+}
+
+/**
+ * Invoke the block on the queue after the interval. Like every block on the queue it retains the uploader until it ran,
+ * so the uploader is never freed while one is pending or running.
+ *
+ */
+- (void)performAfter:(NSTimeInterval)interval block:(dispatch_block_t)block
+{
+	dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MAX(interval, 0.0) * NSEC_PER_SEC)), _queue, block);
+}
+
+/**
+ * Queue the segments left by a previous launch, ordered by their number.
+ *
+ */
+- (void)restoreSegments
+{
+	NSFileManager* fileManager = [NSFileManager defaultManager];
+
+	[fileManager createDirectoryAtPath: _directory withIntermediateDirectories: YES attributes: nil error: NULL];
+
+	NSArray* names = [[fileManager contentsOfDirectoryAtPath: _directory error: NULL] sortedArrayUsingSelector: @selector(compare:)];
+
+	for (NSString* name in names)
+	{
+		if (NO == [[name pathExtension] isEqualToString: DM_LOCATION_UPLOADER_EXTENSION])
+			continue;
+
+		NSDictionary* attributes = [fileManager attributesOfItemAtPath: [_directory stringByAppendingPathComponent: name] error: NULL];
+
+		[_segments addObject: name];
+		_queueLength	+= (NSUInteger)[attributes fileSize];
+		_segmentNumber	= MAX(_segmentNumber, strtoull([[name stringByDeletingPathExtension] UTF8String], NULL, 10) + 1);
+	}
+}
+
+
+#pragma mark -
+#pragma mark Collecting
+
+- (void)collectSamplesOfHistory:(DMLocationHistory*)history
+{
+	dispatch_async(_queue, ^{
+		NSTimeInterval startTime	= nextafter(_lastTimestamp, DBL_MAX);
+		NSUInteger count			= [history countOfSamplesFromTime: startTime toTime: DBL_MAX];
+
+		if (0 == count)
+			return;
+
+		[self ensureSampleCapacity: _sampleCount + count];
+
+		count = [history getSamples: _samples + _sampleCount count: count fromTime: startTime toTime: DBL_MAX];
+		if (0 == count)
+			return;
+
+		// The age counts from the first sample waiting
+		if (0 == _sampleCount)
+		{
+			NSUInteger batchNumber = _batchNumber;
+
+			[self performAfter: _maximumAge block: ^{
+				if (batchNumber != _batchNumber)
+					return;
+
+				[self sealSamples];
+				[self upload];
+			}];
+		}
+
+		_sampleCount	+= count;
+		_lastTimestamp	= _samples[_sampleCount - 1].timestamp;
+
+		if (_sampleCount >= _batchSize)
+		{
+			[self sealSamples];
+			[self upload];
+		}
+	});
+}
+
+- (void)ensureSampleCapacity:(NSUInteger)capacity
+{
+	if (capacity <= _sampleCapacity)
+		return;
+
+	_sampleCapacity	= MAX(capacity, MAX(2 * _sampleCapacity, _batchSize));
+	_samples		= reallocf(_samples, _sampleCapacity * sizeof(DMLocationSample));
+}
+
+
+#pragma mark -
+#pragma mark Segments
+
+/**
+ * Encode the collected samples into a segment and queue it.
+ *
+ */
+- (void)sealSamples
+{
+	if (0 == _sampleCount)
+		return;
+
+	[self enqueueSegment: [self encodeSamples]];
+	_sampleCount = 0;
+	_batchNumber++;
+}
+
+/**
+ * Encode the samples as differences to the previous one. The monotonic timestamps are converted to the time since 1970.
+ * The monotonic time keeps running while the device sleeps, so one offset to the wall clock holds for the samples of the whole batch.
+ *
+ */
+- (NSData*)encodeSamples
+{
+	NSMutableData* data		= [NSMutableData dataWithCapacity: 16 + 12 * _sampleCount];
+	NSTimeInterval offset	= [[NSDate date] timeIntervalSince1970] - DMLocationManagerMonotonicTime();
+	uint8_t version			= DM_LOCATION_UPLOADER_VERSION;
+
+	int64_t time			= 0;
+	int64_t latitude		= 0;
+	int64_t longitude		= 0;
+
+	[data appendBytes: DMLocationUploaderMagic length: sizeof(DMLocationUploaderMagic)];
+	[data appendBytes: &version length: 1];
+	DMLocationUploaderAppendVarint(data, _sampleCount);
+
+	for (NSUInteger i = 0; i < _sampleCount; i++)
+	{
+		const DMLocationSample* sample = &_samples[i];
+
+		int64_t sampleTime		= llround((sample->timestamp + offset) * 1000.0);
+		int64_t sampleLatitude	= llround(sample->latitude * 1e6);
+		int64_t sampleLongitude	= llround(sample->longitude * 1e6);
+
+		DMLocationUploaderAppendVarint(data, (uint64_t)MAX(sampleTime - time, 0));
+		DMLocationUploaderAppendSignedVarint(data, sampleLatitude - latitude);
+		DMLocationUploaderAppendSignedVarint(data, sampleLongitude - longitude);
+		DMLocationUploaderAppendVarint(data, DMLocationUploaderOptional(sample->horizontalAccuracy, 1.0));
+		DMLocationUploaderAppendVarint(data, DMLocationUploaderOptional(sample->speed, 0.1));
+		DMLocationUploaderAppendVarint(data, DMLocationUploaderOptional(sample->course, 1.0));
+
+		time		= MAX(sampleTime, time);
+		latitude	= sampleLatitude;
+		longitude	= sampleLongitude;
+	}
+
+	return data;
+}
+
+/**
+ * Write the segment to the directory before it counts as queued. Beyond the maximum length the oldest segments are dropped.
+ *
+ */
+- (void)enqueueSegment:(NSData*)segment
+{
+	NSString* name = [NSString stringWithFormat: @"%020llu.%@", (unsigned long long)_segmentNumber++, DM_LOCATION_UPLOADER_EXTENSION];
+
+	if (NO == [segment writeToFile: [_directory stringByAppendingPathComponent: name] atomically: YES])
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationUploader could not write %@", name);
+#endif
+		return;
+	}
+
+	[_segments addObject: name];
+	_queueLength += [segment length];
+
+	// Never drop the segments being uploaded nor the new one
+	while (_queueLength > _maximumQueueLength && [_segments count] > _uploadingCount + 1)
+	{
+		[self removeSegmentsInRange: NSMakeRange(_uploadingCount, 1)];
+	}
+}
+
+/**
+ * Delete the files of the segments. Segments of the running upload which are removed do not count as being uploaded anymore.
+ *
+ */
+- (void)removeSegmentsInRange:(NSRange)range
+{
+	range = NSIntersectionRange(range, NSMakeRange(0, [_segments count]));
+
+	for (NSUInteger i = range.location; i < NSMaxRange(range); i++)
+	{
+		NSString* path				= [_directory stringByAppendingPathComponent: [_segments objectAtIndex: i]];
+		NSDictionary* attributes	= [[NSFileManager defaultManager] attributesOfItemAtPath: path error: NULL];
+
+		[[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+		_queueLength -= MIN((NSUInteger)[attributes fileSize], _queueLength);
+	}
+
+	[_segments removeObjectsInRange: range];
+
+	if (range.location < _uploadingCount)
+		_uploadingCount -= MIN(NSMaxRange(range), _uploadingCount) - range.location;
+}
+
+- (NSUInteger)queuedSegmentCount
+{
+	__block NSUInteger count = 0;
+
+	dispatch_sync(_queue, ^{
+		count = [_segments count];
+	});
+
+	return count;
+}
+
+
+#pragma mark -
+#pragma mark Uploading
+
+- (void)flush
+{
+	dispatch_async(_queue, ^{
+		[self sealSamples];
+		[self upload];
+	});
+}
+
+- (void)networkDidBecomeActive
+{
+	dispatch_async(_queue, ^{
+		[self upload];
+	});
+}
+
+/**
+ * Post the oldest segments up to the maximum length in one request, one at a time and not while backing off.
+ *
+ */
+- (void)upload
+{
+	if (YES == _isUploading || 0 == [_segments count] || nil == _URL || DMLocationManagerMonotonicTime() < _retryTime)
+		return;
+
+	NSMutableData* body	= [NSMutableData data];
+	NSUInteger count	= 0;
+
+	for (NSString* name in _segments)
+	{
+		NSData* segment = [NSData dataWithContentsOfFile: [_directory stringByAppendingPathComponent: name]];
+
+		if (0 < count && [body length] + [segment length] > _maximumUploadLength)
+			break;
+
+		if (nil != segment)
+			[body appendData: segment];
+
+		count++;
+	}
+
+	// The segments could not be read, there is nothing to retry
+	if (0 == [body length])
+	{
+		[self removeSegmentsInRange: NSMakeRange(0, count)];
+		return;
+	}
+
+	NSMutableURLRequest* request = [NSMutableURLRequest requestWithURL: _URL];
+
+	[request setHTTPMethod: @"POST"];
+	[request setValue: @"application/octet-stream" forHTTPHeaderField: @"Content-Type"];
+
+	for (NSString* field in _HTTPHeaders)
+	{
+		[request setValue: [_HTTPHeaders objectForKey: field] forHTTPHeaderField: field];
+	}
+
+	_isUploading	= YES;
+	_uploadingCount	= count;
+
+	NSURLSessionUploadTask* task = [_session uploadTaskWithRequest: request fromData: body completionHandler: ^(NSData* data, NSURLResponse* response, NSError* error) {
+		dispatch_async(_queue, ^{
+			[self uploadDidFinishWithResponse: response error: error];
+		});
+	}];
+
+	[task resume];
+}
+
+/**
+ * Remove the uploaded segments and go on with the next ones. Segments the server rejects would be rejected again, so they are dropped.
+ * Network errors, server errors and throttling are retried after backing off.
+ *
+ */
+- (void)uploadDidFinishWithResponse:(NSURLResponse*)response error:(NSError*)error
+{
+	NSUInteger count = _uploadingCount;
+
+	_isUploading	= NO;
+	_uploadingCount	= 0;
+
+	NSInteger statusCode = [response isKindOfClass: [NSHTTPURLResponse class]] ? [(NSHTTPURLResponse*)response statusCode] : 0;
+
+	if (nil == error && statusCode >= 200 && statusCode < 300)
+	{
+		_failureCount	= 0;
+		_retryTime		= 0.0;
+
+		[self removeSegmentsInRange: NSMakeRange(0, count)];
+		[self upload];
+		return;
+	}
+
+	if (nil == error && statusCode >= 400 && statusCode < 500 && 408 != statusCode && 429 != statusCode)
+	{
+#if	DM_LOCATION_MANAGER_LOG_LEVEL >= DM_LOCATION_MANAGER_LOG_LEVEL_ERROR
+		NSLog(@"DMLocationUploader dropped %lu segments rejected with status %ld", (unsigned long)count, (long)statusCode);
+#endif
+
+		[self removeSegmentsInRange: NSMakeRange(0, count)];
+		[self upload];
+		return;
+	}
+
+	[self backOff];
+}
+
+/**
+ * Wait twice as long after each failure, less a random part so many devices do not retry at once.
+ *
+ */
+- (void)backOff
+{
+	_failureCount++;
+
+	NSTimeInterval interval	= MIN(_minimumRetryInterval * pow(2.0, MIN(_failureCount - 1, 30)), _maximumRetryInterval);
+	interval				*= 0.5 + 0.5 * ((double)arc4random_uniform(1001) / 1000.0);
+
+	_retryTime = DMLocationManagerMonotonicTime() + interval;
+
+	NSUInteger retryNumber = ++_retryNumber;
+
+	[self performAfter: interval block: ^{
+		if (retryNumber != _retryNumber)
+			return;
+
+		// The block may run a moment before the monotonic retry time
+		_retryTime = 0.0;
+		[self upload];
+	}];
+}
+
+@end